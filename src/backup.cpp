@@ -0,0 +1,271 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef WIN32
+  #include <direct.h>
+#endif
+
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+#include <fstream>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "tools.h"
+#include "nbt.h"
+#include "chunk.h"
+#include "map.h"
+#include "chunkprovider.h"
+#include "config.h"
+#include "backup.h"
+
+namespace
+{
+
+bool makeDirectory(const std::string &path)
+{
+  struct stat stFileInfo;
+  if(stat(path.c_str(), &stFileInfo) == 0)
+    return true;
+
+#ifdef WIN32
+  return _mkdir(path.c_str()) == 0;
+#else
+  return mkdir(path.c_str(), 0755) == 0;
+#endif
+}
+
+bool copyFile(const std::string &from, const std::string &to)
+{
+  std::ifstream in(from.c_str(), std::ios::binary);
+  std::ofstream out(to.c_str(), std::ios::binary);
+  if(!in || !out)
+    return false;
+
+  out << in.rdbuf();
+  return out.good();
+}
+
+}
+
+Backup &Backup::get()
+{
+  static Backup instance;
+  return instance;
+}
+
+bool Backup::start()
+{
+  if(m_running)
+    return false;
+
+  std::string backupDirectory = Conf::get().sValue("backup_dir");
+
+  char name[32];
+  time_t now = time(NULL);
+  strftime(name, sizeof(name), "%Y%m%d-%H%M%S", localtime(&now));
+  m_directory = backupDirectory+"/"+name;
+
+  if(!makeDirectory(backupDirectory) || !makeDirectory(m_directory))
+  {
+    LOG("Unable to create backup directory "+m_directory);
+    return false;
+  }
+
+  if(!copyFile(Map::get().mapDirectory+"/level.dat", m_directory+"/level.dat") ||
+     !m_storage.init(m_directory))
+  {
+    LOG("Unable to write backup to "+m_directory);
+    return false;
+  }
+
+  // Chunks on disk, their files stay as they are until the chunk changes
+  std::vector<std::pair<int, int> > chunks;
+  Map::get().storage.listChunks(chunks);
+
+  m_chunks.clear();
+  for(unsigned int i = 0; i < chunks.size(); i++)
+  {
+    uint32 mapId;
+    Map::get().posToId(chunks[i].first, chunks[i].second, &mapId);
+    m_chunks.push_back(mapId);
+  }
+
+  // Snapshots still being saved, and changed chunks newer than those
+  std::vector<sChunk *> copies;
+  ChunkProvider::get().unsavedCopies(copies);
+  for(std::map<uint32, sChunk *>::iterator it = Map::get().maps.begin(); it != Map::get().maps.end(); ++it)
+  {
+    if(Map::get().mapChanged[it->first])
+      copies.push_back(it->second->clone());
+  }
+
+  for(unsigned int i = 0; i < copies.size(); i++)
+  {
+    uint32 mapId;
+    Map::get().posToId(copies[i]->x, copies[i]->z, &mapId);
+
+    if(m_copies.count(mapId))
+      delete m_copies[mapId];
+    else if(!Map::get().storage.hasChunk(copies[i]->x, copies[i]->z))
+      m_chunks.push_back(mapId);
+
+    m_copies[mapId] = copies[i];
+  }
+
+  m_remaining.clear();
+  m_remaining.insert(m_chunks.begin(), m_chunks.end());
+  m_finished = false;
+  m_written  = 0;
+  m_failed   = 0;
+
+  if(!m_thread.start(writer, this))
+  {
+    LOG("Unable to start backup thread");
+    for(std::map<uint32, sChunk *>::iterator it = m_copies.begin(); it != m_copies.end(); ++it)
+      delete it->second;
+    m_copies.clear();
+    m_storage.free();
+    return false;
+  }
+
+  m_running = true;
+  std::cout << "Backing up " << m_chunks.size() << " chunks to " << m_directory << std::endl;
+
+  return true;
+}
+
+void Backup::chunkChanging(sChunk *chunk)
+{
+  if(!m_running)
+    return;
+
+  uint32 mapId;
+  Map::get().posToId(chunk->x, chunk->z, &mapId);
+
+  MutexLock lock(m_mutex);
+
+  // Written already, or the backup has its own copy
+  if(!m_remaining.count(mapId) || m_copies.count(mapId))
+    return;
+
+  m_copies[mapId] = chunk->clone();
+}
+
+void Backup::writer(void *arg)
+{
+  Backup *backup = (Backup *)arg;
+
+  for(unsigned int i = 0; i < backup->m_chunks.size(); i++)
+  {
+    uint32 mapId = backup->m_chunks[i];
+    int x, z;
+    Map::get().idToPos(mapId, &x, &z);
+
+    sChunk *copy    = NULL;
+    NBT_Value *root = NULL;
+    {
+      MutexLock lock(backup->m_mutex);
+
+      std::map<uint32, sChunk *>::iterator it = backup->m_copies.find(mapId);
+      if(it != backup->m_copies.end())
+      {
+        copy = it->second;
+        backup->m_copies.erase(it);
+        backup->m_remaining.erase(mapId);
+      }
+    }
+
+    if(copy == NULL)
+    {
+      // Read without the lock, block changes on the main thread take it.
+      // The chunk stays remaining until read, a change meanwhile leaves a
+      // copy of the state before, which is used instead of what was read.
+      bool exists;
+      root = Map::get().storage.loadChunk(x, z, &exists);
+
+      MutexLock lock(backup->m_mutex);
+      backup->m_remaining.erase(mapId);
+
+      std::map<uint32, sChunk *>::iterator it = backup->m_copies.find(mapId);
+      if(it != backup->m_copies.end())
+      {
+        delete root;
+        root = NULL;
+        copy = it->second;
+        backup->m_copies.erase(it);
+      }
+    }
+
+    if(copy != NULL)
+    {
+      root = copy->toNBT();
+      delete copy;
+    }
+
+    if(root != NULL && backup->m_storage.saveChunk(x, z, root))
+      backup->m_written++;
+    else
+      backup->m_failed++;
+
+    delete root;
+  }
+
+  MutexLock lock(backup->m_mutex);
+  backup->m_finished = true;
+}
+
+void Backup::poll()
+{
+  if(!m_running)
+    return;
+
+  {
+    MutexLock lock(m_mutex);
+    if(!m_finished)
+      return;
+  }
+
+  m_thread.join();
+  m_storage.free();
+  m_running = false;
+
+  std::cout << "Backup to " << m_directory << " finished, " << m_written << " chunks";
+  if(m_failed)
+    std::cout << ", " << m_failed << " failed";
+  std::cout << std::endl;
+}
+
+void Backup::free()
+{
+  if(!m_running)
+    return;
+
+  m_thread.join();
+  poll();
+}
@@ -0,0 +1,96 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BACKUP_H
+#define _BACKUP_H
+
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include "tools.h"
+#include "thread.h"
+#include "regionfile.h"
+
+struct sChunk;
+
+// Consistent copy of the map taken while the server keeps running. Chunks
+// newer than their file are copied when the backup starts, every other
+// chunk just before it first changes. A thread writes these copies and the
+// untouched chunks read from the region files to
+// <backup_dir>/<date-time>/region.
+class Backup
+{
+public:
+  static Backup &get();
+
+  // False if a backup is running already or the directory can't be created
+  bool start();
+
+  bool isRunning() const
+  {
+    return m_running;
+  }
+
+  // Call before a loaded chunk changes
+  void chunkChanging(sChunk *chunk);
+
+  // Finishes a completed backup, call once per tick
+  void poll();
+
+  // Wait for a running backup
+  void free();
+
+private:
+  Backup() : m_running(false), m_finished(false), m_written(0), m_failed(0)
+  {
+  }
+
+  bool m_running;
+  std::string m_directory;
+  RegionStorage m_storage;
+  Thread m_thread;
+
+  // Chunks to write in order, the ones not read yet (a chunk being read
+  // stays until it is done) and copies of chunks whose file is not the
+  // state to back up
+  std::vector<uint32> m_chunks;
+  std::set<uint32> m_remaining;
+  std::map<uint32, sChunk *> m_copies;
+  Mutex m_mutex;
+
+  bool m_finished;
+  int m_written;
+  int m_failed;
+
+  static void writer(void *arg);
+
+  Backup(const Backup &);
+  Backup &operator=(const Backup &);
+};
+
+#endif
@@ -0,0 +1,602 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <string>
+#include <map>
+
+#include "logger.h"
+#include "tools.h"
+#include "nbt.h"
+#include "thread.h"
+#include "chunk.h"
+
+namespace
+{
+
+// Read TAG_Int coordinates x/y/z of a tile entity compound
+bool getEntityPos(NBT_Value *entity, sint32 *x, sint32 *y, sint32 *z)
+{
+  NBT_Value *xVal = (*entity)["x"];
+  NBT_Value *yVal = (*entity)["y"];
+  NBT_Value *zVal = (*entity)["z"];
+
+  if(xVal == NULL || yVal == NULL || zVal == NULL ||
+     xVal->GetType() != NBT_Value::TAG_INT ||
+     yVal->GetType() != NBT_Value::TAG_INT ||
+     zVal->GetType() != NBT_Value::TAG_INT)
+  {
+    return false;
+  }
+
+  *x = *xVal;
+  *y = *yVal;
+  *z = *zVal;
+  return true;
+}
+
+std::string getEntityId(NBT_Value *entity)
+{
+  NBT_Value *idVal = (*entity)["id"];
+  if(idVal == NULL || idVal->GetString() == NULL)
+    return std::string();
+  return *idVal->GetString();
+}
+
+// Header in front of every shared array
+struct SharedArray
+{
+  uint64 hash;
+  // Never reused, tells arrays apart that were allocated at the same address
+  uint64 serial;
+  uint32 size;
+  uint32 refs;
+  // Never freed
+  bool pinned;
+};
+
+enum { SHARED_HEADER_SIZE = 64 };
+
+SharedArray *header(const uint8 *bytes)
+{
+  return (SharedArray *)(bytes-SHARED_HEADER_SIZE);
+}
+
+uint64 hashArray(const uint8 *bytes, size_t len)
+{
+  uint64 hash = 14695981039346656037ULL ^ len;
+  for(size_t i = 0; i < len; i += 8)
+  {
+    uint64 word;
+    memcpy(&word, bytes+i, 8);
+    hash  = (hash ^ word)*1099511628211ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+// Section arrays shared by content between all chunks. Chunks are filled on
+// the worker threads too, so every access is locked.
+class ArrayStore
+{
+public:
+  uint8 *zeroBlocks;
+  uint8 *zeroNibbles;
+  uint8 *fullNibbles;
+
+  ArrayStore() : m_serial(0), m_bytes(0)
+  {
+    uint8 bytes[SECTION_BLOCKS_SIZE];
+
+    memset(bytes, 0, sizeof(bytes));
+    zeroBlocks  = intern(bytes, SECTION_BLOCKS_SIZE, true);
+    zeroNibbles = intern(bytes, SECTION_NIBBLES_SIZE, true);
+
+    memset(bytes, 0xff, sizeof(bytes));
+    fullNibbles = intern(bytes, SECTION_NIBBLES_SIZE, true);
+  }
+
+  // Shared array with the given content, the caller gets a reference
+  uint8 *intern(const uint8 *bytes, uint32 size, bool pinned = false)
+  {
+    uint64 hash = hashArray(bytes, size);
+
+    MutexLock lock(m_mutex);
+
+    std::pair<ArrayMap::iterator, ArrayMap::iterator> range = m_arrays.equal_range(hash);
+    for(ArrayMap::iterator it = range.first; it != range.second; ++it)
+    {
+      uint8 *shared = (uint8 *)it->second+SHARED_HEADER_SIZE;
+      if(it->second->size == size && memcmp(shared, bytes, size) == 0)
+      {
+        it->second->refs++;
+        return shared;
+      }
+    }
+
+    SharedArray *array = (SharedArray *)alignedAlloc(SHARED_HEADER_SIZE+size, 64);
+    if(array == NULL)
+    {
+      LOG("Out of memory (ArrayStore)");
+      exit(EXIT_FAILURE);
+    }
+    array->hash   = hash;
+    array->serial = m_serial++;
+    array->size   = size;
+    array->refs   = 1;
+    array->pinned = pinned;
+
+    uint8 *shared = (uint8 *)array+SHARED_HEADER_SIZE;
+    memcpy(shared, bytes, size);
+    m_arrays.insert(std::make_pair(hash, array));
+    if(!pinned)
+      m_bytes += SHARED_HEADER_SIZE+size;
+
+    return shared;
+  }
+
+  void retain(uint8 *bytes)
+  {
+    SharedArray *array = header(bytes);
+    if(array->pinned)
+      return;
+
+    MutexLock lock(m_mutex);
+    array->refs++;
+  }
+
+  void release(uint8 *bytes)
+  {
+    SharedArray *array = header(bytes);
+    if(array->pinned)
+      return;
+
+    MutexLock lock(m_mutex);
+    if(--array->refs > 0)
+      return;
+
+    std::pair<ArrayMap::iterator, ArrayMap::iterator> range = m_arrays.equal_range(array->hash);
+    for(ArrayMap::iterator it = range.first; it != range.second; ++it)
+    {
+      if(it->second == array)
+      {
+        m_arrays.erase(it);
+        break;
+      }
+    }
+    m_bytes -= SHARED_HEADER_SIZE+array->size;
+    alignedFree(array);
+  }
+
+  size_t bytes()
+  {
+    MutexLock lock(m_mutex);
+    return m_bytes;
+  }
+
+private:
+  typedef std::multimap<uint64, SharedArray *> ArrayMap;
+
+  Mutex m_mutex;
+  ArrayMap m_arrays;
+  uint64 m_serial;
+  size_t m_bytes;
+};
+
+ArrayStore arrayStore;
+
+uint8 *allocArray(size_t size)
+{
+  uint8 *array = (uint8 *)alignedAlloc(size, 64);
+  if(array == NULL)
+  {
+    LOG("Out of memory (sChunk)");
+    exit(EXIT_FAILURE);
+  }
+  return array;
+}
+
+// Copy a byte array tag into a chunk array, false if size does not match
+bool copyByteArray(NBT_Value *level, const char *name, sChunk *chunk, int array)
+{
+  NBT_Value *val = (*level)[name];
+  if(val == NULL)
+    return false;
+
+  size_t len = (array == CHUNK_BLOCKS) ? CHUNK_BLOCKS_SIZE : CHUNK_NIBBLES_SIZE;
+  std::vector<uint8> *bytes = val->GetByteArray();
+  if(bytes == NULL || bytes->size() != len)
+    return false;
+
+  chunk->setArray(array, &(*bytes)[0]);
+  return true;
+}
+
+}
+
+uint8 *sChunk::s_airBlocks = arrayStore.zeroBlocks;
+
+sChunk::sChunk(sint32 x, sint32 z) : x(x), z(z), lastUpdate(0), terrainPopulated(true), lightPopulated(false),
+                                     skySeeded(false), m_owned(0), m_bytes(sizeof(sChunk))
+{
+  memset(heightmap, 0, CHUNK_HEIGHTMAP_SIZE);
+
+  for(int section = 0; section < CHUNK_SECTIONS; section++)
+  {
+    sections[section][CHUNK_BLOCKS] = arrayStore.zeroBlocks;
+    for(int array = CHUNK_DATA; array < CHUNK_ARRAYS; array++)
+      sections[section][array] = arrayStore.zeroNibbles;
+  }
+}
+
+sChunk::~sChunk()
+{
+  clearEntities();
+
+  for(int section = 0; section < CHUNK_SECTIONS; section++)
+  {
+    for(int array = 0; array < CHUNK_ARRAYS; array++)
+    {
+      if(isOwned(section, array))
+        alignedFree(sections[section][array]);
+      else
+        arrayStore.release(sections[section][array]);
+    }
+  }
+}
+
+size_t sChunk::sharedMemoryUsage()
+{
+  return arrayStore.bytes();
+}
+
+void sChunk::expand(int section, int array)
+{
+  size_t size = arraySize(array);
+  uint8 *copy = allocArray(size);
+  memcpy(copy, sections[section][array], size);
+
+  arrayStore.release(sections[section][array]);
+  sections[section][array] = copy;
+  m_owned |= 1u << (section*CHUNK_ARRAYS+array);
+  m_bytes += size;
+}
+
+void sChunk::share(int section, int array, uint8 *shared)
+{
+  if(isOwned(section, array))
+  {
+    alignedFree(sections[section][array]);
+    m_owned &= ~(1u << (section*CHUNK_ARRAYS+array));
+    m_bytes -= arraySize(array);
+  }
+  else
+    arrayStore.release(sections[section][array]);
+
+  sections[section][array] = shared;
+}
+
+void sChunk::fillSection(int section, int array, uint8 value)
+{
+  if(value == 0)
+    share(section, array, (array == CHUNK_BLOCKS) ? arrayStore.zeroBlocks : arrayStore.zeroNibbles);
+  else if(value == 0xff && array != CHUNK_BLOCKS)
+    share(section, array, arrayStore.fullNibbles);
+  else
+  {
+    uint8 bytes[SECTION_BLOCKS_SIZE];
+    memset(bytes, value, arraySize(array));
+    share(section, array, arrayStore.intern(bytes, arraySize(array)));
+  }
+}
+
+void sChunk::getArray(int array, uint8 *dst) const
+{
+  // Each column of a section is a run of 16 blocks or 8 nibble bytes
+  int shift = (array == CHUNK_BLOCKS) ? 0 : 1;
+  int run   = 16 >> shift;
+
+  for(int section = 0; section < CHUNK_SECTIONS; section++)
+  {
+    const uint8 *src = sections[section][array];
+    for(int x = 0; x < 16; x++)
+    {
+      for(int z = 0; z < 16; z++)
+      {
+        memcpy(dst + ((section*16 + z*128 + x*2048) >> shift),
+               src + ((z*16 + x*256) >> shift), run);
+      }
+    }
+  }
+}
+
+void sChunk::setArray(int array, const uint8 *src)
+{
+  int shift = (array == CHUNK_BLOCKS) ? 0 : 1;
+  int run   = 16 >> shift;
+
+  uint8 bytes[SECTION_BLOCKS_SIZE];
+  for(int section = 0; section < CHUNK_SECTIONS; section++)
+  {
+    for(int x = 0; x < 16; x++)
+    {
+      for(int z = 0; z < 16; z++)
+      {
+        memcpy(bytes + ((z*16 + x*256) >> shift),
+               src + ((section*16 + z*128 + x*2048) >> shift), run);
+      }
+    }
+
+    share(section, array, arrayStore.intern(bytes, arraySize(array)));
+  }
+}
+
+void sChunk::gather(uint8 *payload) const
+{
+  getArray(CHUNK_BLOCKS, payload);
+  getArray(CHUNK_DATA, payload+CHUNK_BLOCKS_SIZE);
+  getArray(CHUNK_BLOCKLIGHT, payload+CHUNK_BLOCKS_SIZE+CHUNK_NIBBLES_SIZE);
+  getArray(CHUNK_SKYLIGHT, payload+CHUNK_BLOCKS_SIZE+2*CHUNK_NIBBLES_SIZE);
+}
+
+void sChunk::compact()
+{
+  for(int section = 0; section < CHUNK_SECTIONS; section++)
+  {
+    for(int array = 0; array < CHUNK_ARRAYS; array++)
+    {
+      if(isOwned(section, array))
+        share(section, array, arrayStore.intern(sections[section][array], arraySize(array)));
+    }
+  }
+}
+
+bool sChunk::signature(std::vector<uint64> &key) const
+{
+  if(m_owned)
+    return false;
+
+  key.resize(CHUNK_SECTIONS*CHUNK_ARRAYS);
+  for(int section = 0; section < CHUNK_SECTIONS; section++)
+  {
+    for(int array = 0; array < CHUNK_ARRAYS; array++)
+      key[section*CHUNK_ARRAYS+array] = header(sections[section][array])->serial;
+  }
+  return true;
+}
+
+void sChunk::clearEntities()
+{
+  for(unsigned int i = 0; i < tileEntities.size(); i++)
+    delete tileEntities[i].nbt;
+  tileEntities.clear();
+
+  for(unsigned int i = 0; i < entities.size(); i++)
+    delete entities[i].nbt;
+  entities.clear();
+}
+
+sTileEntity *sChunk::getTileEntity(sint32 x, sint32 y, sint32 z)
+{
+  for(unsigned int i = 0; i < tileEntities.size(); i++)
+  {
+    if(tileEntities[i].x == x && tileEntities[i].y == y && tileEntities[i].z == z)
+      return &tileEntities[i];
+  }
+  return NULL;
+}
+
+bool sChunk::setTileEntity(NBT_Value *entity)
+{
+  sTileEntity tile;
+
+  if(entity->GetType() != NBT_Value::TAG_COMPOUND ||
+     !getEntityPos(entity, &tile.x, &tile.y, &tile.z))
+  {
+    return false;
+  }
+
+  tile.id  = getEntityId(entity);
+  tile.nbt = entity;
+
+  sTileEntity *old = getTileEntity(tile.x, tile.y, tile.z);
+  if(old != NULL)
+  {
+    // Replace entity
+    if(old->nbt != entity)
+      delete old->nbt;
+    *old = tile;
+  }
+  else
+    tileEntities.push_back(tile);
+
+  return true;
+}
+
+bool sChunk::fromNBT(NBT_Value *root)
+{
+  NBT_Value *level = (*root)["Level"];
+  if(level == NULL)
+    return false;
+
+  NBT_Value *xPos = (*level)["xPos"];
+  NBT_Value *zPos = (*level)["zPos"];
+  if(xPos == NULL || zPos == NULL)
+    return false;
+
+  x = *xPos;
+  z = *zPos;
+
+  if(!copyByteArray(level, "Blocks", this, CHUNK_BLOCKS) ||
+     !copyByteArray(level, "Data", this, CHUNK_DATA) ||
+     !copyByteArray(level, "BlockLight", this, CHUNK_BLOCKLIGHT) ||
+     !copyByteArray(level, "SkyLight", this, CHUNK_SKYLIGHT))
+  {
+    return false;
+  }
+
+  NBT_Value *heightVal = (*level)["HeightMap"];
+  std::vector<uint8> *heightArray = heightVal ? heightVal->GetByteArray() : NULL;
+  if(heightArray == NULL || heightArray->size() != CHUNK_HEIGHTMAP_SIZE)
+    return false;
+  memcpy(heightmap, &(*heightArray)[0], CHUNK_HEIGHTMAP_SIZE);
+
+  NBT_Value *val = (*level)["LastUpdate"];
+  lastUpdate = val ? (sint64)*val : 0;
+  // Older generated chunks stored this as TAG_Int
+  val = (*level)["TerrainPopulated"];
+  if(val && val->GetType() == NBT_Value::TAG_BYTE)
+    terrainPopulated = ((sint8)*val != 0);
+  else if(val && val->GetType() == NBT_Value::TAG_INT)
+    terrainPopulated = ((sint32)*val != 0);
+  // Chunks were relit before every save until the flag was stored
+  val = (*level)["LightPopulated"];
+  lightPopulated = (val == NULL) || ((sint8)*val != 0);
+
+  clearEntities();
+
+  // Move entity compounds out of the tree, the tree is freed by the caller
+  NBT_Value *tileList = (*level)["TileEntities"];
+  if(tileList && tileList->GetListType() == NBT_Value::TAG_COMPOUND)
+  {
+    std::vector<NBT_Value*> *list = tileList->GetList();
+    for(unsigned int i = 0; i < list->size(); i++)
+    {
+      if((*list)[i] != NULL && setTileEntity((*list)[i]))
+        (*list)[i] = NULL;
+    }
+  }
+
+  NBT_Value *entityList = (*level)["Entities"];
+  if(entityList && entityList->GetListType() == NBT_Value::TAG_COMPOUND)
+  {
+    std::vector<NBT_Value*> *list = entityList->GetList();
+    for(unsigned int i = 0; i < list->size(); i++)
+    {
+      if((*list)[i] == NULL)
+        continue;
+
+      sEntity entity;
+      entity.id  = getEntityId((*list)[i]);
+      entity.x   = entity.y = entity.z = 0;
+      entity.nbt = (*list)[i];
+
+      NBT_Value *pos = (*entity.nbt)["Pos"];
+      if(pos && pos->GetListType() == NBT_Value::TAG_DOUBLE && pos->GetList()->size() == 3)
+      {
+        entity.x = *(*pos->GetList())[0];
+        entity.y = *(*pos->GetList())[1];
+        entity.z = *(*pos->GetList())[2];
+      }
+
+      entities.push_back(entity);
+      (*list)[i] = NULL;
+    }
+  }
+
+  return true;
+}
+
+NBT_Value *sChunk::toNBT()
+{
+  NBT_Value *root  = new NBT_Value(NBT_Value::TAG_COMPOUND);
+  NBT_Value *level = new NBT_Value(NBT_Value::TAG_COMPOUND);
+
+  std::vector<uint8> payload(CHUNK_PAYLOAD_SIZE);
+  uint8 *blocks = &payload[0];
+  gather(blocks);
+
+  level->Insert("Blocks", new NBT_Value(blocks, CHUNK_BLOCKS_SIZE));
+  level->Insert("Data", new NBT_Value(blocks+CHUNK_BLOCKS_SIZE, CHUNK_NIBBLES_SIZE));
+  level->Insert("BlockLight", new NBT_Value(blocks+CHUNK_BLOCKS_SIZE+CHUNK_NIBBLES_SIZE,
+                                            CHUNK_NIBBLES_SIZE));
+  level->Insert("SkyLight", new NBT_Value(blocks+CHUNK_BLOCKS_SIZE+2*CHUNK_NIBBLES_SIZE,
+                                          CHUNK_NIBBLES_SIZE));
+  level->Insert("HeightMap", new NBT_Value(heightmap, CHUNK_HEIGHTMAP_SIZE));
+
+  NBT_Value *entityList = new NBT_Value(NBT_Value::TAG_LIST, NBT_Value::TAG_COMPOUND);
+  for(unsigned int i = 0; i < entities.size(); i++)
+    entityList->GetList()->push_back(entities[i].nbt->Clone());
+  level->Insert("Entities", entityList);
+
+  NBT_Value *tileList = new NBT_Value(NBT_Value::TAG_LIST, NBT_Value::TAG_COMPOUND);
+  for(unsigned int i = 0; i < tileEntities.size(); i++)
+    tileList->GetList()->push_back(tileEntities[i].nbt->Clone());
+  level->Insert("TileEntities", tileList);
+
+  level->Insert("LastUpdate", new NBT_Value((sint64)time(NULL)));
+  level->Insert("xPos", new NBT_Value(x));
+  level->Insert("zPos", new NBT_Value(z));
+  level->Insert("TerrainPopulated", new NBT_Value((sint8)(terrainPopulated ? 1 : 0)));
+  level->Insert("LightPopulated", new NBT_Value((sint8)(lightPopulated ? 1 : 0)));
+
+  root->Insert("Level", level);
+
+  return root;
+}
+
+sChunk *sChunk::clone()
+{
+  sChunk *copy = new sChunk(x, z);
+  memcpy(copy->heightmap, heightmap, CHUNK_HEIGHTMAP_SIZE);
+  copy->m_owned = m_owned;
+  copy->m_bytes = m_bytes;
+  for(int section = 0; section < CHUNK_SECTIONS; section++)
+  {
+    for(int array = 0; array < CHUNK_ARRAYS; array++)
+    {
+      uint8 *bytes = sections[section][array];
+      if(isOwned(section, array))
+      {
+        copy->sections[section][array] = allocArray(arraySize(array));
+        memcpy(copy->sections[section][array], bytes, arraySize(array));
+      }
+      else
+      {
+        arrayStore.retain(bytes);
+        copy->sections[section][array] = bytes;
+      }
+    }
+  }
+  copy->lastUpdate       = lastUpdate;
+  copy->terrainPopulated = terrainPopulated;
+  copy->lightPopulated   = lightPopulated;
+  copy->skySeeded        = skySeeded;
+
+  copy->tileEntities = tileEntities;
+  for(unsigned int i = 0; i < copy->tileEntities.size(); i++)
+    copy->tileEntities[i].nbt = tileEntities[i].nbt->Clone();
+
+  copy->entities = entities;
+  for(unsigned int i = 0; i < copy->entities.size(); i++)
+    copy->entities[i].nbt = entities[i].nbt->Clone();
+
+  return copy;
+}
@@ -0,0 +1,235 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CHUNK_H
+#define _CHUNK_H
+
+#include <string>
+#include <vector>
+#include "tools.h"
+
+class NBT_Value;
+
+// Chunk array sizes
+enum
+{
+  CHUNK_BLOCKS_SIZE    = 16*16*128,
+  CHUNK_NIBBLES_SIZE   = 16*16*128/2,
+  CHUNK_HEIGHTMAP_SIZE = 16*16,
+  // blocks, data, blocklight and skylight in the map chunk packet order
+  CHUNK_PAYLOAD_SIZE   = CHUNK_BLOCKS_SIZE+3*CHUNK_NIBBLES_SIZE,
+
+  // A chunk is stored as a column of 16x16x16 sections
+  CHUNK_SECTIONS       = 8,
+  SECTION_BLOCKS_SIZE  = 16*16*16,
+  SECTION_NIBBLES_SIZE = 16*16*16/2
+};
+
+// Arrays kept for each section
+enum
+{
+  CHUNK_BLOCKS,
+  CHUNK_DATA,
+  CHUNK_BLOCKLIGHT,
+  CHUNK_SKYLIGHT,
+  CHUNK_ARRAYS
+};
+
+// Chest, furnace, sign etc. kept with the chunk
+struct sTileEntity
+{
+  std::string id;
+  sint32 x;
+  sint32 y;
+  sint32 z;
+  // Full TAG_Compound of the entity, owned by the chunk
+  NBT_Value *nbt;
+};
+
+// Mobs and dropped items saved with the chunk
+struct sEntity
+{
+  std::string id;
+  double x;
+  double y;
+  double z;
+  // Full TAG_Compound of the entity, owned by the chunk
+  NBT_Value *nbt;
+};
+
+struct sChunk
+{
+  uint8 heightmap[CHUNK_HEIGHTMAP_SIZE];
+  sint32 x;
+  sint32 z;
+  sint64 lastUpdate;
+  bool terrainPopulated;
+  // Light arrays match the blocks, false after edits until relit
+  bool lightPopulated;
+  // Set by the map generator: the heightmap and the skylight down to the
+  // ground are those the light engine's first sky pass would write.
+  // Cleared by block changes.
+  bool skySeeded;
+
+  std::vector<sTileEntity> tileEntities;
+  std::vector<sEntity> entities;
+
+  sChunk(sint32 x = 0, sint32 z = 0);
+  ~sChunk();
+
+  // Block access in chunk coordinates, x and z 0-15, y 0-127
+  uint8 getBlock(int x, int y, int z) const
+  {
+    return sections[y>>4][CHUNK_BLOCKS][sectionIndex(x, y, z)];
+  }
+
+  // Data, blocklight or skylight nibble
+  uint8 getNibble(int array, int x, int y, int z) const
+  {
+    int index = sectionIndex(x, y, z);
+    uint8 value = sections[y>>4][array][index>>1];
+    return (index & 1) ? (value >> 4) : (value & 0x0f);
+  }
+
+  void setBlock(int x, int y, int z, uint8 value)
+  {
+    uint8 *array = sections[y>>4][CHUNK_BLOCKS];
+    int index    = sectionIndex(x, y, z);
+    if(array[index] == value)
+      return;
+    writable(y>>4, CHUNK_BLOCKS)[index] = value;
+    skySeeded = false;
+  }
+
+  void setNibble(int array, int x, int y, int z, uint8 value)
+  {
+    int index     = sectionIndex(x, y, z);
+    uint8 current = sections[y>>4][array][index>>1];
+    uint8 updated = (index & 1) ? ((current & 0x0f) | (value << 4))
+                                : ((current & 0xf0) | (value & 0x0f));
+    if(current == updated)
+      return;
+    writable(y>>4, array)[index>>1] = updated;
+  }
+
+  // True if the section has no blocks other than air
+  bool isAirSection(int section) const
+  {
+    return sections[section][CHUNK_BLOCKS] == s_airBlocks;
+  }
+
+  // Fill one array of a section with a byte value
+  void fillSection(int section, int array, uint8 value);
+
+  // Copy one array from/to the full 16x16x128 layout used by the chunk
+  // files and the map chunk packet
+  void getArray(int array, uint8 *dst) const;
+  void setArray(int array, const uint8 *src);
+
+  // Write blocks, data, blocklight and skylight in packet order,
+  // CHUNK_PAYLOAD_SIZE bytes
+  void gather(uint8 *payload) const;
+
+  // Share the arrays written since the last call with identical arrays
+  // of other chunks
+  void compact();
+
+  // Identifies the content of a chunk whose arrays are all shared, so
+  // identical chunks can share their compressed payload. False if the
+  // chunk has arrays of its own.
+  bool signature(std::vector<uint64> &key) const;
+
+  // Heap memory held by the chunk alone, changes as sections are written
+  size_t memoryUsage() const { return m_bytes; }
+
+  // Memory held by the arrays shared between chunks
+  static size_t sharedMemoryUsage();
+
+  // Tile entity at absolute block position, NULL if none
+  sTileEntity *getTileEntity(sint32 x, sint32 y, sint32 z);
+
+  // Add or replace tile entity, takes ownership of entity
+  bool setTileEntity(NBT_Value *entity);
+
+  // Fill the chunk from a chunk file root, returns false on corrupt data.
+  // Entity compounds are moved out of the tree, the rest is left to the caller.
+  bool fromNBT(NBT_Value *root);
+
+  // Build a chunk file root, caller deletes. Only reads the chunk.
+  NBT_Value *toNBT();
+
+  // Deep copy, used as a snapshot for background saving
+  sChunk *clone();
+
+private:
+  // Section arrays indexed y + z*16 + x*256 within the section. Arrays are
+  // shared by content between all chunks and get a copy of their own when
+  // first written.
+  uint8 *sections[CHUNK_SECTIONS][CHUNK_ARRAYS];
+  // Bit section*CHUNK_ARRAYS+array set if the array is owned
+  uint32 m_owned;
+  size_t m_bytes;
+
+  // Shared all air section
+  static uint8 *s_airBlocks;
+
+  static int sectionIndex(int x, int y, int z)
+  {
+    return (y & 15) | (z << 4) | (x << 8);
+  }
+
+  static int arraySize(int array)
+  {
+    return (array == CHUNK_BLOCKS) ? SECTION_BLOCKS_SIZE : SECTION_NIBBLES_SIZE;
+  }
+
+  bool isOwned(int section, int array) const
+  {
+    return (m_owned >> (section*CHUNK_ARRAYS+array)) & 1;
+  }
+
+  uint8 *writable(int section, int array)
+  {
+    if(!isOwned(section, array))
+      expand(section, array);
+    return sections[section][array];
+  }
+
+  // Give the array its own copy
+  void expand(int section, int array);
+
+  // Point the array to a shared one, takes over a reference
+  void share(int section, int array, uint8 *shared);
+
+  void clearEntities();
+
+  // Not copyable, arrays are owned
+  sChunk(const sChunk &);
+  sChunk &operator=(const sChunk &);
+};
+
+#endif
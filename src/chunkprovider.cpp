@@ -0,0 +1,518 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdlib>
+#include <algorithm>
+
+#include "logger.h"
+#include "constants.h"
+#include "config.h"
+#include "chunk.h"
+#include "map.h"
+#include "mapgen.h"
+#include "nbt.h"
+#include "journal.h"
+#include "chunkprovider.h"
+
+// Reads the chunk file on a loader thread and continues on a generator
+// thread if the chunk does not exist yet
+class ChunkJob : public Job
+{
+public:
+  ChunkJob(ChunkProvider *provider, int x, int z, bool generate, bool lowPriority)
+    : provider(provider), x(x), z(z), generate(generate), lowPriority(lowPriority),
+      generated(false), loaded(false), chunk(NULL)
+  {
+  }
+
+  void run()
+  {
+    if(!loaded)
+    {
+      loaded = true;
+
+      bool exists;
+      chunk = Map::get().readMapFile(x, z, &exists);
+
+      if(!exists && generate)
+      {
+        provider->m_generators.push(this, lowPriority);
+        return;
+      }
+    }
+    else
+    {
+      // The generator is shared, generating changes nothing in it
+      chunk     = Map::get().mapGen->generateChunk(x, z);
+      generated = true;
+    }
+
+    provider->finished(this);
+  }
+
+  ChunkProvider *provider;
+  int x;
+  int z;
+  bool generate;
+  // Only changed by the main thread while the job is not queued
+  bool lowPriority;
+  bool generated;
+  bool loaded;
+  sChunk *chunk;
+};
+
+// Serializes, compresses and writes a chunk snapshot on a saver thread
+class SaveJob : public Job
+{
+public:
+  SaveJob(ChunkProvider *provider, sChunk *chunk, uint64 sequence)
+    : provider(provider), chunk(chunk), sequence(sequence), ok(false)
+  {
+  }
+
+  void run()
+  {
+    NBT_Value *root = chunk->toNBT();
+    ok              = Map::get().storage.saveChunk(chunk->x, chunk->z, root);
+    delete root;
+
+    provider->saved(this);
+  }
+
+  ChunkProvider *provider;
+  sChunk *chunk;
+  // Journal records included in the snapshot
+  uint64 sequence;
+  bool ok;
+};
+
+ChunkProvider &ChunkProvider::get()
+{
+  static ChunkProvider instance;
+  return instance;
+}
+
+void ChunkProvider::init()
+{
+  m_enabled = Conf::get().bValue("map_async_io");
+  if(!m_enabled)
+    return;
+
+  int loaders    = Conf::get().iValue("map_io_threads");
+  int generators = Conf::get().iValue("map_generator_threads");
+  int savers     = Conf::get().iValue("map_save_threads");
+
+  m_prefetchLimit   = Conf::get().iValue("map_prefetch_limit");
+  m_prefetchSpeed   = Conf::get().iValue("map_prefetch_speed");
+  m_prefetchSeconds = Conf::get().iValue("map_prefetch_seconds");
+
+  // Leave one core for the main thread
+  if(generators <= 0)
+    generators = std::max(Thread::cpuCount() - 1, 1);
+  if(loaders <= 0)
+    loaders = 1;
+  if(savers <= 0)
+    savers = 1;
+
+  m_loaders.start(loaders);
+  m_generators.start(generators);
+  m_savers.start(savers);
+
+  if(m_loaders.threadCount() == 0 || m_generators.threadCount() == 0 ||
+     m_savers.threadCount() == 0)
+  {
+    LOG("Unable to start chunk threads, loading chunks synchronously");
+    free();
+  }
+}
+
+void ChunkProvider::free()
+{
+  if(!m_enabled)
+    return;
+
+  // Loaders may still hand jobs to the generators, stop them first
+  std::vector<Job *> unfinished;
+  m_loaders.stop(&unfinished);
+  m_generators.stop(&unfinished);
+
+  m_finishedMutex.lock();
+  unfinished.insert(unfinished.end(), m_finished.begin(), m_finished.end());
+  m_finished.clear();
+  m_finishedMutex.unlock();
+
+  for(unsigned int i = 0; i < unfinished.size(); i++)
+  {
+    ChunkJob *job = (ChunkJob *)unfinished[i];
+    delete job->chunk;
+    delete job;
+  }
+
+  // Snapshots must reach the disk, write the rest on this thread
+  m_stopping = true;
+  unfinished.clear();
+  m_savers.stop(&unfinished);
+  for(unsigned int i = 0; i < unfinished.size(); i++)
+    unfinished[i]->run();
+
+  while(!m_saving.empty())
+    pollSaves();
+  m_stopping = false;
+
+  m_pending.clear();
+  m_prefetching = 0;
+  m_enabled     = false;
+}
+
+void ChunkProvider::request(int x, int z, bool generate, Callback callback, void *arg)
+{
+  uint32 mapId;
+  Map::get().posToId(x, z, &mapId);
+
+  std::map<uint32, sRequest>::iterator it = m_pending.find(mapId);
+
+  if(it == m_pending.end())
+  {
+    sRequest &req = m_pending[mapId];
+    req.generate  = generate;
+    req.stale     = false;
+    req.prefetch  = false;
+    req.job       = new ChunkJob(this, x, z, generate, false);
+    it            = m_pending.find(mapId);
+
+    m_loaders.push(req.job);
+  }
+  else if(it->second.prefetch)
+  {
+    // Someone needs the prefetched chunk now. A job already on its way from
+    // the loader to the generator stays low priority.
+    it->second.prefetch = false;
+    m_prefetching--;
+    if(!m_loaders.promote(it->second.job))
+      m_generators.promote(it->second.job);
+  }
+
+  if(generate && !it->second.generate)
+  {
+    // A load-only request is running, redo it with generation when it finishes
+    it->second.generate = true;
+    it->second.stale    = true;
+  }
+
+  if(callback == NULL)
+    return;
+
+  std::vector<sCallback> &callbacks = it->second.callbacks;
+  for(unsigned int i = 0; i < callbacks.size(); i++)
+  {
+    if(callbacks[i].callback == callback && callbacks[i].arg == arg)
+      return;
+  }
+
+  sCallback cb;
+  cb.callback = callback;
+  cb.arg      = arg;
+  callbacks.push_back(cb);
+}
+
+void ChunkProvider::prefetch(int x, int z)
+{
+  if(!m_enabled || m_prefetching >= m_prefetchLimit)
+    return;
+
+  uint32 mapId;
+  Map::get().posToId(x, z, &mapId);
+
+  // Compressed chunks come back quickly enough without prefetching
+  if(m_pending.count(mapId) || Map::get().maps.count(mapId) || Map::get().warmMaps.count(mapId))
+    return;
+
+  sRequest &req = m_pending[mapId];
+  req.generate  = true;
+  req.stale     = false;
+  req.prefetch  = true;
+  req.job       = new ChunkJob(this, x, z, true, true);
+  m_prefetching++;
+
+  m_loaders.push(req.job, true);
+}
+
+bool ChunkProvider::isPending(int x, int z)
+{
+  uint32 mapId;
+  Map::get().posToId(x, z, &mapId);
+
+  return m_pending.count(mapId) != 0;
+}
+
+void ChunkProvider::invalidate(int x, int z)
+{
+  uint32 mapId;
+  Map::get().posToId(x, z, &mapId);
+
+  std::map<uint32, sRequest>::iterator it = m_pending.find(mapId);
+  if(it != m_pending.end())
+    it->second.stale = true;
+}
+
+void ChunkProvider::poll()
+{
+  if(!m_enabled)
+    return;
+
+  // Finished saves first, loads that read the old data are redone
+  pollSaves();
+
+  std::vector<ChunkJob *> finished;
+  m_finishedMutex.lock();
+  finished.swap(m_finished);
+  m_finishedMutex.unlock();
+
+  // Generated chunks are lit together before any callback sees them
+  std::vector<ChunkJob *> done;
+  std::vector<std::vector<sCallback> > doneCallbacks;
+  std::vector<uint32> generated;
+
+  for(unsigned int i = 0; i < finished.size(); i++)
+  {
+    ChunkJob *job = finished[i];
+
+    uint32 mapId;
+    Map::get().posToId(job->x, job->z, &mapId);
+
+    sRequest &req = m_pending[mapId];
+
+    // File changed while loading, read it again
+    if(req.stale)
+    {
+      delete job->chunk;
+      job->chunk     = NULL;
+      job->loaded    = false;
+      job->generated = false;
+      job->generate    = req.generate;
+      job->lowPriority = req.prefetch;
+      req.stale        = false;
+      m_loaders.push(job, job->lowPriority);
+      continue;
+    }
+
+    if(req.prefetch)
+      m_prefetching--;
+
+    doneCallbacks.push_back(std::vector<sCallback>());
+    doneCallbacks.back().swap(req.callbacks);
+    m_pending.erase(mapId);
+
+    sChunk *chunk = NULL;
+
+    if(Map::get().maps.count(mapId))
+    {
+      // Loaded synchronously in the meantime, the resident copy wins
+      delete job->chunk;
+      chunk = Map::get().maps[mapId];
+    }
+    else if(Map::get().thawMap(job->x, job->z))
+    {
+      // Released to the compressed copies while loading
+      delete job->chunk;
+      chunk = Map::get().maps[mapId];
+    }
+    else if((chunk = unsavedCopy(job->x, job->z)) != NULL)
+    {
+      // Released while loading, the file is not up to date yet
+      delete job->chunk;
+      Map::get().addMap(chunk);
+    }
+    else if(job->chunk != NULL)
+    {
+      chunk = job->chunk;
+      Map::get().addMap(chunk);
+
+      if(job->generated)
+        generated.push_back(mapId);
+    }
+
+    // The chunk as published to the map
+    job->chunk = chunk;
+    done.push_back(job);
+  }
+
+  Map::get().lightMaps(generated, false);
+
+  for(unsigned int i = 0; i < done.size(); i++)
+  {
+    ChunkJob *job = done[i];
+    std::vector<sCallback> &callbacks = doneCallbacks[i];
+
+    for(unsigned int j = 0; j < callbacks.size(); j++)
+      callbacks[j].callback(job->x, job->z, job->chunk, callbacks[j].arg);
+
+    delete job;
+  }
+}
+
+void ChunkProvider::save(sChunk *snapshot)
+{
+  uint32 mapId;
+  Map::get().posToId(snapshot->x, snapshot->z, &mapId);
+
+  // Wait for the running save of this chunk, replacing an older snapshot
+  uint64 sequence = Journal::get().sequence();
+
+  std::map<uint32, sSave>::iterator it = m_saving.find(mapId);
+  if(it != m_saving.end())
+  {
+    delete it->second.next;
+    it->second.next         = snapshot;
+    it->second.nextSequence = sequence;
+
+    // A failed save waiting for its retry, write the newer snapshot now
+    if(it->second.running == NULL)
+      startSave(snapshot, sequence);
+    return;
+  }
+
+  startSave(snapshot, sequence);
+}
+
+sChunk *ChunkProvider::unsavedCopy(int x, int z)
+{
+  uint32 mapId;
+  Map::get().posToId(x, z, &mapId);
+
+  std::map<uint32, sSave>::iterator it = m_saving.find(mapId);
+  if(it == m_saving.end())
+    return NULL;
+
+  // Savers only read the snapshot, copying it here is safe
+  if(it->second.next != NULL)
+    return it->second.next->clone();
+  return it->second.running->chunk->clone();
+}
+
+void ChunkProvider::unsavedCopies(std::vector<sChunk *> &chunks)
+{
+  for(std::map<uint32, sSave>::iterator it = m_saving.begin(); it != m_saving.end(); ++it)
+  {
+    if(it->second.next != NULL)
+      chunks.push_back(it->second.next->clone());
+    else
+      chunks.push_back(it->second.running->chunk->clone());
+  }
+}
+
+void ChunkProvider::startSave(sChunk *snapshot, uint64 sequence)
+{
+  uint32 mapId;
+  Map::get().posToId(snapshot->x, snapshot->z, &mapId);
+
+  SaveJob *job = new SaveJob(this, snapshot, sequence);
+
+  sSave &entry  = m_saving[mapId];
+  entry.running = job;
+  entry.next    = NULL;
+
+  if(m_stopping)
+    job->run();
+  else
+    m_savers.push(job);
+}
+
+void ChunkProvider::pollSaves()
+{
+  std::vector<SaveJob *> saved;
+  m_finishedMutex.lock();
+  saved.swap(m_saved);
+  m_finishedMutex.unlock();
+
+  for(unsigned int i = 0; i < saved.size(); i++)
+  {
+    SaveJob *job = saved[i];
+    int x        = job->chunk->x;
+    int z        = job->chunk->z;
+
+    uint32 mapId;
+    Map::get().posToId(x, z, &mapId);
+
+    if(job->ok)
+      Journal::get().chunkSaved(x, z, job->sequence);
+    else
+    {
+      LOG("Error in saving map");
+
+      sSave &entry = m_saving[mapId];
+
+      // Still loaded, try again with the next save
+      if(Map::get().maps.count(mapId))
+        Map::get().mapChanged[mapId] = 1;
+      else if(entry.next == NULL && !m_stopping)
+      {
+        // Released, loads get the snapshot until it is written
+        entry.running      = NULL;
+        entry.next         = job->chunk;
+        entry.nextSequence = job->sequence;
+        entry.retry        = time(0)+SAVE_RETRY_SECONDS;
+        delete job;
+        continue;
+      }
+      else if(entry.next == NULL)
+        LOG("Changes of the chunk are left in the journal");
+    }
+
+    delete job->chunk;
+    delete job;
+
+    sChunk *next        = m_saving[mapId].next;
+    uint64 nextSequence = m_saving[mapId].nextSequence;
+    m_saving.erase(mapId);
+
+    if(next != NULL)
+      startSave(next, nextSequence);
+
+    invalidate(x, z);
+  }
+
+  // Failed saves of released chunks, right away when shutting down
+  time_t now = time(0);
+  for(std::map<uint32, sSave>::iterator it = m_saving.begin(); it != m_saving.end(); ++it)
+  {
+    if(it->second.running == NULL && (m_stopping || it->second.retry <= now))
+      startSave(it->second.next, it->second.nextSequence);
+  }
+}
+
+void ChunkProvider::saved(SaveJob *job)
+{
+  MutexLock lock(m_finishedMutex);
+  m_saved.push_back(job);
+}
+
+void ChunkProvider::finished(ChunkJob *job)
+{
+  MutexLock lock(m_finishedMutex);
+  m_finished.push_back(job);
+}
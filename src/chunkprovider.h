@@ -0,0 +1,167 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CHUNKPROVIDER_H
+#define _CHUNKPROVIDER_H
+
+#include <ctime>
+#include <map>
+#include <vector>
+#include <string>
+#include "tools.h"
+#include "thread.h"
+
+struct sChunk;
+class ChunkJob;
+class SaveJob;
+
+// Loads, generates and saves chunks on worker threads. Requests are made
+// and finished chunks are published to the map on the main thread only.
+class ChunkProvider
+{
+public:
+  // Called on the main thread when the request is done, chunk is NULL if
+  // the chunk could not be loaded or generated
+  typedef void (*Callback)(int x, int z, sChunk *chunk, void *arg);
+
+  static ChunkProvider &get();
+
+  // Start loader and generator threads according to configuration
+  void init();
+  // Stop threads and drop unfinished requests
+  void free();
+
+  bool isEnabled() const
+  {
+    return m_enabled;
+  }
+
+  // Queue chunk x,z for loading, and for generation if it does not exist and
+  // generate is set. Callbacks of duplicate requests are merged.
+  void request(int x, int z, bool generate = true, Callback callback = NULL, void *arg = NULL);
+
+  // Queue chunk x,z at low priority if it is not loaded or requested yet.
+  // Becomes a normal request once someone asks for the chunk.
+  void prefetch(int x, int z);
+
+  // Players faster than this many blocks per second are prefetched for
+  double prefetchSpeed() const
+  {
+    return m_prefetchSpeed;
+  }
+  // How far ahead the position is predicted
+  int prefetchSeconds() const
+  {
+    return m_prefetchSeconds;
+  }
+
+  bool isPending(int x, int z);
+
+  // Chunk x,z was written to disk, reload it if a request already read the file
+  void invalidate(int x, int z);
+
+  // Serialize, compress and write a chunk snapshot in the background, takes
+  // ownership. Saves of the same chunk are written in order and only the
+  // newest waiting snapshot is kept.
+  void save(sChunk *snapshot);
+
+  // Copy of the newest snapshot of x,z not yet on disk, NULL if none
+  sChunk *unsavedCopy(int x, int z);
+
+  // Copies of the newest snapshots of all chunks not yet on disk
+  void unsavedCopies(std::vector<sChunk *> &chunks);
+
+  // Publish finished chunks and run callbacks, call from the main loop
+  void poll();
+
+private:
+  friend class ChunkJob;
+  friend class SaveJob;
+
+  struct sCallback
+  {
+    Callback callback;
+    void *arg;
+  };
+
+  struct sRequest
+  {
+    bool generate;
+    bool stale;
+    bool prefetch;
+    ChunkJob *job;
+    std::vector<sCallback> callbacks;
+  };
+
+  ChunkProvider() : m_enabled(false), m_stopping(false), m_prefetching(0), m_prefetchLimit(0),
+                    m_prefetchSpeed(0), m_prefetchSeconds(0)
+  {
+  }
+
+  bool m_enabled;
+  // Saves run on the calling thread while shutting down
+  bool m_stopping;
+
+  // Pending prefetch requests and their maximum
+  int m_prefetching;
+  int m_prefetchLimit;
+  double m_prefetchSpeed;
+  int m_prefetchSeconds;
+
+  struct sSave
+  {
+    // Owned by the job while it runs
+    SaveJob *running;
+    sChunk *next;
+    // Journal sequence when the next snapshot was taken
+    uint64 nextSequence;
+    // No save running, the snapshot of a failed save is written again then
+    time_t retry;
+  };
+
+  enum { SAVE_RETRY_SECONDS = 10 };
+
+  // Main thread only
+  std::map<uint32, sRequest> m_pending;
+  std::map<uint32, sSave> m_saving;
+
+  ThreadPool m_loaders;
+  ThreadPool m_generators;
+  ThreadPool m_savers;
+
+  // Jobs handed back by the workers
+  std::vector<ChunkJob *> m_finished;
+  std::vector<SaveJob *> m_saved;
+  Mutex m_finishedMutex;
+
+  void finished(ChunkJob *job);
+  void saved(SaveJob *job);
+  void startSave(sChunk *snapshot, uint64 sequence);
+  void pollSaves();
+};
+
+#endif
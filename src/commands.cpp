@@ -50,6 +50,7 @@
 #include "config.h"
 #include "tools.h"
 #include "physics.h"
+#include "backup.h"
 
 namespace
 {
@@ -141,6 +142,15 @@ void saveMap(User *user, std::string command, std::deque<std::string> args)
                       Chat::USER);
 }
 
+void backupMap(User *user, std::string command, std::deque<std::string> args)
+{
+  if(Backup::get().start())
+    Chat::get().sendMsg(user, COLOR_DARK_MAGENTA + "SERVER:" + COLOR_RED + " Backup started",
+                        Chat::USER);
+  else
+    reportError(user, "Backup is already running or failed to start");
+}
+
 void kick(User *user, std::string command, std::deque<std::string> args)
 {
   if(!args.empty())
@@ -354,6 +364,7 @@ void Chat::registerStandardCommands()
   registerCommand("home", home, false);
   registerCommand("kit", kit, false);
   registerCommand("save", saveMap, true);
+  registerCommand("backup", backupMap, true);
   registerCommand("kick", kick, true);
   registerCommand("ctp", coordinateTeleport, true);
   registerCommand("tp", userTeleport, true);
@@ -153,6 +153,11 @@ bool Conf::load(std::string configFile)
   return true;
 }
 
+void Conf::set(std::string name, std::string value)
+{
+  confSet[name] = value;
+}
+
 // Return values
 std::string Conf::sValue(std::string name)
 {
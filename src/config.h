@@ -43,6 +43,8 @@ public:
   std::string sValue(std::string name);
   bool bValue(std::string name);
   std::vector<int> vValue(std::string name);
+  // Override a value after loading
+  void set(std::string name, std::string value);
   
   static Conf &get();
 };
@@ -41,8 +41,25 @@ void initConstants()
   defaultConf.insert(std::pair<std::string, std::string>("mapdir", "testmap"));
   defaultConf.insert(std::pair<std::string, std::string>("userlimit", "20"));
   defaultConf.insert(std::pair<std::string, std::string>("map_release_time", "10"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_memory_budget", "0"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_warm_time", "300"));
+  defaultConf.insert(std::pair<std::string, std::string>("backup_dir", "backup"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_async_io", "true"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_io_threads", "1"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_generator_threads", "0"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_save_threads", "1"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_light_threads", "0"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_seed", "0"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_prefetch_limit", "32"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_prefetch_speed", "6"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_prefetch_seconds", "4"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_autosave_interval", "300"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_journal", "true"));
   defaultConf.insert(std::pair<std::string, std::string>("liquid_physics", "1"));
   defaultConf.insert(std::pair<std::string, std::string>("map_flatland", "false"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_caves", "false"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_ores", "false"));
+  defaultConf.insert(std::pair<std::string, std::string>("map_decorations", "false"));
   defaultConf.insert(std::pair<std::string, std::string>("oreDensity", "24"));
   defaultConf.insert(std::pair<std::string, std::string>("seaLevel", "63"));
   defaultConf.insert(std::pair<std::string, std::string>("server_full_message",
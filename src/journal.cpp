@@ -0,0 +1,369 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef WIN32
+  #include <io.h>
+  #include <fcntl.h>
+  #include <sys/stat.h>
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <iostream>
+
+#include "logger.h"
+#include "tools.h"
+#include "nbt.h"
+#include "map.h"
+#include "journal.h"
+
+namespace
+{
+
+enum
+{
+  RECORD_RESET  = 0x00,
+  RECORD_BLOCK  = 0x01,
+  RECORD_ENTITY = 0x02
+};
+
+// Writes or truncates the journal on the writer thread
+class JournalJob : public Job
+{
+public:
+  JournalJob(int fd, bool truncate) : fd(fd), truncate(truncate)
+  {
+  }
+
+  void run()
+  {
+#ifdef WIN32
+    if(truncate)
+      _chsize(fd, 0);
+    else if(_write(fd, &data[0], (unsigned int)data.size()) == (int)data.size())
+      _commit(fd);
+#else
+    if(truncate)
+    {
+      if(ftruncate(fd, 0) != 0)
+        LOG("Unable to truncate journal");
+    }
+    else if(write(fd, &data[0], data.size()) == (ssize_t)data.size())
+      fsync(fd);
+#endif
+    else
+      LOG("Error in writing journal");
+
+    delete this;
+  }
+
+  int fd;
+  bool truncate;
+  std::vector<uint8> data;
+};
+
+bool getVarint(const std::vector<uint8> &data, size_t &pos, uint32 &value)
+{
+  value = 0;
+  for(int shift = 0; shift < 35; shift += 7)
+  {
+    if(pos >= data.size())
+      return false;
+    uint8 byte = data[pos++];
+    value     |= (uint32)(byte & 0x7f) << shift;
+    if(!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+bool getZigzag(const std::vector<uint8> &data, size_t &pos, sint32 &value)
+{
+  uint32 raw;
+  if(!getVarint(data, pos, raw))
+    return false;
+  value = (sint32)(raw >> 1) ^ -(sint32)(raw & 1);
+  return true;
+}
+
+}
+
+Journal &Journal::get()
+{
+  static Journal instance;
+  return instance;
+}
+
+int Journal::replay(const std::string &mapDirectory)
+{
+  std::string infile = mapDirectory+"/journal.dat";
+
+  FILE *fp = fopen(infile.c_str(), "rb");
+  if(fp == NULL)
+    return 0;
+
+  std::vector<uint8> data;
+  uint8 chunk[4096];
+  size_t read;
+  while((read = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+    data.insert(data.end(), chunk, chunk+read);
+  fclose(fp);
+
+  int applied   = 0;
+  int baseX     = 0;
+  int baseZ     = 0;
+  size_t pos    = 0;
+  bool complete = true;
+
+  while(complete && pos < data.size())
+  {
+    m_validSize = pos;
+    uint8 type  = data[pos++];
+
+    if(type == RECORD_RESET)
+    {
+      baseX = 0;
+      baseZ = 0;
+    }
+    else if(type == RECORD_BLOCK)
+    {
+      sint32 dx, dz;
+      if(!getZigzag(data, pos, dx) || !getZigzag(data, pos, dz) || pos+4 > data.size())
+      {
+        complete = false;
+        break;
+      }
+
+      uint32 packed = (uint32)getSint32(&data[pos]);
+      pos   += 4;
+      baseX += dx;
+      baseZ += dz;
+
+      Map::get().setBlock(baseX*16 + ((packed >> 4) & 0xf), (packed >> 8) & 0x7f,
+                          baseZ*16 + (packed & 0xf), (char)(packed >> 19),
+                          (char)((packed >> 15) & 0xf));
+      markUnsaved(baseX, baseZ);
+      applied++;
+    }
+    else if(type == RECORD_ENTITY)
+    {
+      sint32 x, y, z;
+      uint32 len;
+      if(!getZigzag(data, pos, x) || pos+1 > data.size())
+      {
+        complete = false;
+        break;
+      }
+      y = data[pos++];
+      if(!getZigzag(data, pos, z) || !getVarint(data, pos, len) || pos+len > data.size())
+      {
+        complete = false;
+        break;
+      }
+
+      uint8 *ptr    = &data[pos];
+      int remaining = (int)len;
+      pos          += len;
+
+      Map::get().setComplexEntity(x, y, z, new NBT_Value(NBT_Value::TAG_COMPOUND, &ptr, remaining));
+      markUnsaved(blockToChunk(x), blockToChunk(z));
+      applied++;
+    }
+    else
+      complete = false;
+  }
+
+  // The tail of a crash can be cut in the middle of a record, it is dropped
+  // before new records are appended
+  if(complete)
+    m_validSize = data.size();
+  else
+    LOG("Journal ends with an incomplete record");
+
+  if(applied)
+    std::cout << "Replayed " << applied << " changes from journal" << std::endl;
+
+  return applied;
+}
+
+bool Journal::init(const std::string &mapDirectory)
+{
+  std::string outfile = mapDirectory+"/journal.dat";
+
+#ifdef WIN32
+  m_fd = _open(outfile.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY,
+               _S_IREAD | _S_IWRITE);
+#else
+  m_fd = open(outfile.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+#endif
+  if(m_fd == -1)
+  {
+    LOG("Unable to open journal");
+    return false;
+  }
+
+#ifdef WIN32
+  _chsize(m_fd, (long)m_validSize);
+#else
+  if(ftruncate(m_fd, m_validSize) != 0)
+    LOG("Unable to truncate journal");
+#endif
+
+  m_writer.start(1);
+  m_enabled = true;
+
+  // Replayed records stay until their chunks are saved
+  m_buffer.push_back(RECORD_RESET);
+
+  return true;
+}
+
+void Journal::free()
+{
+  if(!m_enabled)
+    return;
+
+  flush();
+
+  std::vector<Job *> unfinished;
+  m_writer.stop(&unfinished);
+  for(unsigned int i = 0; i < unfinished.size(); i++)
+    unfinished[i]->run();
+
+#ifdef WIN32
+  _close(m_fd);
+#else
+  close(m_fd);
+#endif
+  m_fd      = -1;
+  m_enabled = false;
+}
+
+void Journal::logBlock(int x, int y, int z, uint8 type, uint8 meta)
+{
+  if(!m_enabled)
+    return;
+
+  int chunk_x = blockToChunk(x);
+  int chunk_z = blockToChunk(z);
+
+  m_buffer.push_back(RECORD_BLOCK);
+  putZigzag(chunk_x - m_baseX);
+  putZigzag(chunk_z - m_baseZ);
+  m_baseX = chunk_x;
+  m_baseZ = chunk_z;
+
+  uint32 packed = ((uint32)type << 19) | ((uint32)(meta & 0xf) << 15) | ((uint32)(y & 0x7f) << 8) |
+                  ((uint32)blockToChunkBlock(x) << 4) | (uint32)blockToChunkBlock(z);
+  size_t pos = m_buffer.size();
+  m_buffer.resize(pos+4);
+  putSint32(&m_buffer[pos], (sint32)packed);
+
+  markUnsaved(chunk_x, chunk_z);
+}
+
+void Journal::logComplexEntity(sint32 x, sint32 y, sint32 z, NBT_Value *entity)
+{
+  if(!m_enabled)
+    return;
+
+  std::vector<uint8> payload;
+  entity->Write(payload);
+
+  m_buffer.push_back(RECORD_ENTITY);
+  putZigzag(x);
+  m_buffer.push_back((uint8)y);
+  putZigzag(z);
+  putVarint((uint32)payload.size());
+  m_buffer.insert(m_buffer.end(), payload.begin(), payload.end());
+
+  markUnsaved(blockToChunk(x), blockToChunk(z));
+}
+
+void Journal::chunkSaved(int x, int z, uint64 sequence)
+{
+  if(!m_enabled)
+    return;
+
+  uint32 mapId;
+  Map::get().posToId(x, z, &mapId);
+
+  std::map<uint32, uint64>::iterator it = m_unsaved.find(mapId);
+  if(it == m_unsaved.end() || it->second > sequence)
+    return;
+
+  m_unsaved.erase(it);
+
+  // Everything journaled is on disk, start over
+  if(m_unsaved.empty())
+  {
+    m_buffer.clear();
+    m_baseX = 0;
+    m_baseZ = 0;
+    push(std::vector<uint8>(), true);
+  }
+}
+
+void Journal::flush()
+{
+  if(!m_enabled || m_buffer.empty())
+    return;
+
+  push(m_buffer, false);
+  m_buffer.clear();
+}
+
+void Journal::markUnsaved(int x, int z)
+{
+  uint32 mapId;
+  Map::get().posToId(x, z, &mapId);
+  m_unsaved[mapId] = ++m_sequence;
+}
+
+void Journal::push(const std::vector<uint8> &data, bool truncate)
+{
+  JournalJob *job = new JournalJob(m_fd, truncate);
+  job->data       = data;
+  m_writer.push(job);
+}
+
+void Journal::putVarint(uint32 value)
+{
+  while(value >= 0x80)
+  {
+    m_buffer.push_back((uint8)(value | 0x80));
+    value >>= 7;
+  }
+  m_buffer.push_back((uint8)value);
+}
+
+void Journal::putZigzag(sint32 value)
+{
+  putVarint(((uint32)value << 1) ^ (uint32)(value >> 31));
+}
@@ -0,0 +1,110 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include "tools.h"
+#include "thread.h"
+
+class NBT_Value;
+
+// Append-only log of block and complex entity changes, replayed on startup
+// so edits survive a crash between saves. Records are buffered and written
+// with one fsync per flush on a writer thread. The file is truncated once
+// every journaled chunk has been saved.
+//
+// Records:
+//   0x00                                   reset chunk base to 0,0
+//   0x01 dx dz packed                      block change, dx/dz zigzag varint
+//                                          chunk delta from the previous block,
+//                                          packed = type<<19 | meta<<15 | y<<8 |
+//                                          x<<4 | z (4 bytes)
+//   0x02 x y z len nbt                     complex entity, x/z zigzag varint,
+//                                          y byte, len varint, compound payload
+class Journal
+{
+public:
+  static Journal &get();
+
+  // Apply journal of a previous run through Map before init, returns
+  // applied records. The touched chunks count as unsaved.
+  int replay(const std::string &mapDirectory);
+
+  // Start journaling after the records of a previous run
+  bool init(const std::string &mapDirectory);
+  // Write buffered records and stop the writer
+  void free();
+
+  void logBlock(int x, int y, int z, uint8 type, uint8 meta);
+  void logComplexEntity(sint32 x, sint32 y, sint32 z, NBT_Value *entity);
+
+  // Records so far, taken when a chunk snapshot is saved
+  uint64 sequence() const
+  {
+    return m_sequence;
+  }
+
+  // Chunk x,z was written with all records up to sequence
+  void chunkSaved(int x, int z, uint64 sequence);
+
+  // Hand buffered records to the writer, call once per tick
+  void flush();
+
+private:
+  Journal() : m_enabled(false), m_fd(-1), m_sequence(0), m_validSize(0), m_baseX(0), m_baseZ(0)
+  {
+  }
+
+  bool m_enabled;
+  int m_fd;
+  uint64 m_sequence;
+
+  // Journal size up to the last complete record
+  size_t m_validSize;
+
+  // Delta base for block records
+  int m_baseX;
+  int m_baseZ;
+
+  std::vector<uint8> m_buffer;
+
+  // Last record of each chunk not yet saved
+  std::map<uint32, uint64> m_unsaved;
+
+  ThreadPool m_writer;
+
+  void markUnsaved(int x, int z);
+  void push(const std::vector<uint8> &data, bool truncate);
+  void putVarint(uint32 value);
+  void putZigzag(sint32 value);
+};
+
+#endif
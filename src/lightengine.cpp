@@ -0,0 +1,738 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#include "tools.h"
+#include "map.h"
+#include "chunk.h"
+#include "backup.h"
+#include "lightengine.h"
+#include "lightkernels.h"
+
+LightEngine::LightEngine()
+  : m_light(new uint8[WINDOW_CELLS]), m_stop(new sint8[WINDOW_CELLS]),
+    m_queued(new uint8[WINDOW_CELLS]), m_queue(new uint32[QUEUE_SIZE]), m_head(0), m_tail(0),
+    m_blocks(new uint8[CHUNK_BLOCKS_SIZE]), m_buffer(new uint8[CHUNK_BLOCKS_SIZE]), m_memoryDelta(0)
+{
+  memset(m_queued, 0, WINDOW_CELLS);
+}
+
+LightEngine::~LightEngine()
+{
+  delete [] m_light;
+  delete [] m_stop;
+  delete [] m_queued;
+  delete [] m_queue;
+  delete [] m_blocks;
+  delete [] m_buffer;
+}
+
+void LightEngine::findChunks(Map &map, int x, int z)
+{
+  for(int tile = 0; tile < 9; tile++)
+  {
+    uint32 mapId;
+    map.posToId(x+tile/3-1, z+tile%3-1, &mapId);
+
+    std::map<uint32, sChunk *>::iterator it = map.maps.find(mapId);
+    m_chunks[tile]     = (it != map.maps.end()) ? it->second : NULL;
+    m_dirty[tile]      = false;
+    m_usedBefore[tile] = m_chunks[tile] ? m_chunks[tile]->memoryUsage() : 0;
+  }
+}
+
+void LightEngine::loadBlocks(Map &map)
+{
+  for(int tile = 0; tile < 9; tile++)
+  {
+    uint8 *blocks = (tile == CENTER) ? m_blocks : m_buffer;
+    if(m_chunks[tile] != NULL)
+      m_chunks[tile]->getArray(CHUNK_BLOCKS, blocks);
+
+    for(int block_x = 0; block_x < 16; block_x++)
+    {
+      for(int block_z = 0; block_z < 16; block_z++)
+      {
+        sint8 *stop         = m_stop+((tile/3*16+block_x)*STEP_X | (tile%3*16+block_z)*STEP_Z);
+        const uint8 *column = blocks+(block_z*128+block_x*2048);
+
+        if(m_chunks[tile] == NULL)
+          memset(stop, -16, 128);
+        else
+        {
+          for(int block_y = 0; block_y < 128; block_y++)
+            stop[block_y] = map.stopLight[column[block_y]];
+        }
+      }
+    }
+  }
+}
+
+void LightEngine::loadLight(int array)
+{
+  for(int tile = 0; tile < 9; tile++)
+  {
+    m_dirty[tile] = false;
+
+    if(m_chunks[tile] == NULL)
+    {
+      for(int block_x = 0; block_x < 16; block_x++)
+        memset(m_light+((tile/3*16+block_x)*STEP_X | (tile%3*16)*STEP_Z), 0, 16*STEP_Z);
+      continue;
+    }
+
+    m_chunks[tile]->getArray(array, m_buffer);
+
+    for(int block_x = 0; block_x < 16; block_x++)
+    {
+      for(int block_z = 0; block_z < 16; block_z++)
+      {
+        uint8 *light        = m_light+((tile/3*16+block_x)*STEP_X | (tile%3*16+block_z)*STEP_Z);
+        unpackNibbles(m_buffer+((block_z*128+block_x*2048) >> 1), light, 64);
+      }
+    }
+  }
+}
+
+void LightEngine::storeLight(Map &map, int array)
+{
+  for(int tile = 0; tile < 9; tile++)
+  {
+    if(m_chunks[tile] == NULL || !m_dirty[tile])
+      continue;
+
+    for(int block_x = 0; block_x < 16; block_x++)
+    {
+      for(int block_z = 0; block_z < 16; block_z++)
+      {
+        const uint8 *light = m_light+((tile/3*16+block_x)*STEP_X | (tile%3*16+block_z)*STEP_Z);
+        packNibbles(light, m_buffer+((block_z*128+block_x*2048) >> 1), 64);
+      }
+    }
+
+    // A running backup keeps the light as it was
+    Backup::get().chunkChanging(m_chunks[tile]);
+
+    size_t usedBefore = m_chunks[tile]->memoryUsage();
+    m_chunks[tile]->setArray(array, m_buffer);
+    m_memoryDelta += m_chunks[tile]->memoryUsage()-usedBefore;
+  }
+}
+
+void LightEngine::spread(int cell, int light)
+{
+  // If no light, stop!
+  if(light < 1)
+    return;
+
+  // Cells raised later spread their current light, which gives the same
+  // result as spreading every raise right away
+  for(;;)
+  {
+    int y = cell & 127;
+    if(y < 127)
+      raise(cell+1, light);
+    if(y > 0)
+      raise(cell-1, light);
+    raise(cell+STEP_Z, light);
+    raise(cell-STEP_Z, light);
+    raise(cell+STEP_X, light);
+    raise(cell-STEP_X, light);
+
+    if(m_head == m_tail)
+      break;
+
+    cell           = m_queue[m_head];
+    m_head         = (m_head+1) & QUEUE_MASK;
+    m_queued[cell] = 0;
+    light          = m_light[cell];
+  }
+}
+
+void LightEngine::flood()
+{
+  while(m_head != m_tail)
+  {
+    int cell       = m_queue[m_head];
+    m_head         = (m_head+1) & QUEUE_MASK;
+    m_queued[cell] = 0;
+    spread(cell, m_light[cell]);
+  }
+}
+
+void LightEngine::crossFace(int from, int to)
+{
+  uint8 incoming[128];
+  uint8 before[128];
+
+  for(int block_y = 0; block_y < 128; block_y++)
+    incoming[block_y] = std::max(m_light[from | block_y]+m_stop[to | block_y]-1, 0);
+
+  // Faces stitched before let nothing through
+  memcpy(before, m_light+to, 128);
+  if(!maxLight(m_light+to, incoming, 128))
+    return;
+
+  m_dirty[(to >> 17)*3+((to >> 11) & 3)] = true;
+  for(int block_y = 0; block_y < 128; block_y++)
+  {
+    if(m_light[to | block_y] != before[block_y])
+      push(to | block_y);
+  }
+}
+
+bool LightEngine::stitch(Map &map, int x, int z)
+{
+  findChunks(map, x, z);
+
+  if(m_chunks[CENTER] == NULL || !m_chunks[CENTER]->lightPopulated)
+    return false;
+
+  // Face neighbours west, north, south and east, and the step from a
+  // column of the center to the column across the face
+  static const int faces[4] = { 1, 3, 5, 7 };
+  static const int across[4] = { -STEP_X, -STEP_Z, STEP_Z, STEP_X };
+
+  bool stitched[4];
+  bool any = false;
+  for(int face = 0; face < 4; face++)
+  {
+    sChunk *neighbour = m_chunks[faces[face]];
+    stitched[face]    = (neighbour != NULL && neighbour->lightPopulated);
+    any              |= stitched[face];
+  }
+
+  if(!any)
+    return true;
+
+  loadBlocks(map);
+
+  bool changed[9] = { false };
+  for(int array = CHUNK_BLOCKLIGHT; array <= CHUNK_SKYLIGHT; array++)
+  {
+    loadLight(array);
+    m_head = m_tail = 0;
+
+    for(int face = 0; face < 4; face++)
+    {
+      if(!stitched[face])
+        continue;
+
+      for(int i = 0; i < 16; i++)
+      {
+        int column;
+        switch(face)
+        {
+          case 0: column = 16*STEP_X | (16+i)*STEP_Z; break;
+          case 1: column = (16+i)*STEP_X | 16*STEP_Z; break;
+          case 2: column = (16+i)*STEP_X | 31*STEP_Z; break;
+          default: column = 31*STEP_X | (16+i)*STEP_Z; break;
+        }
+
+        crossFace(column+across[face], column);
+        crossFace(column, column+across[face]);
+      }
+    }
+
+    flood();
+
+    for(int tile = 0; tile < 9; tile++)
+      changed[tile] |= m_dirty[tile];
+
+    storeLight(map, array);
+  }
+
+  for(int tile = 0; tile < 9; tile++)
+  {
+    if(m_chunks[tile] == NULL || !changed[tile])
+      continue;
+
+    uint32 mapId;
+    map.posToId(m_chunks[tile]->x, m_chunks[tile]->z, &mapId);
+    m_changed.push_back(mapId);
+  }
+
+  return true;
+}
+
+void LightEngine::commit(Map &map)
+{
+  map.residentBytes += m_memoryDelta;
+  m_memoryDelta      = 0;
+
+  for(unsigned int i = 0; i < m_changed.size(); i++)
+    map.mapChanged[m_changed[i]] = 1;
+  m_changed.clear();
+}
+
+bool LightEngine::generate(Map &map, int x, int z)
+{
+  uint32 mapId;
+  map.posToId(x, z, &mapId);
+
+  std::map<uint32, sChunk *>::iterator it = map.maps.find(mapId);
+  if(it == map.maps.end())
+    return false;
+
+  sChunk *chunk    = it->second;
+  uint8 *heightmap = chunk->heightmap;
+  uint8 highest_y  = 0;
+
+  findChunks(map, x, z);
+  loadBlocks(map);
+
+  // The heightmap is written before the light is stored
+  Backup::get().chunkChanging(chunk);
+
+  // Skylight, air sections above the ground are fully lit. The bottom
+  // section is always lit block by block.
+  loadLight(CHUNK_SKYLIGHT);
+
+  int top_section = CHUNK_SECTIONS;
+  while(top_section > 1 && chunk->isAirSection(top_section-1))
+    top_section--;
+
+  // First set sunlight for all blocks until hit ground, a whole column at
+  // a time. Generated chunks have the ground in the heightmap already, a
+  // height of 127 is ground 126 or 127. Neighbours lit first may have
+  // spread into the seeded light, so it is filled again.
+  for(int block_x = 0; block_x < 16; block_x++)
+  {
+    for(int block_z = 0; block_z < 16; block_z++)
+    {
+      int column   = (16+block_x)*STEP_X | (16+block_z)*STEP_Z;
+      uint8 *light = m_light+column;
+      int ground;
+      if(chunk->skySeeded)
+      {
+        int height = heightmap[block_z+(block_x<<4)];
+        ground     = (height == 127 && m_stop[column | 127] == -16) ? 127 : height-1;
+      }
+      else
+        ground = findLast(m_stop+column, 1, top_section*16, -16);
+
+      if(ground > 0)
+      {
+        //Calculate heightmap while looping this
+        heightmap[block_z+(block_x<<4)] = ((ground==127)?ground:ground+1);
+        if(ground>highest_y)
+        {
+          highest_y=ground;
+        }
+      }
+      else
+      {
+        ground = 1;
+      }
+
+      fillLight(light, 0, ground, 0);
+      fillLight(light, ground, 128, 15);
+    }
+  }
+  chunk->skySeeded = false;
+
+  // Loop again and now spread the light
+  for(int block_x = 0; block_x < 16; block_x++)
+  {
+    for(int block_z = 0; block_z < 16; block_z++)
+    {
+      int column = (16+block_x)*STEP_X | (16+block_z)*STEP_Z;
+
+      //Start from highest pos of the chunk, light of higher neighboring
+      // chunks comes in when the faces are stitched
+      for(int block_y = highest_y; block_y >= 0; block_y--)
+      {
+        int stop = m_stop[column | block_y];
+
+        m_light[column | block_y] = 0;
+
+        if(stop == -16)
+          break;
+
+        spread(column | block_y, 15+stop);
+      }
+    }
+  }
+
+  m_dirty[CENTER] = true;
+  storeLight(map, CHUNK_SKYLIGHT);
+
+  // Blocklight
+  loadLight(CHUNK_BLOCKLIGHT);
+
+  for(int block_x = 0; block_x < 16; block_x++)
+  {
+    for(int block_z = 0; block_z < 16; block_z++)
+      fillLight(m_light+((16+block_x)*STEP_X | (16+block_z)*STEP_Z), 0, 128, 0);
+  }
+
+  for(int block_x = 0; block_x < 16; block_x++)
+  {
+    for(int block_z = 0; block_z < 16; block_z++)
+    {
+      int column          = (16+block_x)*STEP_X | (16+block_z)*STEP_Z;
+      const uint8 *blocks = m_blocks+(block_z*128+block_x*2048);
+
+      //Start searching from first block pos
+      for(int block_y = heightmap[block_z+(block_x<<4)]; block_y >= 0; block_y--)
+      {
+        // If light emitting block
+        if(map.emitLight[blocks[block_y]])
+          spread(column | block_y, map.emitLight[blocks[block_y]]);
+      }
+    }
+  }
+
+  m_dirty[CENTER] = true;
+  storeLight(map, CHUNK_BLOCKLIGHT);
+
+  chunk->lightPopulated = true;
+
+  // Share arrays written by block changes with identical arrays again
+  for(int tile = 0; tile < 9; tile++)
+  {
+    if(m_chunks[tile] == NULL)
+      continue;
+
+    size_t usedBefore = m_chunks[tile]->memoryUsage();
+    m_chunks[tile]->compact();
+    m_memoryDelta += m_chunks[tile]->memoryUsage()-usedBefore;
+  }
+
+  return true;
+}
+
+int LightEngine::source(Map &map, int array, int cell)
+{
+  sChunk *chunk = chunkAt(cell);
+  int block_x   = blockX(cell);
+  int block_y   = cell & 127;
+  int block_z   = blockZ(cell);
+  uint8 block   = chunk->getBlock(block_x, block_y, block_z);
+
+  if(array == CHUNK_BLOCKLIGHT)
+    return map.emitLight[block];
+
+  // Sky lights the blocks above the ground
+  if(block_y < chunk->heightmap[block_z+(block_x<<4)])
+    return 0;
+
+  return 15+map.stopLight[block];
+}
+
+void LightEngine::spreadChunks(Map &map, int array, int cell, int light)
+{
+  if(light < 1)
+    return;
+
+  for(;;)
+  {
+    for(int direction = 0; direction < 6; direction++)
+    {
+      int next      = neighbour(cell, direction);
+      sChunk *chunk = (next >= 0) ? chunkAt(next) : NULL;
+      if(chunk == NULL)
+        continue;
+
+      int block_x = blockX(next);
+      int block_y = next & 127;
+      int block_z = blockZ(next);
+      int stop    = map.stopLight[chunk->getBlock(block_x, block_y, block_z)];
+      int value   = light+stop-1;
+
+      if(chunk->getNibble(array, block_x, block_y, block_z) >= value)
+        continue;
+
+      chunk->setNibble(array, block_x, block_y, block_z, value);
+      m_dirty[(next >> 17)*3+((next >> 11) & 3)] = true;
+
+      if(stop != -16 && !m_queued[next])
+      {
+        m_queued[next]  = 1;
+        m_queue[m_tail] = next;
+        m_tail          = (m_tail+1) & QUEUE_MASK;
+      }
+    }
+
+    if(m_head == m_tail)
+      break;
+
+    cell           = m_queue[m_head];
+    m_head         = (m_head+1) & QUEUE_MASK;
+    m_queued[cell] = 0;
+    light          = chunkAt(cell)->getNibble(array, blockX(cell), cell & 127, blockZ(cell));
+  }
+}
+
+void LightEngine::removeLight(Map &map, int array)
+{
+  m_sources.clear();
+
+  while(m_head != m_tail)
+  {
+    int cell  = m_queue[m_head] & 0xffffff;
+    int light = m_queue[m_head] >> 24;
+    m_head    = (m_head+1) & QUEUE_MASK;
+
+    for(int direction = 0; direction < 6; direction++)
+    {
+      int next      = neighbour(cell, direction);
+      sChunk *chunk = (next >= 0) ? chunkAt(next) : NULL;
+      if(chunk == NULL)
+        continue;
+
+      int block_x = blockX(next);
+      int block_y = next & 127;
+      int block_z = blockZ(next);
+      int current = chunk->getNibble(array, block_x, block_y, block_z);
+
+      // Darker neighbours may have been lit through the cell, brighter
+      // ones are lit from elsewhere and spread their light back
+      if(current == 0 || current < light)
+      {
+        if(current != 0)
+        {
+          chunk->setNibble(array, block_x, block_y, block_z, 0);
+          m_dirty[(next >> 17)*3+((next >> 11) & 3)] = true;
+
+          // Cleared once, so queued once
+          m_queue[m_tail] = (current << 24) | next;
+          m_tail          = (m_tail+1) & QUEUE_MASK;
+        }
+
+        if(source(map, array, next) > 0)
+          m_sources.push_back(next);
+      }
+      else
+        m_sources.push_back(next);
+    }
+  }
+}
+
+bool LightEngine::update(Map &map, int x, int y, int z, uint8 oldType)
+{
+  findChunks(map, blockToChunk(x), blockToChunk(z));
+
+  sChunk *chunk = m_chunks[CENTER];
+  if(chunk == NULL)
+    return false;
+
+  // Light is written in place, into any of the chunks around the block
+  for(int tile = 0; tile < 9; tile++)
+  {
+    if(m_chunks[tile] != NULL)
+      Backup::get().chunkChanging(m_chunks[tile]);
+  }
+
+  int block_x     = blockToChunkBlock(x);
+  int block_z     = blockToChunkBlock(z);
+  int column      = (16+block_x)*STEP_X | (16+block_z)*STEP_Z;
+  uint8 newType   = chunk->getBlock(block_x, y, block_z);
+  uint8 &height   = chunk->heightmap[block_z+(block_x<<4)];
+  int oldHeight   = height;
+
+  // Ground of the column, blocks between the old and the new ground lose
+  // or get the sky
+  if(map.stopLight[newType] == -16 && y >= oldHeight)
+    height = (y == 127) ? y : y+1;
+  else if(map.stopLight[oldType] == -16 && map.stopLight[newType] != -16 && y+1 >= oldHeight)
+  {
+    height = 0;
+    for(int block_y = y-1; block_y >= 0; block_y--)
+    {
+      if(map.stopLight[chunk->getBlock(block_x, block_y, block_z)] == -16)
+      {
+        height = block_y+1;
+        break;
+      }
+    }
+  }
+  int newHeight = height;
+
+  for(int array = CHUNK_BLOCKLIGHT; array <= CHUNK_SKYLIGHT; array++)
+  {
+    int oldSource;
+    if(array == CHUNK_BLOCKLIGHT)
+      oldSource = map.emitLight[oldType];
+    else
+      oldSource = (y >= oldHeight) ? 15+map.stopLight[oldType] : 0;
+
+    m_head = m_tail = 0;
+
+    // The changed block and the blocks the sky does not reach anymore
+    for(int block_y = 0; block_y < 128; block_y++)
+    {
+      int light;
+      if(block_y == y)
+        light = std::max(oldSource, 0);
+      else if(array == CHUNK_SKYLIGHT && block_y >= oldHeight && block_y < newHeight)
+        light = 15+map.stopLight[chunk->getBlock(block_x, block_y, block_z)];
+      else
+        continue;
+
+      light = std::max(light, (int)chunk->getNibble(array, block_x, block_y, block_z));
+      chunk->setNibble(array, block_x, block_y, block_z, 0);
+
+      m_queue[m_tail] = (light << 24) | column | block_y;
+      m_tail          = (m_tail+1) & QUEUE_MASK;
+    }
+    m_dirty[CENTER] = true;
+
+    removeLight(map, array);
+
+    // The new block and the blocks the sky reaches now
+    m_sources.push_back(column | y);
+    if(array == CHUNK_SKYLIGHT)
+    {
+      for(int block_y = newHeight; block_y < oldHeight; block_y++)
+        m_sources.push_back(column | block_y);
+    }
+
+    m_head = m_tail = 0;
+    for(unsigned int i = 0; i < m_sources.size(); i++)
+    {
+      int cell    = m_sources[i];
+      int current = chunkAt(cell)->getNibble(array, blockX(cell), cell & 127, blockZ(cell));
+      spreadChunks(map, array, cell, std::max(current, source(map, array, cell)));
+    }
+  }
+
+  for(int tile = 0; tile < 9; tile++)
+  {
+    if(m_chunks[tile] == NULL || !m_dirty[tile])
+      continue;
+
+    uint32 mapId;
+    map.posToId(m_chunks[tile]->x, m_chunks[tile]->z, &mapId);
+    map.mapChanged[mapId] = 1;
+    map.residentBytes    += m_chunks[tile]->memoryUsage()-m_usedBefore[tile];
+  }
+
+  return true;
+}
+
+class LightJob : public Job
+{
+public:
+  LightJob(LightPool *pool, Map *map, int x, int z, bool stitch)
+    : pool(pool), map(map), x(x), z(z), stitch(stitch)
+  {
+  }
+
+  void run()
+  {
+    pool->m_mutex.lock();
+    LightEngine *engine = pool->m_free.back();
+    pool->m_free.pop_back();
+    pool->m_mutex.unlock();
+
+    if(stitch)
+      engine->stitch(*map, x, z);
+    else
+      engine->generate(*map, x, z);
+
+    pool->m_mutex.lock();
+    pool->m_free.push_back(engine);
+    if(--pool->m_running == 0)
+      pool->m_cond.signal();
+    pool->m_mutex.unlock();
+
+    delete this;
+  }
+
+private:
+  LightPool *pool;
+  Map *map;
+  int x;
+  int z;
+  bool stitch;
+};
+
+LightPool::LightPool() : m_running(0)
+{
+}
+
+LightPool::~LightPool()
+{
+  stop();
+}
+
+void LightPool::start(int threads)
+{
+  m_threads.start(threads);
+
+  // One engine per running job
+  for(int i = 0; i < m_threads.threadCount(); i++)
+  {
+    m_engines.push_back(new LightEngine);
+    m_free.push_back(m_engines.back());
+  }
+}
+
+void LightPool::stop()
+{
+  m_threads.stop();
+
+  for(unsigned int i = 0; i < m_engines.size(); i++)
+    delete m_engines[i];
+  m_engines.clear();
+  m_free.clear();
+}
+
+void LightPool::run(Map &map, const std::vector<uint32> &mapIds, bool stitch)
+{
+  std::vector<std::pair<int, int> > rounds[9];
+  for(unsigned int i = 0; i < mapIds.size(); i++)
+  {
+    int x, z;
+    map.idToPos(mapIds[i], &x, &z);
+    rounds[round(x, z)].push_back(std::make_pair(x, z));
+  }
+
+  for(int round = 0; round < 9; round++)
+  {
+    if(rounds[round].empty())
+      continue;
+
+    m_mutex.lock();
+    m_running = (int)rounds[round].size();
+    m_mutex.unlock();
+
+    for(unsigned int i = 0; i < rounds[round].size(); i++)
+      m_threads.push(new LightJob(this, &map, rounds[round][i].first, rounds[round][i].second, stitch));
+
+    m_mutex.lock();
+    while(m_running > 0)
+      m_cond.wait(m_mutex);
+    m_mutex.unlock();
+  }
+
+  for(unsigned int i = 0; i < m_engines.size(); i++)
+    m_engines[i]->commit(map);
+}
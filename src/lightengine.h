@@ -0,0 +1,235 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LIGHTENGINE_H
+#define _LIGHTENGINE_H
+
+#include <vector>
+#include "tools.h"
+#include "thread.h"
+
+class Map;
+struct sChunk;
+
+// Spreads light breadth-first over a flat copy of a chunk and its eight
+// neighbours instead of looking up the chunk for every step. Light only
+// goes as far as the neighbours, it weakens by at least one per block.
+class LightEngine
+{
+public:
+  LightEngine();
+  ~LightEngine();
+
+  // Relight a loaded chunk, see Map::generateLightMaps. Light spreads into
+  // the loaded neighbours, false if the chunk is not loaded.
+  bool generate(Map &map, int x, int z);
+
+  // Update the light around block x,y,z after it changed from oldType.
+  // Light that came through the old block is removed and spread again
+  // from the edge of the removed area, so the cost is proportional to the
+  // area that changes. Chunks whose light changed are marked changed.
+  bool update(Map &map, int x, int y, int z, uint8 oldType);
+
+  // Spread light across the faces a lit chunk shares with its lit
+  // neighbours, both ways. Chunks lit by themselves or loaded at different
+  // times then get the light of the other side. False if the chunk is not
+  // loaded or not lit.
+  bool stitch(Map &map, int x, int z);
+
+  // generate() and stitch() only touch the chunks of the window, so they
+  // can run on other threads. The memory used and the chunks whose light
+  // changed are kept until commit() hands them to the map on the main
+  // thread.
+  void commit(Map &map);
+
+private:
+  enum
+  {
+    // Cells are indexed y | z << 7 | x << 13 with x and z 0-47, the chunk
+    // being lit is at 16-31
+    STEP_Z       = 1 << 7,
+    STEP_X       = 1 << 13,
+    WINDOW_CELLS = 48*STEP_X,
+    // Cells are queued once at a time, the queue never fills up
+    QUEUE_SIZE   = 1 << 19,
+    QUEUE_MASK   = QUEUE_SIZE-1,
+
+    CENTER       = 4
+  };
+
+  // Light of the array being worked on and how much each block takes
+  // away, opaque blocks and missing chunks -16
+  uint8 *m_light;
+  sint8 *m_stop;
+  uint8 *m_queued;
+  uint32 *m_queue;
+  uint32 m_head;
+  uint32 m_tail;
+
+  // Chunks of the window by (x+1)*3+(z+1), NULL if not loaded
+  sChunk *m_chunks[9];
+  // Light changed in the chunk
+  bool m_dirty[9];
+
+  // Blocks of the chunk being lit in the chunk file layout, and a buffer
+  // for copying arrays
+  uint8 *m_blocks;
+  uint8 *m_buffer;
+
+  // Cells to spread light from again after a removal
+  std::vector<uint32> m_sources;
+  // Memory used by the chunks before an update
+  size_t m_usedBefore[9];
+
+  // Not committed yet
+  size_t m_memoryDelta;
+  std::vector<uint32> m_changed;
+
+  void loadBlocks(Map &map);
+  void loadLight(int array);
+  void storeLight(Map &map, int array);
+
+  // Spread light from a cell as the recursive step did:
+  // neighbours darker than light, less what their block takes away, are
+  // raised and spread further
+  void spread(int cell, int light);
+  // Spread the light of the queued cells
+  void flood();
+  // Raise the cells of a column by the light of the column next to it
+  void crossFace(int from, int to);
+
+  // Block updates work on the chunks directly, cells use the window index
+  void findChunks(Map &map, int x, int z);
+  // Clear the light that may have come from the queued cells, entries are
+  // light << 24 | cell. Leaves the cells to spread from in m_sources.
+  void removeLight(Map &map, int array);
+  void spreadChunks(Map &map, int array, int cell, int light);
+  // Light a cell gives its neighbours by itself, torches and sky
+  int source(Map &map, int array, int cell);
+
+  sChunk *chunkAt(int cell) const
+  {
+    return m_chunks[(cell >> 17)*3+((cell >> 11) & 3)];
+  }
+
+  static int blockX(int cell)
+  {
+    return (cell >> 13) & 15;
+  }
+  static int blockZ(int cell)
+  {
+    return (cell >> 7) & 15;
+  }
+
+  // Neighbour of a cell in direction 0-5, -1 if outside of the window
+  static int neighbour(int cell, int direction)
+  {
+    switch(direction)
+    {
+      case 0: return ((cell & 127) < 127) ? cell+1 : -1;
+      case 1: return ((cell & 127) > 0) ? cell-1 : -1;
+      case 2: return (((cell >> 7) & 63) < 47) ? cell+STEP_Z : -1;
+      case 3: return (((cell >> 7) & 63) > 0) ? cell-STEP_Z : -1;
+      case 4: return ((cell >> 13) < 47) ? cell+STEP_X : -1;
+      default: return ((cell >> 13) > 0) ? cell-STEP_X : -1;
+    }
+  }
+
+  void raise(int cell, int light)
+  {
+    int stop  = m_stop[cell];
+    int value = light+stop-1;
+
+    if(m_light[cell] >= value)
+      return;
+
+    m_light[cell] = value;
+    m_dirty[(cell >> 17)*3+((cell >> 11) & 3)] = true;
+
+    if(stop != -16)
+      push(cell);
+  }
+
+  // Queue a cell to spread its light, once at a time
+  void push(int cell)
+  {
+    if(m_queued[cell])
+      return;
+
+    m_queued[cell]  = 1;
+    m_queue[m_tail] = cell;
+    m_tail          = (m_tail+1) & QUEUE_MASK;
+  }
+
+  LightEngine(const LightEngine &);
+  LightEngine &operator=(const LightEngine &);
+};
+
+// Lights many chunks at once on worker threads with an engine each. Chunks
+// closer than three chunks share part of their window, so they are lit in
+// nine rounds by position modulo three and no two windows overlap.
+class LightPool
+{
+public:
+  LightPool();
+  ~LightPool();
+
+  void start(int threads);
+  void stop();
+
+  int threadCount() const
+  {
+    return m_threads.threadCount();
+  }
+
+  // Relight or stitch the loaded chunks and wait until all are done. The
+  // main thread must not touch the map meanwhile.
+  void run(Map &map, const std::vector<uint32> &mapIds, bool stitch);
+
+  // Round 0-8 of a chunk, lighting in the same order without threads gives
+  // the same light
+  static int round(int x, int z)
+  {
+    return ((x%3+3)%3)*3+(z%3+3)%3;
+  }
+
+private:
+  friend class LightJob;
+
+  ThreadPool m_threads;
+  std::vector<LightEngine *> m_engines;
+  std::vector<LightEngine *> m_free;
+  // Jobs of the round still running
+  int m_running;
+  Mutex m_mutex;
+  Condition m_cond;
+
+  LightPool(const LightPool &);
+  LightPool &operator=(const LightPool &);
+};
+
+#endif
@@ -0,0 +1,187 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LIGHTKERNELS_H
+#define _LIGHTKERNELS_H
+
+// Vector kernels for light arrays, with a scalar version for other
+// compilers and processors. AVX2 is used when the compiler targets it
+// (e.g. -mavx2 or -march=native), SSE2 on every x86-64 build.
+//
+// Light arrays hold one value per byte, nibble arrays two per byte with
+// the even block in the low nibble as in the chunk files.
+
+#include <string.h>
+#include "tools.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #define LIGHT_SSE2
+  #include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+  #define LIGHT_AVX2
+  #include <immintrin.h>
+#endif
+
+// Nibble array of bytes bytes to a light array of 2*bytes values, bytes is
+// a multiple of 32
+inline void unpackNibbles(const uint8 *src, uint8 *dst, int bytes)
+{
+  int i = 0;
+#if defined(LIGHT_AVX2)
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  for(; i < bytes; i += 32)
+  {
+    __m256i packed = _mm256_loadu_si256((const __m256i *)(src+i));
+    __m256i low    = _mm256_and_si256(packed, mask);
+    __m256i high   = _mm256_and_si256(_mm256_srli_epi16(packed, 4), mask);
+    // Interleaving works within 128-bit lanes, put the halves in order
+    __m256i first  = _mm256_unpacklo_epi8(low, high);
+    __m256i second = _mm256_unpackhi_epi8(low, high);
+    _mm256_storeu_si256((__m256i *)(dst+i*2), _mm256_permute2x128_si256(first, second, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst+i*2+32), _mm256_permute2x128_si256(first, second, 0x31));
+  }
+#elif defined(LIGHT_SSE2)
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  for(; i < bytes; i += 16)
+  {
+    __m128i packed = _mm_loadu_si128((const __m128i *)(src+i));
+    __m128i low    = _mm_and_si128(packed, mask);
+    __m128i high   = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+    _mm_storeu_si128((__m128i *)(dst+i*2), _mm_unpacklo_epi8(low, high));
+    _mm_storeu_si128((__m128i *)(dst+i*2+16), _mm_unpackhi_epi8(low, high));
+  }
+#endif
+  for(; i < bytes; i++)
+  {
+    dst[i*2]   = src[i] & 0x0f;
+    dst[i*2+1] = src[i] >> 4;
+  }
+}
+
+// Light array of 2*bytes values, each 0-15, to a nibble array of bytes
+// bytes, bytes is a multiple of 32
+inline void packNibbles(const uint8 *src, uint8 *dst, int bytes)
+{
+  int i = 0;
+#if defined(LIGHT_AVX2)
+  const __m256i mask = _mm256_set1_epi16(0x00ff);
+  for(; i < bytes; i += 32)
+  {
+    // Pairs of values as 16-bit words, low | high << 4 in the low byte
+    __m256i first  = _mm256_loadu_si256((const __m256i *)(src+i*2));
+    __m256i second = _mm256_loadu_si256((const __m256i *)(src+i*2+32));
+    first          = _mm256_and_si256(_mm256_or_si256(first, _mm256_srli_epi16(first, 4)), mask);
+    second         = _mm256_and_si256(_mm256_or_si256(second, _mm256_srli_epi16(second, 4)), mask);
+    // Packing works within 128-bit lanes, put the quarters in order
+    __m256i packed = _mm256_packus_epi16(first, second);
+    _mm256_storeu_si256((__m256i *)(dst+i), _mm256_permute4x64_epi64(packed, 0xd8));
+  }
+#elif defined(LIGHT_SSE2)
+  const __m128i mask = _mm_set1_epi16(0x00ff);
+  for(; i < bytes; i += 16)
+  {
+    __m128i first  = _mm_loadu_si128((const __m128i *)(src+i*2));
+    __m128i second = _mm_loadu_si128((const __m128i *)(src+i*2+16));
+    first          = _mm_and_si128(_mm_or_si128(first, _mm_srli_epi16(first, 4)), mask);
+    second         = _mm_and_si128(_mm_or_si128(second, _mm_srli_epi16(second, 4)), mask);
+    _mm_storeu_si128((__m128i *)(dst+i), _mm_packus_epi16(first, second));
+  }
+#endif
+  for(; i < bytes; i++)
+    dst[i] = src[i*2] | (src[i*2+1] << 4);
+}
+
+// dst = max(dst, src) for count light values, true if any value was raised
+inline bool maxLight(uint8 *dst, const uint8 *src, int count)
+{
+  int i       = 0;
+  bool raised = false;
+#if defined(LIGHT_AVX2)
+  for(; i+32 <= count; i += 32)
+  {
+    __m256i current = _mm256_loadu_si256((const __m256i *)(dst+i));
+    __m256i result  = _mm256_max_epu8(current, _mm256_loadu_si256((const __m256i *)(src+i)));
+    raised         |= (_mm256_movemask_epi8(_mm256_cmpeq_epi8(current, result)) != -1);
+    _mm256_storeu_si256((__m256i *)(dst+i), result);
+  }
+#elif defined(LIGHT_SSE2)
+  for(; i+16 <= count; i += 16)
+  {
+    __m128i current = _mm_loadu_si128((const __m128i *)(dst+i));
+    __m128i result  = _mm_max_epu8(current, _mm_loadu_si128((const __m128i *)(src+i)));
+    raised         |= (_mm_movemask_epi8(_mm_cmpeq_epi8(current, result)) != 0xffff);
+    _mm_storeu_si128((__m128i *)(dst+i), result);
+  }
+#endif
+  for(; i < count; i++)
+  {
+    if(src[i] > dst[i])
+    {
+      dst[i] = src[i];
+      raised = true;
+    }
+  }
+  return raised;
+}
+
+// Set values from to to-1 of a light column
+inline void fillLight(uint8 *column, int from, int to, uint8 value)
+{
+  // memset is vectorized by the C library already
+  if(to > from)
+    memset(column+from, value, to-from);
+}
+
+// Highest index from to-1 down to low whose value is key, low-1 if none
+inline int findLast(const sint8 *column, int low, int to, sint8 key)
+{
+  int i = to;
+#if defined(LIGHT_SSE2)
+  const __m128i keys = _mm_set1_epi8(key);
+  while(i-16 >= low)
+  {
+    int found = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(column+i-16)), keys));
+    if(found)
+    {
+      int bit = 15;
+      while(!(found & (1 << bit)))
+        bit--;
+      return i-16+bit;
+    }
+    i -= 16;
+  }
+#endif
+  while(--i >= low)
+  {
+    if(column[i] == key)
+      return i;
+  }
+  return low-1;
+}
+
+#endif
@@ -52,6 +52,9 @@
 #include "tools.h"
 #include "map.h"
 #include "mapgen.h"
+#include "chunkprovider.h"
+#include "journal.h"
+#include "backup.h"
 
 #include "user.h"
 #include "nbt.h"
@@ -90,6 +93,17 @@ void Map::initMap()
     exit(EXIT_FAILURE);
   }
 
+  releaseTime  = Conf::get().iValue("map_release_time");
+  warmTime     = Conf::get().iValue("map_warm_time");
+  memoryBudget = (size_t)Conf::get().iValue("map_memory_budget")*1024*1024;
+
+  // Bulk lighting on the main thread only with one thread
+  int lightThreads = Conf::get().iValue("map_light_threads");
+  if(lightThreads <= 0)
+    lightThreads = Thread::cpuCount();
+  if(lightThreads > 1)
+    lightPool.start(lightThreads);
+
   std::string infile = mapDirectory+"/level.dat";
 
   struct stat stFileInfo;
@@ -107,17 +121,54 @@ void Map::initMap()
   spawnPos.y() = (sint32)*data["SpawnY"];
   spawnPos.z() = (sint32)*data["SpawnZ"];
 
+  // Maps without a seed keep the terrain of the fixed seed used before
+  mapSeed = Conf::get().iValue("map_seed");
+  if(mapSeed == 0 && data["RandomSeed"] != NULL)
+  {
+    sint64 seed = (sint64)*data["RandomSeed"];
+    mapSeed     = (sint32)(seed ^ (seed >> 32));
+  }
+  if(mapSeed == 0)
+    mapSeed = 12345678;
+
+  mapGen = new MapGen(mapSeed);
 
   root->SaveToFile("test.nbt");
 
   delete root;
 
+  if(!storage.init(mapDirectory))
+  {
+    std::cout << "Error, unable to open region files!" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Changes since the last save of a crashed run
+  bool journal = Conf::get().bValue("map_journal");
+  int replayed = Journal::get().replay(mapDirectory);
+
+  if(journal)
+    Journal::get().init(mapDirectory);
+
+  if(replayed)
+  {
+    saveWholeMap();
+
+    // Not journaling, the replayed records must not be applied again
+    if(!journal)
+      remove((mapDirectory+"/journal.dat").c_str());
+  }
+
   std::cout << "Spawn: (" << spawnPos.x() << "," << spawnPos.y() << "," << spawnPos.z() << ")"<<
   std::endl;
 }
 
 void Map::freeMap()
 {
+  lightPool.stop();
+
+  delete mapGen;
+  mapGen = NULL;
 }
 
 sChunk *Map::getMapData(int x, int z, bool generate)
@@ -131,14 +182,28 @@ sChunk *Map::getMapData(int x, int z, bool generate)
 #ifdef MSDBG
   printf("Getting data for chunk %u\n", mapId);
 #endif
-  if(!maps.count(mapId) && (!generate || !loadMap(x, z, generate)))
-    return 0;
+  if(!maps.count(mapId))
+  {
+    if(!generate)
+      return 0;
+
+    // Load in the background, the chunk is available on a later tick.
+    // Compressed chunks come back right away.
+    if(ChunkProvider::get().isEnabled() && !thawMap(x, z))
+    {
+      ChunkProvider::get().request(x, z);
+      return 0;
+    }
+
+    if(!loadMap(x, z, generate))
+      return 0;
+  }
 
   // Update last used time
-  mapLastused[mapId] = (int)time(0);
+  touchMap(mapId);
 
   // Data in memory
-  return &maps[mapId];
+  return maps[mapId];
 }
 
 bool Map::saveWholeMap()
@@ -147,8 +212,8 @@ bool Map::saveWholeMap()
   printf("saveWholeMap()\n");
 #endif
 
-  for(std::map<uint32, sChunk>::const_iterator it = maps.begin(); it != maps.end(); ++it)
-    saveMap(maps[it->first].x, maps[it->first].z);
+  for(std::map<uint32, sChunk *>::const_iterator it = maps.begin(); it != maps.end(); ++it)
+    saveMap(it->second->x, it->second->z);
   return true;
 }
 
@@ -158,209 +223,97 @@ bool Map::generateLightMaps(int x, int z)
   printf("generateLightMaps(x=%d, z=%d)\n", x, z);
 #endif
 
-  uint32 mapId;
-  Map::posToId(x, z, &mapId);
-
-  uint8 highest_y = 0;
+  if(!lightEngine.generate(*this, x, z))
+    return false;
 
-  uint8 *skylight   = maps[mapId].skylight;
-  uint8 *blocklight = maps[mapId].blocklight;
-  uint8 *blocks     = maps[mapId].blocks;
-  uint8 *heightmap  = maps[mapId].heightmap;
+  lightEngine.commit(*this);
 
-  // Clear lightmaps
-  memset(blocklight, 0, 16*16*128/2);
-  memset(skylight, 0, 16*16*128/2);
+  // Light of the neighbours comes in once the faces are stitched
+  uint32 mapId;
+  posToId(x, z, &mapId);
+  lightBorders.insert(mapId);
 
-  // Skylight
+  return true;
+}
 
-  // First set sunlight for all blocks until hit ground
-  for(int block_x = 0; block_x < 16; block_x++)
+void Map::lightMaps(const std::vector<uint32> &mapIds, bool stitch)
+{
+  if(lightPool.threadCount() == 0 || mapIds.size() < 2)
   {
-    for(int block_z = 0; block_z < 16; block_z++)
+    for(int round = 0; round < 9; round++)
     {
-      for(int block_y = 127; block_y > 0; block_y--)
+      for(unsigned int i = 0; i < mapIds.size(); i++)
       {
-        int index      = block_y + (block_z * 128) + (block_x * 128 * 16);
-        int absolute_x = x*16+block_x;
-        int absolute_z = z*16+block_z;
-        uint8 block    = blocks[index];
-
-        setBlockLight(absolute_x, block_y, absolute_z, 0, 15, 2);
-
-        if(stopLight[block] == -16)
-        {
-          //Calculate heightmap while looping this
-          heightmap[block_z+(block_x<<4)] = ((block_y==127)?block_y:block_y+1);
-          if(block_y>highest_y)
-          {
-            highest_y=block_y;
-          }
-          break;
-        }
-      }
-    }
-  }
+        int x, z;
+        idToPos(mapIds[i], &x, &z);
+        if(LightPool::round(x, z) != round)
+          continue;
 
-  // Loop again and now spread the light
-  for(int block_x = 0; block_x < 16; block_x++)
-  {
-    for(int block_z = 0; block_z < 16; block_z++)
-    {
-      //Start from highest pos of the chunk, might still mess lighting
-      // if neighboring chunks are higher..
-      for(int block_y = highest_y; block_y >= 0; block_y--)
-      {
-        int index      = block_y + (block_z * 128) + (block_x * 128 * 16);
-        int absolute_x = x*16+block_x;
-        int absolute_z = z*16+block_z;
-        uint8 block    = blocks[index];
-
-        if(stopLight[block] == -16)
-        {
-          setBlockLight(absolute_x, block_y, absolute_z, 15+stopLight[block], 0, 2);
-          break;
-        }
+        if(stitch)
+          stitchLight(x, z);
         else
-        {
-          setBlockLight(absolute_x, block_y, absolute_z, 0, 0, 2);
-          lightmapStep(absolute_x, block_y, absolute_z, 15+stopLight[block]);
-        }
+          generateLightMaps(x, z);
       }
     }
+    return;
   }
 
-  // Blocklight
-  for(uint8 block_x = 0; block_x < 16; block_x++)
+  lightPool.run(*this, mapIds, stitch);
+
+  for(unsigned int i = 0; i < mapIds.size(); i++)
   {
-    for(uint8 block_z = 0; block_z < 16; block_z++)
-    {
-      //Start searching from first block pos
-      for(int block_y = heightmap[block_z+(block_x<<4)]; block_y >= 0; block_y--)
-      {
-        int index = block_y + (block_z * 128) + (block_x * 128 * 16);
-
-        // If light emitting block
-        if(emitLight[blocks[index]])
-        {
-          int absolute_x = x*16+block_x;
-          int absolute_z = z*16+block_z;
-          blocklightmapStep(absolute_x, block_y, absolute_z, emitLight[blocks[index]]);
-        }
-      }
-    }
+    if(stitch)
+      lightBorders.erase(mapIds[i]);
+    else if(maps.count(mapIds[i]))
+      lightBorders.insert(mapIds[i]);
   }
-
-  return true;
 }
 
-bool Map::blocklightmapStep(int x, int y, int z, int light)
+void Map::invalidateLight(uint32 mapId)
 {
-#ifdef MSDBG
-  printf("blocklightmapStep(x=%d, y=%d, z=%d, light=%d)\n", x, y, z, light);
-#endif
-
-  uint8 block, meta;
+  std::map<uint32, sChunk *>::iterator chunk = maps.find(mapId);
+  if(chunk == maps.end())
+    return;
 
-  // If no light, stop!
-  if(light < 1)
-    return false;
+  chunk->second->lightPopulated = false;
+  lightDirty.insert(mapId);
+}
 
-  for(uint8 i = 0; i < 6; i++)
+void Map::relightMaps()
+{
+  std::vector<uint32> mapIds;
+  for(std::set<uint32>::const_iterator it = lightDirty.begin(); it != lightDirty.end(); ++it)
   {
-    // Going too high
-    if((y == 127) && (i == 2))
-      i++;
-    // going negative
-    else if((y == 0) && (i == 3))
-      i++;
-
-    int x_local = x;
-    int y_local = y;
-    int z_local = z;
-
-    switch(i)
-    {
-      case 0: x_local++; break;
-      case 1: x_local--; break;
-      case 2: y_local++; break;
-      case 3: y_local--; break;
-      case 4: z_local++; break;
-      case 5: z_local--; break;
-    }
-
-    if(getBlock(x_local, y_local, z_local, &block, &meta, false))
-    {
-      uint8 blocklight, skylight;
-
-      getBlockLight(x_local, y_local, z_local, &blocklight, &skylight);
+    std::map<uint32, sChunk *>::iterator chunk = maps.find(*it);
+    if(chunk != maps.end() && !chunk->second->lightPopulated)
+      mapIds.push_back(*it);
+  }
+  lightDirty.clear();
 
-      if(blocklight < light+stopLight[block]-1)
-      {
-        setBlockLight(x_local, y_local, z_local, light+stopLight[block]-1, 0, 1);
+  lightMaps(mapIds, false);
 
-        if(stopLight[block] != -16)
-          blocklightmapStep(x_local, y_local, z_local, light+stopLight[block]-1);
-      }
-    }
+  mapIds.clear();
+  for(std::set<uint32>::const_iterator it = lightBorders.begin(); it != lightBorders.end(); ++it)
+  {
+    if(maps.count(*it))
+      mapIds.push_back(*it);
   }
+  lightBorders.clear();
 
-  return true;
+  lightMaps(mapIds, true);
 }
 
-bool Map::lightmapStep(int x, int y, int z, int light)
+bool Map::stitchLight(int x, int z)
 {
 #ifdef MSDBG
-  printf("lightmapStep(x=%d, y=%d, z=%d, light=%d)\n", x, y, z, light);
+  printf("stitchLight(x=%d, z=%d)\n", x, z);
 #endif
 
-  uint8 block, meta;
-
-  // If no light, stop!
-  if(light < 1)
-    return false;
-
-  for(uint8 i = 0; i < 6; i++)
-  {
-    // Going too high
-    if(y == 127 && i == 2)
-      i++;
-    // going negative
-    else if(y == 0 && i == 3)
-      i++;
-
-    int x_local = x;
-    int y_local = y;
-    int z_local = z;
-
-    switch(i)
-    {
-      case 0: x_local++; break;
-      case 1: x_local--; break;
-      case 2: y_local++; break;
-      case 3: y_local--; break;
-      case 4: z_local++; break;
-      case 5: z_local--; break;
-    }
-
-    //printf("getBlock(%d, %d, %d) (lightmapStep)\n", x_local, y_local, z_local);
-    if(getBlock(x_local, y_local, z_local, &block, &meta, false))
-    {
-      uint8 blocklight, skylight;
-
-      getBlockLight(x_local, y_local, z_local, &blocklight, &skylight);
-
-      if(skylight < light+stopLight[block]-1)
-      {
-        setBlockLight(x_local, y_local, z_local, 0, light+stopLight[block]-1, 2);
-
-        if(stopLight[block] != -16)
-          lightmapStep(x_local, y_local, z_local, light+stopLight[block]-1);
-      }
-    }
-  }
+  uint32 mapId;
+  posToId(x, z, &mapId);
+  lightBorders.erase(mapId);
 
-  return true;
+  return lightEngine.stitch(*this, x, z);
 }
 
 bool Map::getBlock(int x, int y, int z, uint8 *type, uint8 *meta, bool generate)
@@ -386,7 +339,7 @@ bool Map::getBlock(int x, int y, int z, uint8 *type, uint8 *meta, bool generate)
 
   if(!chunk)
   {
-    if(generate)
+    if(generate && !ChunkProvider::get().isPending(chunk_x, chunk_z))
      LOG("Loading chunk failed (getBlock)");
     return false;
   }
@@ -394,22 +347,9 @@ bool Map::getBlock(int x, int y, int z, uint8 *type, uint8 *meta, bool generate)
   int chunk_block_x  = blockToChunkBlock(x);
   int chunk_block_z  = blockToChunkBlock(z);
 
-  uint8 *blocks      = chunk->blocks;
-  uint8 *metapointer = chunk->data;
-  int index          = y + (chunk_block_z * 128) + (chunk_block_x * 128 * 16);
-  *type = blocks[index];
-  uint8 metadata     = metapointer[(index)>>1];
-
-  if(y%2)
-  {
-    metadata  &= 0xf0;
-    metadata >>= 4;
-  }
-  else
-    metadata &= 0x0f;
-
-  *meta              = metadata;
-  mapLastused[mapId] = (int)time(0);
+  *type = chunk->getBlock(chunk_block_x, y, chunk_block_z);
+  *meta = chunk->getNibble(CHUNK_DATA, chunk_block_x, y, chunk_block_z);
+  touchMap(mapId);
 
   return true;
 }
@@ -442,25 +382,8 @@ bool Map::getBlockLight(int x, int y, int z, uint8 *blocklight, uint8 *skylight)
   int chunk_block_x        = blockToChunkBlock(x);
   int chunk_block_z        = blockToChunkBlock(z);
 
-  uint8 *blocklightpointer = chunk->blocklight;
-  uint8 *skylightpointer   = chunk->skylight;
-  int index                = y + (chunk_block_z * 128) + (chunk_block_x * 128 * 16);
-  *blocklight = blocklightpointer[(index)>>1];
-  *skylight   = skylightpointer[(index)>>1];
-
-  if(y%2)
-  {
-    *blocklight  &= 0xf0;
-    *blocklight >>= 4;
-
-    *skylight    &= 0xf0;
-    *skylight   >>= 4;
-  }
-  else
-  {
-    *blocklight &= 0x0f;
-    *skylight   &= 0x0f;
-  }
+  *blocklight = chunk->getNibble(CHUNK_BLOCKLIGHT, chunk_block_x, y, chunk_block_z);
+  *skylight   = chunk->getNibble(CHUNK_SKYLIGHT, chunk_block_x, y, chunk_block_z);
 
   return true;
 }
@@ -491,48 +414,15 @@ bool Map::setBlockLight(int x, int y, int z, uint8 blocklight, uint8 skylight, u
   int chunk_block_x        = blockToChunkBlock(x);
   int chunk_block_z        = blockToChunkBlock(z);
 
-  uint8 *blocklightpointer = chunk->blocklight;
-  uint8 *skylightpointer   = chunk->skylight;
-  int index                = y + (chunk_block_z * 128) + (chunk_block_x * 128 * 16);
-  char skylight_local      = skylightpointer[index>>1];
-  char blocklight_local    = blocklightpointer[index>>1];
-
-  if(y % 2)
-  {
-    if(setLight & 0x6) // 2 or 4
-    {
-      skylight_local &= 0x0f;
-      skylight_local |= skylight<<4;
-    }
-
-    if(setLight & 0x5) // 1 or 4
-    {
-      blocklight_local &= 0x0f;
-      blocklight_local |= blocklight<<4;
-    }
-  }
-  else
-  {
-    if(setLight & 0x6) // 2 or 4
-    {
-      skylight_local &= 0xf0;
-      skylight_local |= skylight;
-    }
-
-    if(setLight & 0x5) // 1 or 4
-    {
-      blocklight_local &= 0xf0;
-      blocklight_local |= blocklight;
-    }
-  }
+  size_t usedBefore = chunk->memoryUsage();
 
   if(setLight & 0x6) // 2 or 4
-
-    skylightpointer[index>>1] = skylight_local;
+    chunk->setNibble(CHUNK_SKYLIGHT, chunk_block_x, y, chunk_block_z, skylight);
 
   if(setLight & 0x5) // 1 or 4
+    chunk->setNibble(CHUNK_BLOCKLIGHT, chunk_block_x, y, chunk_block_z, blocklight);
 
-    blocklightpointer[index>>1] = blocklight_local;
+  residentBytes += chunk->memoryUsage()-usedBefore;
 
   return true;
 }
@@ -556,7 +446,8 @@ bool Map::setBlock(int x, int y, int z, char type, char meta)
   uint32 mapId;
   Map::posToId(chunk_x, chunk_z, &mapId);
 
-  sChunk *chunk = getMapData(chunk_x, chunk_z);
+  // Edits must not be dropped, load synchronously even with asynchronous I/O
+  sChunk *chunk = loadMap(chunk_x, chunk_z) ? getMapData(chunk_x, chunk_z) : 0;
 
   if(!chunk)
   {
@@ -568,26 +459,34 @@ bool Map::setBlock(int x, int y, int z, char type, char meta)
   int chunk_block_x  = ((x < 0) ? (15+((x+1)%16)) : (x%16));
   int chunk_block_z  = ((z < 0) ? (15+((z+1)%16)) : (z%16));
 
-  uint8 *blocks      = chunk->blocks;
-  uint8 *metapointer = chunk->data;
-  int index          = y + (chunk_block_z * 128) + (chunk_block_x * 128 * 16);
-  blocks[index] = type;
-  char metadata      = metapointer[index>>1];
+  uint8 oldType     = chunk->getBlock(chunk_block_x, y, chunk_block_z);
+  bool lightChanged = (stopLight[oldType] != stopLight[(uint8)type] ||
+                       emitLight[oldType] != emitLight[(uint8)type]);
 
-  if(y%2)
-  {
-    metadata &= 0x0f;
-    metadata |= meta<<4;
-  }
-  else
+  // A running backup keeps the chunk as it was, the light engine takes
+  // care of the neighbours the light spreads into
+  Backup::get().chunkChanging(chunk);
+
+  size_t usedBefore = chunk->memoryUsage();
+
+  chunk->setBlock(chunk_block_x, y, chunk_block_z, type);
+  chunk->setNibble(CHUNK_DATA, chunk_block_x, y, chunk_block_z, meta & 0x0f);
+
+  residentBytes += chunk->memoryUsage()-usedBefore;
+
+  // Update the light around the block, unless the chunk is relit anyway
+  if(lightChanged)
   {
-    metadata &= 0xf0;
-    metadata |= meta;
+    if(chunk->lightPopulated)
+      lightEngine.update(*this, x, y, z, oldType);
+    else
+      invalidateLight(mapId);
   }
-  metapointer[index >> 1] = metadata;
 
-  mapChanged[mapId]       = 1;
-  mapLastused[mapId]      = (int)time(0);
+  mapChanged[mapId] = 1;
+  touchMap(mapId);
+
+  Journal::get().logBlock(x, y, z, type, meta);
 
   return true;
 }
@@ -657,6 +556,62 @@ void Map::createPickupSpawn(int x, int y, int z, int type, int count)
    this->sendPickupSpawn(item);
 }
 
+sChunk *Map::readMapFile(int x, int z, bool *exists)
+{
+  NBT_Value *root = storage.loadChunk(x, z, exists);
+
+  if(root == NULL)
+  {
+    if(*exists)
+      LOG("Error in loading map (unable to load file)");
+    return NULL;
+  }
+
+  // Convert to the native chunk, the NBT tree is not kept around
+  sChunk *chunk = new sChunk(x, z);
+  bool valid    = chunk->fromNBT(root);
+  delete root;
+
+  if(!valid)
+  {
+    LOG("Error in loading map (corrupt?)");
+    delete chunk;
+    return NULL;
+  }
+
+  if(chunk->x != x || chunk->z != z)
+  {
+    LOG("Error in loading map (incorrect chunk)");
+    delete chunk;
+    return NULL;
+  }
+
+  return chunk;
+}
+
+void Map::addMap(sChunk *chunk)
+{
+  uint32 mapId;
+  Map::posToId(chunk->x, chunk->z, &mapId);
+
+  maps[mapId] = chunk;
+  residentBytes += chunk->memoryUsage();
+
+  // A compressed copy would be outdated once the chunk changes
+  dropWarmMap(mapId);
+
+  // Update last used time
+  touchMap(mapId);
+
+  // Not changed
+  mapChanged[mapId] = 0;
+
+  if(!chunk->lightPopulated)
+    lightDirty.insert(mapId);
+  else
+    lightBorders.insert(mapId);
+}
+
 bool Map::loadMap(int x, int z, bool generate)
 {
 #ifdef MSDBG
@@ -666,30 +621,28 @@ bool Map::loadMap(int x, int z, bool generate)
   uint32 mapId;
   Map::posToId(x, z, &mapId);
 
-  if(maps.count(mapId))
+  if(maps.count(mapId) || thawMap(x, z))
     return true;
 
-  // Generate map file name
-
-  int mapposx = x;
-  int modulox = (mapposx) & 0x3F;
-
-  int mapposz = z;
-  int moduloz = (mapposz) & 0x3F;
+  // Released chunk still waiting to be written
+  sChunk *chunk = ChunkProvider::get().unsavedCopy(x, z);
+  if(chunk != NULL)
+  {
+    addMap(chunk);
+    return true;
+  }
 
-  std::string infile = mapDirectory+"/"+base36_encode(modulox)+"/"+base36_encode(moduloz)+"/c."+
-                       base36_encode(mapposx)+"."+base36_encode(mapposz)+".dat";
+  bool exists;
+  chunk = readMapFile(x, z, &exists);
 
-  struct stat stFileInfo;
-  if(stat(infile.c_str(), &stFileInfo) != 0)
+  if(!exists)
   {
     //std::cout << "Mappos: " << x << "," << z << std::endl;
     
     // If generate (false only for lightmapgenerator)
     if(generate)
     {    
-      MapGen mapgen(12345678);
-      mapgen.generateChunk(x,z);
+      addMap(mapGen->generateChunk(x,z));
       generateLightMaps(x, z);
       return true;
     } 
@@ -698,176 +651,280 @@ bool Map::loadMap(int x, int z, bool generate)
       return false;
     }
   }
-  else 
-  {
-    maps[mapId].nbt = NBT_Value::LoadFromFile(infile.c_str());
-  }
-  
-  
-  if(maps[mapId].nbt == NULL)
-  {
-    LOG("Error in loading map (unable to load file)");
+
+  if(chunk == NULL)
     return false;
-  }
 
-  NBT_Value &level = *(*maps[mapId].nbt)["Level"];
+  addMap(chunk);
 
-  maps[mapId].x = (sint32)(*level["xPos"]);
-  maps[mapId].z = (sint32)(*level["zPos"]);
+  return true;
+}
 
-  if(maps[mapId].x != x || maps[mapId].z != z)
-  {
-    LOG("Error in loading map (incorrect chunk)");
-    return false;
-  }
+bool Map::saveMap(int x, int z)
+{
+#ifdef MSDBG
+  printf("saveMap(x=%d, z=%d)\n", x, z);
+#endif
+
+  uint32 mapId;
+  Map::posToId(x, z, &mapId);
 
-  std::vector<uint8> *blocks = level["Blocks"]->GetByteArray();
-  std::vector<uint8> *data = level["Data"]->GetByteArray();
-  std::vector<uint8> *blocklight = level["BlockLight"]->GetByteArray();
-  std::vector<uint8> *skylight = level["SkyLight"]->GetByteArray();
-  std::vector<uint8> *heightmap = level["HeightMap"]->GetByteArray();
+  if(!mapChanged[mapId])
+    return true;
 
-  if(blocks == 0 || data == 0 || blocklight == 0 || skylight == 0 || heightmap == 0)
-  {
-    LOG("Error in loading map (chunk missing data)");
+  if(!maps.count(mapId))
     return false;
+
+  // Serialize, compress and write a snapshot in the background
+  if(ChunkProvider::get().isEnabled())
+  {
+    ChunkProvider::get().save(maps[mapId]->clone());
+    mapChanged[mapId] = 0;
+    return true;
   }
 
-  size_t fullLen = (16 * 128 * 16);
-  size_t halfLen = fullLen >> 1;
+  NBT_Value *root = maps[mapId]->toNBT();
+  bool saved      = storage.saveChunk(x, z, root);
+  delete root;
 
-  if(blocks->size() != fullLen ||
-    data->size() != halfLen ||
-    blocklight->size() != halfLen ||
-    skylight->size() != halfLen)
+  if(!saved)
   {
-    LOG("Error in loading map (corrupt?)");
+    LOG("Error in saving map");
     return false;
   }
 
-  maps[mapId].blocks = &((*blocks)[0]);
-  maps[mapId].data = &((*data)[0]);
-  maps[mapId].blocklight = &((*blocklight)[0]);
-  maps[mapId].skylight = &((*skylight)[0]);
-  maps[mapId].heightmap = &((*heightmap)[0]);
+  Journal::get().chunkSaved(x, z, Journal::get().sequence());
 
-  // Update last used time
-  mapLastused[mapId] = (int)time(0);
+  // A pending background load may have read the old file
+  ChunkProvider::get().invalidate(x, z);
 
-  // Not changed
+  // Set "not changed"
   mapChanged[mapId] = 0;
 
   return true;
 }
 
-bool Map::saveMap(int x, int z)
+bool Map::releaseMap(int x, int z)
 {
-#ifdef MSDBG
-  printf("saveMap(x=%d, z=%d)\n", x, z);
-#endif
+  // save first
+  saveMap(x, z);
 
   uint32 mapId;
   Map::posToId(x, z, &mapId);
 
-  if(!mapChanged[mapId])
-    return true;
+  mapChanged.erase(mapId);
+  mapLastused.erase(mapId);
+  lightDirty.erase(mapId);
+  lightBorders.erase(mapId);
 
-  if(!maps.count(mapId))
-    return false;
+  std::map<uint32, std::list<uint32>::iterator>::iterator pos = mapLruPos.find(mapId);
+  if(pos != mapLruPos.end())
+  {
+    mapLru.erase(pos->second);
+    mapLruPos.erase(pos);
+  }
+
+  if(maps.count(mapId))
+  {
+    residentBytes -= maps[mapId]->memoryUsage();
+    delete maps[mapId];
+  }
+
+  return maps.erase(mapId) ? true : false;
+}
 
-  // Recalculate light maps
-  generateLightMaps(x, z);
+void Map::releaseAllMaps()
+{
+  while(!maps.empty())
+    releaseMap(maps.begin()->second->x, maps.begin()->second->z);
+}
 
-  // Generate map file name
+void Map::touchMap(uint32 mapId)
+{
+  mapLastused[mapId] = (int)time(0);
 
-  int mapposx = x;
-  int modulox = (mapposx);
-  while(modulox < 0)
-    modulox += 64;
-  modulox %= 64;
+  std::map<uint32, std::list<uint32>::iterator>::iterator pos = mapLruPos.find(mapId);
+  if(pos == mapLruPos.end())
+    mapLruPos[mapId] = mapLru.insert(mapLru.end(), mapId);
+  else
+    mapLru.splice(mapLru.end(), mapLru, pos->second);
+}
 
-  int mapposz = z;
-  int moduloz = (mapposz);
-  while(moduloz < 0)
-    moduloz += 64;
-  moduloz %= 64;
+void Map::evictMaps()
+{
+  // Bound the work per tick, the rest is picked up on the next ones
+  const int maxChecked  = 64;
+  const int maxReleased = 16;
 
-  std::string outfile = mapDirectory+"/"+base36_encode(modulox)+"/"+base36_encode(moduloz)+"/c."+
-                        base36_encode(mapposx)+"."+base36_encode(mapposz)+".dat";
+  int now      = (int)time(0);
+  int checked  = 0;
+  int released = 0;
 
-  // Try to create parent directories if necessary
-  struct stat stFileInfo;
-  if(stat(outfile.c_str(), &stFileInfo) != 0)
+  // Drop the oldest compressed chunks first, they were saved before freezing
+  while(!warmOrder.empty() && checked < maxChecked)
   {
-    std::string outdir_a = mapDirectory+"/"+base36_encode(modulox);
-    std::string outdir_b = mapDirectory+"/"+base36_encode(modulox)+"/"+base36_encode(moduloz);
+    uint32 mapId = warmOrder.front();
+    checked++;
 
-    if(stat(outdir_b.c_str(), &stFileInfo) != 0)
+    bool expired    = warmMaps[mapId].released <= now-warmTime;
+    bool overBudget = memoryBudget &&
+                      residentBytes+sChunk::sharedMemoryUsage()+warmBytes > memoryBudget;
+    if(!expired && !overBudget)
+      break;
+
+    dropWarmMap(mapId);
+  }
+
+  checked = 0;
+
+  while(!mapLru.empty() && checked < maxChecked && released < maxReleased)
+  {
+    uint32 mapId = mapLru.front();
+    checked++;
+
+    bool expired    = mapLastused[mapId] <= now-releaseTime;
+    bool overBudget = memoryBudget &&
+                      residentBytes+sChunk::sharedMemoryUsage()+warmBytes > memoryBudget;
+
+    // The front is the oldest chunk, nothing further back can be released
+    if(!expired && !overBudget)
+      break;
+
+    int x, z;
+    idToPos(mapId, &x, &z);
+
+    // Keep chunks players can see, moving them out of the way
+    bool inView = false;
+    for(unsigned int i = 0; i < Users.size(); i++)
     {
-      if(stat(outdir_a.c_str(), &stFileInfo) != 0)
+      if(abs(x-Users[i]->curChunk.x()) <= User::viewDistance+1 &&
+         abs(z-Users[i]->curChunk.z()) <= User::viewDistance+1)
       {
-#ifdef WIN32
-        if(_mkdir(outdir_a.c_str()) == -1)
-#else
-        if(mkdir(outdir_a.c_str(), 0755) == -1)
-#endif
-
-          return false;
+        inView = true;
+        break;
       }
+    }
 
-#ifdef WIN32
-      if(_mkdir(outdir_b.c_str()) == -1)
-#else
-      if(mkdir(outdir_b.c_str(), 0755) == -1)
-#endif
+    if(inView)
+    {
+      touchMap(mapId);
+      continue;
+    }
 
-        return false;
+    if(warmTime > 0)
+    {
+      saveMap(x, z);
+      freezeMap(x, z);
     }
+    releaseMap(x, z);
+    released++;
   }
+}
 
-  maps[mapId].nbt->SaveToFile(outfile);
+bool Map::freezeMap(int x, int z)
+{
+  uint32 mapId;
+  posToId(x, z, &mapId);
 
-  // Set "not changed"
-  mapChanged[mapId] = 0;
+  if(!maps.count(mapId))
+    return false;
+
+  std::vector<uint8> raw;
+  NBT_Value *root = maps[mapId]->toNBT();
+  root->SaveToMemory(raw);
+  delete root;
+
+  // Fastest level, chunks may come back in a few seconds
+  uLongf written = compressBound(raw.size());
+  std::vector<uint8> data(written);
+  if(compress2(&data[0], &written, &raw[0], raw.size(), Z_BEST_SPEED) != Z_OK)
+    return false;
+
+  dropWarmMap(mapId);
+
+  sWarmChunk &warm = warmMaps[mapId];
+  warm.data.assign(data.begin(), data.begin()+written);
+  warm.size     = (uint32)raw.size();
+  warm.released = (int)time(0);
+  warm.pos      = warmOrder.insert(warmOrder.end(), mapId);
+  warmBytes    += warm.data.capacity()+sizeof(sWarmChunk);
 
   return true;
 }
 
-bool Map::releaseMap(int x, int z)
+bool Map::thawMap(int x, int z)
 {
-  // save first
-  saveMap(x, z);
-
   uint32 mapId;
-  Map::posToId(x, z, &mapId);
+  posToId(x, z, &mapId);
 
-  mapChanged.erase(mapId);
-  mapLastused.erase(mapId);
-  if(maps.count(mapId))
+  std::map<uint32, sWarmChunk>::iterator warm = warmMaps.find(mapId);
+  if(warm == warmMaps.end())
+    return false;
+
+  std::vector<uint8> raw(warm->second.size);
+  uLongf size = warm->second.size;
+  NBT_Value *root = NULL;
+  if(uncompress(&raw[0], &size, &warm->second.data[0], warm->second.data.size()) == Z_OK)
+    root = NBT_Value::LoadFromMemory(&raw[0], (uint32)size);
+
+  dropWarmMap(mapId);
+
+  if(root == NULL)
   {
-    delete maps[mapId].nbt;
+    LOG("Error in loading map (compressed copy)");
+    return false;
   }
 
-  return maps.erase(mapId) ? true : false;
+  sChunk *chunk = new sChunk(x, z);
+  bool valid    = chunk->fromNBT(root);
+  delete root;
+
+  if(!valid)
+  {
+    LOG("Error in loading map (compressed copy)");
+    delete chunk;
+    return false;
+  }
+
+  addMap(chunk);
+  return true;
+}
+
+void Map::dropWarmMap(uint32 mapId)
+{
+  std::map<uint32, sWarmChunk>::iterator warm = warmMaps.find(mapId);
+  if(warm == warmMaps.end())
+    return;
+
+  warmBytes -= warm->second.data.capacity()+sizeof(sWarmChunk);
+  warmOrder.erase(warm->second.pos);
+  warmMaps.erase(warm);
 }
 
 // Send chunk to user
-void Map::sendToUser(User *user, int x, int z)
+bool Map::sendToUser(User *user, int x, int z)
 {
 #ifdef MSDBG
   printf("sendToUser(x=%d, z=%d)\n", x, z);
 #endif
 
-  uint32 mapId;
-  Map::posToId(x, z, &mapId);
-
-  uint8 *data4   = new uint8[18+81920];
-  uint8 *mapdata = new uint8[81920];
   sint32 mapposx    = x;
   sint32 mapposz    = z;
 
-  if(loadMap(x, z))
+  sChunk *chunk = getMapData(x, z);
+
+  if(chunk)
   {
+    // Light still out of date, relight before sending
+    if(!chunk->lightPopulated)
+      generateLightMaps(x, z);
+
+    // Light of the neighbours loaded so far
+    uint32 mapId;
+    posToId(x, z, &mapId);
+    if(lightBorders.count(mapId))
+      stitchLight(x, z);
+
     // Pre chunk
   user->buffer << (sint8)PACKET_PRE_CHUNK << mapposx << mapposz << (sint8)1;
 
@@ -875,94 +932,87 @@ void Map::sendToUser(User *user, int x, int z)
   user->buffer << (sint8)PACKET_MAP_CHUNK << (sint32)(mapposx * 16) << (sint16)0 << (sint32)(mapposz * 16) 
       << (sint8)15 << (sint8)127 << (sint8)15;
 
-    memcpy(&mapdata[0], maps[mapId].blocks, 32768);
-    memcpy(&mapdata[32768], maps[mapId].data, 16384);
-    memcpy(&mapdata[32768+16384], maps[mapId].blocklight, 16384);
-    memcpy(&mapdata[32768+16384+16384], maps[mapId].skylight, 16384);
+    // Chunks made only of shared arrays share their compressed payload
+    std::vector<uint64> key;
+    bool shared = chunk->signature(key);
+    std::map<std::vector<uint64>, std::vector<uint8> >::iterator cached = payloadCache.end();
+    if(shared)
+      cached = payloadCache.find(key);
 
-    uLongf written = 81920;
-    Bytef *buffer = new Bytef[written];
-
-    // Compress data with zlib deflate
-    compress(buffer, &written, &mapdata[0], 81920);
+    std::vector<uint8> compressed;
+    if(cached == payloadCache.end())
+    {
+      // Compress data with zlib deflate, sections are gathered in packet order
+      std::vector<uint8> payload(CHUNK_PAYLOAD_SIZE);
+      chunk->gather(&payload[0]);
 
-    user->buffer << (sint32)written;
-    user->buffer.addToWrite(buffer, written);
+      uLongf written = compressBound(CHUNK_PAYLOAD_SIZE);
+      compressed.resize(written);
+      compress(&compressed[0], &written, &payload[0], CHUNK_PAYLOAD_SIZE);
+      compressed.resize(written);
 
-    //Get list of chests,furnaces etc on the chunk
-    NBT_Value *entityList = (*(*maps[mapId].nbt)["Level"])["TileEntities"];
+      if(shared)
+      {
+        // Keys of released arrays never match again, start over when full
+        if(payloadCache.size() >= 256)
+          payloadCache.clear();
+        cached = payloadCache.insert(std::make_pair(key, std::vector<uint8>())).first;
+        cached->second.swap(compressed);
+      }
+    }
+    const std::vector<uint8> &data = (cached != payloadCache.end()) ? cached->second : compressed;
 
-    //Verify the type
-    if(entityList && entityList->GetType() == NBT_Value::TAG_LIST && entityList->GetListType() == NBT_Value::TAG_COMPOUND)
-    {
-      std::vector<NBT_Value*> *entities = entityList->GetList();
-      std::vector<NBT_Value*>::iterator iter = entities->begin(), end = entities->end();
+    user->buffer << (sint32)data.size();
+    user->buffer.addToWrite(&data[0], data.size());
 
-      uint8 *compressedData = new uint8[ALLOCATE_NBTFILE];
+    //Send chests,furnaces etc on the chunk
+    uint8 *compressedData = new uint8[ALLOCATE_NBTFILE];
 
-      for( ; iter != end ; iter++)
+    for(unsigned int i = 0; i < chunk->tileEntities.size(); i++)
+    {
+      sTileEntity &tile = chunk->tileEntities[i];
+      if(tile.id != "Chest" && tile.id != "Furnace" && tile.id != "Sign")
+        continue;
+
+      std::vector<uint8> buffer;
+      buffer.push_back(NBT_Value::TAG_COMPOUND);
+      buffer.push_back(0);
+      buffer.push_back(0);
+      tile.nbt->Write(buffer);
+      buffer.push_back(0);
+      buffer.push_back(0);
+
+      z_stream zstream2;
+      zstream2.zalloc = Z_NULL;
+      zstream2.zfree = Z_NULL;
+      zstream2.opaque = Z_NULL;
+      zstream2.next_out=compressedData;
+      zstream2.next_in=&buffer[0];
+      zstream2.avail_in=buffer.size();
+      zstream2.avail_out=ALLOCATE_NBTFILE;
+      zstream2.total_out=0;
+      zstream2.total_in=0;
+      deflateInit2(&zstream2, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+MAX_WBITS, 8,
+                 Z_DEFAULT_STRATEGY);
+
+      //Gzip the data
+      if(int state=deflate(&zstream2,Z_FULL_FLUSH)!=Z_OK)
       {
-        std::vector<uint8> buffer;
-        NBT_Value *idVal = (**iter)["id"];
-        if(idVal == NULL)
-          continue;
-        std::string *id = idVal->GetString();
-        if(id && (*id=="Chest" || *id=="Furnace" || *id=="Sign"))
-        {
-          if((**iter)["x"]->GetType() != NBT_Value::TAG_INT ||
-            (**iter)["y"]->GetType() != NBT_Value::TAG_INT ||
-            (**iter)["z"]->GetType() != NBT_Value::TAG_INT)
-          {
-            continue;
-          }
-
-            buffer.push_back(NBT_Value::TAG_COMPOUND);
-            buffer.push_back(0);
-            buffer.push_back(0);
-            (*iter)->Write(buffer);
-            buffer.push_back(0);
-            buffer.push_back(0);
-
-
-          z_stream zstream2;
-          zstream2.zalloc = Z_NULL;
-          zstream2.zfree = Z_NULL;
-          zstream2.opaque = Z_NULL;
-          zstream2.next_out=compressedData;
-          zstream2.next_in=&buffer[0];
-          zstream2.avail_in=buffer.size();
-          zstream2.avail_out=ALLOCATE_NBTFILE;
-          zstream2.total_out=0;
-          zstream2.total_in=0;
-          deflateInit2(&zstream2, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+MAX_WBITS, 8,
-                     Z_DEFAULT_STRATEGY);
-
-          //Gzip the data
-          if(int state=deflate(&zstream2,Z_FULL_FLUSH)!=Z_OK)
-          {
-            std::cout << "Error in deflate: " << state << std::endl;            
-          }
-
-          sint32 entityX = *(**iter)["x"];
-          sint32 entityY = *(**iter)["y"];
-          sint32 entityZ = *(**iter)["z"];
-
-          // !!!! Complex Entity packet! !!!!
-          user->buffer << (sint8)PACKET_COMPLEX_ENTITIES 
-            << (sint32)entityX << (sint16)entityY << (sint32)entityZ << (sint16)zstream2.total_out;
-          user->buffer.addToWrite(compressedData, zstream2.total_out);
-
-          deflateEnd(&zstream2);
-        }
+        std::cout << "Error in deflate: " << state << std::endl;            
       }
-      delete [] compressedData;
+
+      // !!!! Complex Entity packet! !!!!
+      user->buffer << (sint8)PACKET_COMPLEX_ENTITIES 
+        << (sint32)tile.x << (sint16)tile.y << (sint32)tile.z << (sint16)zstream2.total_out;
+      user->buffer.addToWrite(compressedData, zstream2.total_out);
+
+      deflateEnd(&zstream2);
     }
-    delete [] buffer;
-  }
 
+    delete [] compressedData;
+  }
 
-  delete[] data4;
-  delete[] mapdata;
+  return chunk != 0;
 }
 
 void Map::setComplexEntity(sint32 x, sint32 y, sint32 z, NBT_Value *entity)
@@ -991,55 +1041,12 @@ void Map::setComplexEntity(sint32 x, sint32 y, sint32 z, NBT_Value *entity)
     return;
   }
 
-  NBT_Value *entityList = (*(*maps[mapId].nbt)["Level"])["TileEntities"];
-
-  if(!entityList)
-  {
-    entityList = new NBT_Value(NBT_Value::TAG_LIST, NBT_Value::TAG_COMPOUND);
-    maps[mapId].nbt->Insert("TileEntities", entityList);
-  }
-
-  if(entityList->GetType() == NBT_Value::TAG_LIST)
-  {
-   if(entityList->GetListType() != NBT_Value::TAG_COMPOUND)
-     entityList->SetType(NBT_Value::TAG_LIST, NBT_Value::TAG_COMPOUND);
-
-   std::vector<NBT_Value*> *entities = entityList->GetList();
-   std::vector<NBT_Value*>::iterator iter = entities->begin(), end = entities->end();
-
-   bool done = false;
-
-   for( ; iter != end; iter++ )
-   {
-     if((**iter)["x"] == NULL || (**iter)["y"] == NULL || (**iter)["z"] == NULL ||
-      (**iter)["x"]->GetType() != NBT_Value::TAG_INT ||
-      (**iter)["y"]->GetType() != NBT_Value::TAG_INT ||
-      (**iter)["z"]->GetType() != NBT_Value::TAG_INT)
-    {
-      continue;
-    }
+  Journal::get().logComplexEntity(x, y, z, entity);
 
-    if((sint32)(*(**iter)["x"]) == x && (sint32)(*(**iter)["y"]) == y && (sint32)(*(**iter)["z"]) == z)
-    {
-      // Replace entity
-      delete *iter;
-      *iter = entity;
-      done = true;
-      break;
-    }
-   }
+  Backup::get().chunkChanging(maps[mapId]);
 
-   if(!done)
-   {
-    // Add new entity
-    entityList->GetList()->push_back(entity);
-   }
-  }
-  else
-  {
-    LOG("TileEntities list type not valid");
-    return;
-  }
+  // Add or replace entity
+  maps[mapId]->setTileEntity(entity);
 
   mapChanged[mapId] = true;
 
@@ -29,22 +29,17 @@
 #define _MAP_H_
 
 #include <map>
+#include <list>
+#include <set>
 #include <ctime>
 #include "nbt.h"
 #include "user.h"
 #include "vec.h"
+#include "chunk.h"
+#include "regionfile.h"
+#include "lightengine.h"
 
-struct sChunk
-{
-  uint8 *blocks;
-  uint8 *data;
-  uint8 *blocklight;
-  uint8 *skylight;
-  uint8 *heightmap;
-  sint32 x;
-  sint32 z;
-  NBT_Value *nbt;
-};
+class MapGen;
 
 struct spawnedItem
 {
@@ -67,7 +62,8 @@ class Map
 {
 private:
 
-  Map()
+  Map() : mapSeed(0), mapGen(NULL), residentBytes(0), warmBytes(0), releaseTime(10), warmTime(0),
+          memoryBudget(0)
   {
     for(int i = 0; i < 256; i++)
       emitLight[i] = 0;
@@ -114,11 +110,8 @@ private:
   }
   ~Map()
   {
-    // Free all memory
-    for(std::map<uint32, sChunk>::const_iterator it = maps.begin(); it != maps.end(); it = maps.begin())
-    {
-      releaseMap(maps[it->first].x, maps[it->first].z);
-    }
+    // Nothing is left once releaseAllMaps() ran on shutdown
+    releaseAllMaps();
 
     //Free item memory
     for(std::map<uint32, spawnedItem *>::const_iterator it = items.begin(); it != items.end(); ++it)
@@ -136,9 +129,18 @@ public:
 
   std::string mapDirectory;
 
+  // Region files holding the saved chunks
+  RegionStorage storage;
+
   // Map spawn position
   vec spawnPos;
 
+  // Seed of new terrain, map_seed or the seed in level.dat
+  sint32 mapSeed;
+
+  // Generates the chunks generated on the main thread
+  MapGen *mapGen;
+
   // How blocks affect light
   int stopLight[256];
 
@@ -146,14 +148,54 @@ public:
   int emitLight[256];
 
   // Store all maps here
-  std::map<uint32, sChunk> maps;
+  std::map<uint32, sChunk *> maps;
 
   // Store the time map chunk has been last used
   std::map<uint32, int> mapLastused;
 
+  // Loaded chunks from least to most recently used and each chunk's place
+  // in the list, so eviction never has to scan every chunk
+  std::list<uint32> mapLru;
+  std::map<uint32, std::list<uint32>::iterator> mapLruPos;
+
+  // Memory held by the loaded chunks, without the arrays they share
+  size_t residentBytes;
+
+  // Compressed payloads of chunks without arrays of their own, by
+  // sChunk::signature()
+  std::map<std::vector<uint64>, std::vector<uint8> > payloadCache;
+
+  // Released chunks kept compressed in memory, oldest first in warmOrder
+  struct sWarmChunk
+  {
+    // Chunk NBT, deflated
+    std::vector<uint8> data;
+    uint32 size;
+    int released;
+    std::list<uint32>::iterator pos;
+  };
+  std::map<uint32, sWarmChunk> warmMaps;
+  std::list<uint32> warmOrder;
+  size_t warmBytes;
+
+  // Release time and time kept compressed in seconds (0 = no warm tier),
+  // memory budget in bytes (0 = unlimited)
+  int releaseTime;
+  int warmTime;
+  size_t memoryBudget;
+
   // Store if map has been modified
   std::map<uint32, bool> mapChanged;
 
+  // Loaded chunks whose light is out of date, relit by relightMaps()
+  std::set<uint32> lightDirty;
+  // Lit chunks whose faces have not been stitched to their neighbours
+  std::set<uint32> lightBorders;
+
+  // Light on the main thread and in bulk on the light threads
+  LightEngine lightEngine;
+  LightPool lightPool;
+
   // Store item pointers for each chunk
   std::map<uint32, std::vector<spawnedItem *> > mapItems;
 
@@ -165,14 +207,23 @@ public:
 
   void initMap();
   void freeMap();
-  void sendToUser(User *user, int x, int z);
+  // Returns false if the chunk is not available yet (asynchronous loading)
+  bool sendToUser(User *user, int x, int z);
 
-  // Get pointer to struct
+  // Get pointer to struct, with asynchronous loading a missing chunk is
+  // requested and NULL returned
   sChunk *getMapData(int x, int z, bool generate = true);
 
   // Load map chunk
   bool loadMap(int x, int z, bool generate = true);
 
+  // Read chunk from region files, NULL if it does not exist or is broken.
+  // Does not touch the loaded chunks and can be called from worker threads.
+  sChunk *readMapFile(int x, int z, bool *exists);
+
+  // Insert a loaded or generated chunk, takes ownership
+  void addMap(sChunk *chunk);
+
   // Save map chunk to disc
   bool saveMap(int x, int z);
 
@@ -182,14 +233,50 @@ public:
   // Generate light maps for chunk
   bool generateLightMaps(int x, int z);
 
+  // Light of a loaded chunk is out of date, relight it as a whole
+  void invalidateLight(uint32 mapId);
+
+  // Spread light across the faces of a lit chunk and its lit neighbours
+  bool stitchLight(int x, int z);
+
+  // Relight or stitch many loaded chunks, on the light threads if there
+  // are any
+  void lightMaps(const std::vector<uint32> &mapIds, bool stitch);
+
+  // Relight the chunks invalidated since the last call and stitch the
+  // chunks loaded or relit since, called every tick. Block changes update
+  // the light right away. Saving does not relight, chunks keep the flag on
+  // disk instead.
+  void relightMaps();
+
   // Release/save map chunk
   bool releaseMap(int x, int z);
 
+  // Save and release all loaded chunks, before the chunk provider and the
+  // journal are stopped
+  void releaseAllMaps();
+
+  // Mark chunk used now and move it to the back of the LRU list
+  void touchMap(uint32 mapId);
+
+  // Release a few least recently used chunks that are unused for longer
+  // than map_release_time or over map_memory_budget. Chunks in view of a
+  // player are kept. Released chunks stay compressed in memory for
+  // map_warm_time. Called every tick.
+  void evictMaps();
+
+  // Keep a compressed copy of a loaded chunk, it must be saved already
+  bool freezeMap(int x, int z);
+
+  // Load a chunk from its compressed copy, false if there is none
+  bool thawMap(int x, int z);
+
+  // Forget the compressed copy
+  void dropWarmMap(uint32 mapId);
+
   // Light get/set
   bool getBlockLight(int x, int y, int z, uint8 *blocklight, uint8 *skylight);
   bool setBlockLight(int x, int y, int z, uint8 blocklight, uint8 skylight, uint8 setLight);
-  bool lightmapStep(int x, int y, int z, int light);
-  bool blocklightmapStep(int x, int y, int z, int light);
 
   // Block value/meta get/set
   bool getBlock(int x, int y, int z, uint8 *type, uint8 *meta, bool generate = true);
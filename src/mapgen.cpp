@@ -25,6 +25,7 @@
 
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <algorithm>
@@ -49,15 +50,10 @@
 #include "mersenne.h"
 
 #include "mapgen.h"
+#include "mapgenstages.h"
 
-MapGen::MapGen(int seed)
+MapGen::MapGen(int seed) : m_cache(GEN_CACHE_CHUNKS)
 {
-  blocks = new uint8[16*16*128];
-  blockdata = new uint8[16*16*128/2];
-  skylight = new uint8[16*16*128/2];
-  blocklight = new uint8[16*16*128/2];
-  heightmap = new uint8[16*16];
-
   //
   // libnoise
   //
@@ -83,24 +79,42 @@ MapGen::MapGen(int seed)
   finalTerrain.SetBounds(0.0, 1000.0);
   finalTerrain.SetEdgeFalloff(0.125);
 
-  // Generate heightmap
-  heightMapBuilder.SetSourceModule(finalTerrain);
-  heightMapBuilder.SetDestNoiseMap(heightMap);
-  heightMapBuilder.SetDestSize(16, 16);
+  // Check the vector noise against libnoise before other threads use it
+  VectorNoise::get();
 
   oreDensity = Conf::get().iValue("oreDensity");
   seaLevel = Conf::get().iValue("seaLevel");
+  flatland = Conf::get().bValue("map_flatland");
+
+  bool caves       = Conf::get().bValue("map_caves");
+  bool ores        = Conf::get().bValue("map_ores");
+  bool decorations = Conf::get().bValue("map_decorations");
+
+  // Only the enabled features cost time. The surface stage only fixes up
+  // the dirt caves uncover, so map_caves turns it on too.
+  m_terrain = new TerrainStage(*this);
+  m_stages.push_back(m_terrain);
+  if(caves)
+    m_stages.push_back(new CarveStage(seed));
+  if(ores)
+    m_stages.push_back(new OreStage(seed, oreDensity));
+  if(caves)
+    m_stages.push_back(new SurfaceStage(seaLevel));
+  if(decorations)
+    m_stages.push_back(new DecorationStage(seed));
+
+  // Keep what a stage reading neighbours needs, each chunk is read by the
+  // ones around it
+  for(size_t i = 0; i < m_stages.size(); i++)
+    m_cached.push_back(i+1 < m_stages.size() && m_stages[i+1]->radius() > 0);
   
   m_seed = seed;
 }
 
 MapGen::~MapGen()
 {
-  delete [] blocks;
-  delete [] blockdata;
-  delete [] skylight;
-  delete [] blocklight;
-  delete [] heightmap;
+  for(size_t i = 0; i < m_stages.size(); i++)
+    delete m_stages[i];
 }
 
 
@@ -130,90 +144,212 @@ int MapGen::getHeightmapIndex(char x, char z)
   return z + (x * 16);
 }*/
 
-void MapGen::loadFlatgrass() 
+// Fills y from to to-1 of a column, clipped to the blocks above the bedrock
+static inline void fillColumn(uint8 *column, int from, int to, uint8 block)
+{
+  from = std::max(from, 1);
+  to   = std::min(to, 128);
+  if(from < to)
+    memset(column+from, block, to-from);
+}
+
+void MapGen::seedSky(const uint8 *column, int top, uint8 *height, uint8 *skylight) const
+{
+  // Ground is the highest opaque block above the bedrock
+  const Map &map = Map::get();
+  int ground = std::min(top, 127);
+  while(ground > 0 && map.stopLight[column[ground]] != -16)
+    ground--;
+
+  if(ground > 0)
+    *height = (ground == 127) ? ground : ground+1;
+  else
+  {
+    *height = 0;
+    ground  = 1;
+  }
+
+  // Dark below the ground, full light from it up. Columns start at an even
+  // block, the even block of a byte is the low nibble.
+  memset(skylight, 0, ground/2);
+  if(ground & 1)
+    skylight[ground/2] = 0xf0;
+  memset(skylight+(ground+1)/2, 0xff, 64-(ground+1)/2);
+}
+
+void MapGen::loadFlatgrass(uint8 *blocks, uint8 *heightmap, uint8 *skylight) const
 {
-  for (uint8 bX = 0; bX < 16; bX++) 
+  for (int bX = 0; bX < 16; bX++) 
   {
-    for (uint8 bY = 0; bY < 128; bY++) 
+    for (int bZ = 0; bZ < 16; bZ++) 
     {
-      for (uint8 bZ = 0; bZ < 16; bZ++) 
+      uint8 *column = blocks+(bZ * 128 + (bX * 128 * 16));
+
+      column[0] = BLOCK_BEDROCK;
+      fillColumn(column, 1, 64, BLOCK_DIRT);
+      column[64] = BLOCK_GRASS;
+      fillColumn(column, 65, 128, BLOCK_AIR);
+
+      if(heightmap)
+        seedSky(column, 64, &heightmap[bZ+(bX<<4)], skylight+(bZ * 128 + (bX * 128 * 16))/2);
+    }
+  }
+}
+
+bool MapGen::runStages(uint8 *blocks, uint8 *heightmap, uint8 *skylight, int x, int z, int last, const float *heights) const
+{
+  if(m_cached[last] && m_cache.get(last, x, z, blocks))
+    return false;
+
+  bool seeded;
+  if(last == 0)
+  {
+    // The generated chunk seeds the sky in its fill and may have the noise
+    // of a batch, the chunks around it only need their blocks
+    if(heightmap == NULL && heights == NULL)
+      m_terrain->run(blocks, x, z, GenArea(0));
+    else
+      m_terrain->fill(blocks, heightmap, skylight, x, z, heights);
+    seeded = (heightmap != NULL);
+  }
+  else
+  {
+    seeded = runStages(blocks, heightmap, skylight, x, z, last-1, heights);
+
+    const MapGenStage *stage = m_stages[last];
+    int radius = stage->radius();
+    GenArea area(radius);
+    if(radius == 0)
+      area.share(0, 0, blocks);
+    else
+    {
+      for(int dx = -radius; dx <= radius; dx++)
       {
-        if (bY == 0) 
-          blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_BEDROCK; 
-        else if (bY < 64) 
-          blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_DIRT;
-        else if (bY == 64) 
-          blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_GRASS;
-        else 
-          blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_AIR;
+        for(int dz = -radius; dz <= radius; dz++)
+        {
+          if(dx == 0 && dz == 0)
+            memcpy(area.storage(0, 0), blocks, CHUNK_BLOCKS_SIZE);
+          else
+            runStages(area.storage(dx, dz), NULL, NULL, x+dx, z+dz, last-1, NULL);
+        }
       }
     }
+
+    if(stage->run(blocks, x, z, area))
+      seeded = false;
   }
-  //CalculateHeightmap();
+
+  if(m_cached[last])
+    m_cache.put(last, x, z, blocks);
+  return seeded;
 }
 
-void MapGen::generateChunk(int x, int z)
+void MapGen::generate(uint8 *blocks, uint8 *heightmap, uint8 *skylight, int x, int z, const float *heights) const
 {
-  NBT_Value *main = new NBT_Value(NBT_Value::TAG_COMPOUND);
-  NBT_Value *val = new NBT_Value(NBT_Value::TAG_COMPOUND);
- 
-  if(Conf::get().bValue("map_flatland"))
-    loadFlatgrass();
-  else
-    generateWithNoise(x, z);
-   
-  val->Insert("Blocks", new NBT_Value(blocks, 16*16*128));
-  val->Insert("Data", new NBT_Value(blockdata, 16*16*128/2));
-  val->Insert("SkyLight", new NBT_Value(skylight, 16*16*128/2));
-  val->Insert("BlockLight", new NBT_Value(blocklight, 16*16*128/2));
-  val->Insert("HeightMap", new NBT_Value(heightmap, 16*16));
-  val->Insert("Entities", new NBT_Value(NBT_Value::TAG_LIST, NBT_Value::TAG_COMPOUND));
-  val->Insert("TileEntities", new NBT_Value(NBT_Value::TAG_LIST, NBT_Value::TAG_COMPOUND));
-  val->Insert("LastUpdate", new NBT_Value((sint64)time(NULL)));
-  val->Insert("xPos", new NBT_Value(x));
-  val->Insert("zPos", new NBT_Value(z));
-  val->Insert("TerrainPopulated", new NBT_Value((char)1));
-  
-  main->Insert("Level", val);
-  
-  uint32 chunkid;
-  Map::get().posToId(x, z, &chunkid);
-  
-  Map::get().maps[chunkid].x = x;
-  Map::get().maps[chunkid].z = z;
-
-  std::vector<uint8> *t_blocks = (*val)["Blocks"]->GetByteArray();
-  std::vector<uint8> *t_data = (*val)["Data"]->GetByteArray();
-  std::vector<uint8> *t_blocklight = (*val)["BlockLight"]->GetByteArray();
-  std::vector<uint8> *t_skylight = (*val)["SkyLight"]->GetByteArray();
-  std::vector<uint8> *heightmap = (*val)["HeightMap"]->GetByteArray();
-  
-  Map::get().maps[chunkid].blocks = &((*t_blocks)[0]);
-  Map::get().maps[chunkid].data = &((*t_data)[0]);
-  Map::get().maps[chunkid].blocklight = &((*t_blocklight)[0]);
-  Map::get().maps[chunkid].skylight = &((*t_skylight)[0]);
-  Map::get().maps[chunkid].heightmap = &((*heightmap)[0]);
+  if(runStages(blocks, heightmap, skylight, x, z, (int)m_stages.size()-1, heights))
+    return;
 
-  // Update last used time
-  Map::get().mapLastused[chunkid] = (int)time(0);
+  // Blocks changed after the terrain seeded the sky
+  for(int bX = 0; bX < 16; bX++)
+  {
+    for(int bZ = 0; bZ < 16; bZ++)
+    {
+      int offset = bZ*128+bX*128*16;
+      seedSky(blocks+offset, 127, &heightmap[bZ+(bX<<4)], skylight+offset/2);
+    }
+  }
+}
 
-  // Not changed
-  Map::get().mapChanged[chunkid] = 0;
-  
-  Map::get().maps[chunkid].nbt = main;
+sChunk *MapGen::makeChunk(int x, int z, const uint8 *blocks, const uint8 *heightmap, const uint8 *skylight)
+{
+  sChunk *chunk = new sChunk(x, z);
+
+  // Generated in the chunk file layout, the chunk splits it into sections
+  chunk->setArray(CHUNK_BLOCKS, blocks);
+  chunk->setArray(CHUNK_SKYLIGHT, skylight);
+  memcpy(chunk->heightmap, heightmap, CHUNK_HEIGHTMAP_SIZE);
+  chunk->skySeeded = true;
+
+  return chunk;
 }
 
-void MapGen::generateWithNoise(int x, int z) 
+sChunk *MapGen::generateChunk(int x, int z) const
 {
-  // Ore arrays
-  //uint8* oreX;
-  //uint8* oreY;
-  //uint8* oreZ;
-  //uint8* oreType;
+  uint8 blocks[CHUNK_BLOCKS_SIZE];
+  uint8 heightmap[CHUNK_HEIGHTMAP_SIZE];
+  uint8 skylight[CHUNK_NIBBLES_SIZE];
+  generate(blocks, heightmap, skylight, x, z);
 
-  heightMapBuilder.SetBounds(1000 + x*perlinScale, 1000 + (x+1)*perlinScale, 1000 + z*perlinScale, 1000 + (z+1)*perlinScale);
-  heightMapBuilder.Build();
+  return makeChunk(x, z, blocks, heightmap, skylight);
+}
 
+void MapGen::generateChunks(std::vector<sChunk *> &chunks, int x, int z, int width, int depth) const
+{
+  std::vector<float> heights;
+  if(!flatland)
+  {
+    heights.resize(width*depth*16*16);
+    buildHeightMaps(&heights[0], x, z, width, depth);
+  }
+
+  uint8 blocks[CHUNK_BLOCKS_SIZE];
+  uint8 heightmap[CHUNK_HEIGHTMAP_SIZE];
+  uint8 skylight[CHUNK_NIBBLES_SIZE];
+  for(int i = 0; i < width; i++)
+  {
+    for(int j = 0; j < depth; j++)
+    {
+      generate(blocks, heightmap, skylight, x+i, z+j, flatland ? NULL : &heights[(i*depth+j)*16*16]);
+      chunks.push_back(makeChunk(x+i, z+j, blocks, heightmap, skylight));
+    }
+  }
+}
+
+void MapGen::buildHeightMaps(float *heights, int x, int z, int width, int depth) const
+{
+  int samples = width*depth*16*16;
+  std::vector<double> positions(samples*4);
+  double *posX   = &positions[0];
+  double *posY   = &positions[samples];
+  double *posZ   = &positions[samples*2];
+  double *values = &positions[samples*3];
+
+  for(int i = 0; i < width; i++)
+  {
+    for(int j = 0; j < depth; j++)
+    {
+      // Same bounds and accumulated steps as NoiseMapBuilderPlane::Build
+      // for this chunk alone, the terrain does not change
+      double lowerX = 1000 + (x+i)*perlinScale;
+      double upperX = 1000 + (x+i+1)*perlinScale;
+      double lowerZ = 1000 + (z+j)*perlinScale;
+      double upperZ = 1000 + (z+j+1)*perlinScale;
+      double xDelta = (upperX-lowerX)/16.0;
+      double zDelta = (upperZ-lowerZ)/16.0;
+      int first     = (i*depth+j)*16*16;
+
+      double zCur = lowerZ;
+      for(int bZ = 0; bZ < 16; bZ++)
+      {
+        double xCur = lowerX;
+        for(int bX = 0; bX < 16; bX++)
+        {
+          posX[first+bX+bZ*16] = xCur;
+          posZ[first+bX+bZ*16] = zCur;
+          xCur += xDelta;
+        }
+        zCur += zDelta;
+      }
+    }
+  }
+
+  finalTerrain.getValues(posX, posY, posZ, values, samples);
+  for(int i = 0; i < samples; i++)
+    heights[i] = (float)values[i];
+}
+
+void MapGen::generateWithNoise(uint8 *blocks, uint8 *heightmap, uint8 *skylight, const float *heightMap) const
+{
   // Image render
   /*noise::utils::RendererImage renderer;
   noise::utils::Image image;
@@ -226,286 +362,38 @@ void MapGen::generateWithNoise(int x, int z)
   writer.SetDestFilename ("tutorial.bmp");
   writer.WriteDestFile ();*/
 
-
-
-  // Get cave heightmaps for upper caves (top & bottom)
-  /*Noise caveTopNoise;
-  Random rnd(randomSeed);
-  caveTopNoise.init(randomSeed + rnd.uniform(RAND_MAX), caveTopNoise.Spline);
-  caveTopNoise.PerlinNoiseMap(caveTop, 0, 4, 0.4f, x, z);
-  caveTopNoise.Invert(caveTop);
-  caveTopNoise.Marble(caveTop);
-  
-  Noise caveBottomNoise;
-  Random rndBot(rnd.uniform(RAND_MAX));
-  caveBottomNoise.init(randomSeed + rndBot.uniform(RAND_MAX), caveBottomNoise.Spline);
-  caveBottomNoise.PerlinNoiseMap(caveBottom, 0, 4, 0.2f, x, z);
-  caveBottomNoise.Invert(caveBottom);
-  caveBottomNoise.Marble(caveBottom);
-
-  // Get cave heightmaps for lower caves (top & bottom)
-  Noise caveTopNoise2;
-  Random rnd2(randomSeed + 1);
-  caveTopNoise2.init(randomSeed + rnd2.uniform(RAND_MAX), caveTopNoise2.Spline);
-  caveTopNoise2.PerlinNoiseMap(caveTop2, 0, 4, 0.4f, x, z);
-  caveTopNoise2.Invert(caveTop2);
-  caveTopNoise2.Marble(caveTop2);
-  
-  Noise caveBottomNoise2;
-  Random rnd3(randomSeed + 2);
-  Random rnd4(rnd3.uniform(RAND_MAX) + 1);
-  caveBottomNoise2.init(randomSeed + rnd4.uniform(RAND_MAX), caveBottomNoise2.Spline);
-  caveBottomNoise2.PerlinNoiseMap(caveBottom2, 0, 4, 0.2f, x, z);
-  caveBottomNoise2.Invert(caveBottom2);
-  caveBottomNoise2.Marble(caveBottom2);
-
-  // Determine whether there should be ore (random, not seed-related) and where it should be and what type
-  int oreChance = rand()%9 + 1; // 1-10
-  int numOre = 0;
-  if (oreDensity >= 18) 
-  {
-    if (oreChance <= 2)
-      numOre = oreDensity;
-    else if (oreChance <= 4)
-      numOre = oreDensity - 4;
-    else if (oreChance <= 8)
-      numOre = oreDensity - 8;
-    else if (oreChance <= 10)
-      numOre = oreDensity - 12;
-  } 
-  else
-    numOre = oreDensity;
-
-  oreX = new uint8[numOre];
-  oreY = new uint8[numOre];
-  oreZ = new uint8[numOre];
-  oreType = new uint8[numOre];
-
-  for(int i = 0; i < numOre; i++) 
-  {
-    oreX[i] = (char)rand()%14 + 1; // 1-15
-    oreY[i] = (char)rand()%63 + 1; // 1-64
-    oreZ[i] = (char)rand()%14 + 1; // 1-15
-    int oreTypeRand = rand()%19 + 1; // 1-20
-    if(oreY[i] < 14) 
-    {
-      if (oreTypeRand < 10)
-        oreType[i] = BLOCK_REDSTONE_ORE;
-      else
-        oreType[i] = BLOCK_DIAMOND_ORE;
-    } 
-    else 
-    {
-      if (oreTypeRand <= 5 && oreY[i] < 30)
-        oreType[i] = BLOCK_GOLD_ORE;
-      else if (oreTypeRand <= 9)
-        oreType[i] = BLOCK_IRON_ORE;
-      else if (oreTypeRand <= 20)
-        oreType[i] = BLOCK_COAL_ORE;
-    }
-  }
-  */
-  // Populate blocks in chunk
-  int currentHeight;//, caveTopHeight, caveBottomHeight, caveTopHeight2, caveBottomHeight2;
-  for (uint8 bX = 0; bX < 16; bX++) 
+  // Populate blocks in chunk a column at a time: bedrock, stone, dirt,
+  // the top block, water up to the sea and air, each written as one run
+  for (int bX = 0; bX < 16; bX++) 
   {
-    for (uint8 bY = 0; bY < 128; bY++) 
+    for (int bZ = 0; bZ < 16; bZ++) 
     {
-      for (uint8 bZ = 0; bZ < 16; bZ++) 
-      {
-        currentHeight = (int)((heightMap.GetValue(bX,bZ) * 7.49674) + 64.15371);
-
-        //currentHeight = (int)((heightMap[bX][bZ] * 2.49674) + 82.15371);
+      uint8 *column = blocks+(bZ * 128 + (bX * 128 * 16));
+      int currentHeight = (int)((heightMap[bX+bZ*16] * 7.49674) + 64.15371);
+      int stoneHeight   = (int)(currentHeight * 0.94);
 
-        /*caveTopHeight = (int)((caveTop[bX][bZ] * 4.29674) + 36.15371);
-        caveBottomHeight = (int)((caveBottom[bX][bZ] * 2.29674) + 40.15371);
-        caveTopHeight += (int)((float)currentHeight / 128.0 * 90.0) - 40;
-        caveBottomHeight += (int)((float)currentHeight / 128.0 * 90.0) - 45;
+      //currentHeight = (int)((heightMap[bX][bZ] * 2.49674) + 82.15371);
 
-        caveTopHeight2 = (int)((caveTop2[bX][bZ] * 4.29674) + 36.15371);
-        caveBottomHeight2 = (int)((caveBottom2[bX][bZ] * 2.29674) + 40.15371);
-        caveTopHeight2 += (int)((float)currentHeight / 128.0 * 100.0) - 70;
-        caveBottomHeight2 += (int)((float)currentHeight / 128.0 * 100.0) - 75;*/
+      column[0] = BLOCK_BEDROCK;
+      fillColumn(column, 1, std::min(stoneHeight, currentHeight), BLOCK_STONE);
+      fillColumn(column, stoneHeight, currentHeight, BLOCK_DIRT);
 
-        if(bY == 0) 
-        {
-          blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_BEDROCK;
-        } 
-        else 
-        {
-          if(bY < currentHeight) 
-          {
-            if (bY < (int)(currentHeight * 0.94)) 
-            {
-              /*if(bY >= caveBottomHeight && bY <= caveTopHeight)
-                blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_AIR;
-              else if (bY >= caveBottomHeight2 && bY <= caveTopHeight2)
-                blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_AIR;
-              else 
-              {
-                int veinDir = rand()%7 + 1; // 1-8
-                */Block blockToPlace = BLOCK_STONE;
-                         
-                /*for(int i = 0; i < numOre; i++) 
-                {
-                  if(oreType[i] == BLOCK_DIAMOND_ORE || oreType[i] == BLOCK_GOLD_ORE) {    // Smaller deposits
-                    if (veinDir <= 2) 
-                    {         // Cube (2x2)
-                      if (oreX[i] < bX - 0)
-                        continue;
-                      if (oreX[i] > bX + 1)
-                        continue;
-                      if (oreY[i] < bY - 0)
-                        continue;
-                      if (oreY[i] > bY + 1)
-                        continue;
-                      if (oreZ[i] < bZ - 0)
-                        continue;
-                      if (oreZ[i] > bZ + 1)
-                        continue;
-                    } 
-                    else if (veinDir <= 4) 
-                    {  // Long across X
-                      if (oreX[i] < bX - 0)
-                        continue;
-                      if (oreX[i] > bX + 2)
-                        continue;
-                      if (oreY[i] < bY - 0)
-                        continue;
-                      if (oreY[i] > bY + 1)
-                        continue;
-                      if (oreZ[i] < bZ - 0)
-                        continue;
-                      if (oreZ[i] > bZ + 1)
-                        continue;
-                    } 
-                    else if (veinDir <= 6) 
-                    {  // Long across Z
-                      if (oreX[i] < bX - 0)
-                        continue;
-                      if (oreX[i] > bX + 1)
-                        continue;
-                      if (oreY[i] < bY - 0)
-                        continue;
-                      if (oreY[i] > bY + 1)
-                        continue;
-                      if (oreZ[i] < bZ - 0)
-                        continue;
-                      if (oreZ[i] > bZ + 2)
-                        continue;
-                    } 
-                    else if (veinDir <= 8) 
-                    {  // Tall
-                      if (oreX[i] < bX - 0)
-                        continue;
-                      if (oreX[i] > bX + 1)
-                        continue;
-                      if (oreY[i] < bY - 0)
-                        continue;
-                      if (oreY[i] > bY + 2)
-                        continue;
-                      if (oreZ[i] < bZ - 0)
-                        continue;
-                      if (oreZ[i] > bZ + 1)
-                        continue;
-                    }
-                  } 
-                  else 
-                  {
-                    // Larger deposits
-                    if (veinDir <= 2) 
-                    {         // Cube (2x2)
-                      if (oreX[i] < bX - 0)
-                        continue;
-                      if (oreX[i] > bX + 1)
-                        continue;
-                      if (oreY[i] < bY - 0)
-                        continue;
-                      if (oreY[i] > bY + 1)
-                        continue;
-                      if (oreZ[i] < bZ - 0)
-                        continue;
-                      if (oreZ[i] > bZ + 1)
-                        continue;
-                    } 
-                    else if (veinDir <= 4) 
-                    {  // Long across X
-                      if (oreX[i] < bX - 1)
-                        continue;
-                      if (oreX[i] > bX + 2)
-                        continue;
-                      if (oreY[i] < bY - 0)
-                        continue;
-                      if (oreY[i] > bY + 1)
-                        continue;
-                      if (oreZ[i] < bZ - 0)
-                        continue;
-                      if (oreZ[i] > bZ + 1)
-                        continue;
-                    } 
-                    else if (veinDir <= 6) 
-                    {  // Long across Z
-                      if (oreX[i] < bX - 0)
-                        continue;
-                      if (oreX[i] > bX + 1)
-                        continue;
-                      if (oreY[i] < bY - 0)
-                        continue;
-                      if (oreY[i] > bY + 1)
-                        continue;
-                      if (oreZ[i] < bZ - 1)
-                        continue;
-                      if (oreZ[i] > bZ + 2)
-                        continue;
-                    } 
-                    else if (veinDir <= 8) 
-                    {  // Tall
-                      if (oreX[i] < bX - 0)
-                         continue;
-                      if (oreX[i] > bX + 1)
-                         continue;
-                      if (oreY[i] < bY - 1)
-                         continue;
-                      if (oreY[i] > bY + 2)
-                         continue;
-                      if (oreZ[i] < bZ - 0)
-                         continue;
-                      if (oreZ[i] > bZ + 1)
-                         continue;
-                    }
-                  }*/
-                  //blockToPlace = (Block)oreType[i];
-                  //break;
-                //}
-                blocks[bY + (bZ * 128 + (bX * 128 * 16))] = blockToPlace;
-              //} 
-            } 
-            else
-              blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_DIRT;
-          } 
-          else if (currentHeight == bY) 
-          {
-            if (bY == seaLevel || bY == seaLevel - 1 || bY == seaLevel - 2)
-              blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_SAND; // FF
-            else if (bY < seaLevel - 1)
-              blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_GRAVEL; // FF
-            else
-              blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_GRASS; // FF
-          } 
-          else 
-          {
-            if (bY <= seaLevel)
-              blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_STATIONARY_WATER; // FF
-            else
-              blocks[bY + (bZ * 128 + (bX * 128 * 16))] = BLOCK_AIR; // FF
-          }
-        }
+      if(currentHeight >= 1 && currentHeight < 128)
+      {
+        if (currentHeight == seaLevel || currentHeight == seaLevel - 1 || currentHeight == seaLevel - 2)
+          column[currentHeight] = BLOCK_SAND; // FF
+        else if (currentHeight < seaLevel - 1)
+          column[currentHeight] = BLOCK_GRAVEL; // FF
+        else
+          column[currentHeight] = BLOCK_GRASS; // FF
       }
+
+      fillColumn(column, currentHeight + 1, seaLevel + 1, BLOCK_STATIONARY_WATER); // FF
+      fillColumn(column, std::max(currentHeight, seaLevel) + 1, 128, BLOCK_AIR); // FF
+
+      if(heightmap)
+        seedSky(column, currentHeight, &heightmap[bZ+(bX<<4)], skylight+(bZ * 128 + (bX * 128 * 16))/2);
     }
   }
   //CalculateHeightmap();
-  /*delete [] oreX;
-  delete [] oreY;
-  delete [] oreZ;
-  delete [] oreType;*/
 }
@@ -26,22 +26,27 @@
 #ifndef _MAPGEN_H
 #define _MAPGEN_H
 
+#include <vector>
+
 #ifdef WIN32
 #include <noise/noise.h>
 #else
 #include <libnoise/noise.h>
 #endif
 #include "noiseutils.h"
+#include "vectornoise.h"
+
+#include "mapgenstages.h"
+
+struct sChunk;
+
+// Chunks whose blocks after a stage are kept for the stages reading
+// around them
+#define GEN_CACHE_CHUNKS 512
 
 class MapGen
 {
 private:
-  uint8 *blocks;
-  uint8 *blockdata;
-  uint8 *skylight;
-  uint8 *blocklight;
-  uint8 *heightmap;
-
   /*float** heightMap;
   float** steepnessMap;
   float** caveTop;
@@ -52,32 +57,80 @@ private:
   int m_seed;
   int oreDensity;
   int seaLevel;
+  bool flatland;
 
   float perlinScale;
   
   //int getHeightmapIndex(char x, char z);
   //void calculateHeightmap();
   
-  void loadFlatgrass();
-  void generateWithNoise(int x, int z);
+  // The fills write each 128 block column of the chunk as runs of blocks,
+  // and with seedSky its heightmap entry and skylight in the same pass
+  void loadFlatgrass(uint8 *blocks, uint8 *heightmap, uint8 *skylight) const;
+  void generateWithNoise(uint8 *blocks, uint8 *heightmap, uint8 *skylight, const float *heightMap) const;
 
-  noise::module::Perlin perlinNoise;
-  noise::utils::NoiseMap heightMap;
-  noise::utils::NoiseMapBuilderPlane heightMapBuilder;
+  // Runs the stages up to last on chunk x,z, and those of the chunks
+  // around it the later stages read. Returns false if the seeded sky no
+  // longer matches the blocks.
+  bool runStages(uint8 *blocks, uint8 *heightmap, uint8 *skylight, int x, int z, int last, const float *heights) const;
+
+  // Heightmap entry and skylight of a filled column as the first sky pass
+  // of the light engine sets them, top is the highest block that can be
+  // opaque
+  void seedSky(const uint8 *column, int top, uint8 *height, uint8 *skylight) const;
+
+  VectorPerlin perlinNoise;
 
   noise::module::RidgedMulti mountainTerrain;
 
-  noise::module::Billow baseFlatTerrain;
-  noise::module::ScaleBias flatTerrain;
+  VectorBillow baseFlatTerrain;
+  VectorScaleBias flatTerrain;
+
+  VectorPerlin terrainType;
 
-  noise::module::Perlin terrainType;
+  VectorSelect finalTerrain;
 
-  noise::module::Select finalTerrain;
+  // Enabled stages in order, the terrain first
+  std::vector<MapGenStage *> m_stages;
+  TerrainStage *m_terrain;
+  // Whether the output of a stage is cached for the next
+  std::vector<bool> m_cached;
+  mutable GenCache m_cache;
+
+  friend class TerrainStage;
 
 public:
+  // Reads configuration, construct on the main thread
   MapGen(int seed);
   ~MapGen();  
-  void generateChunk(int x, int z);
+
+  // Blocks, heightmap and seeded skylight of chunk x,z in the chunk file
+  // layout. They depend only on the seed, the configuration read when
+  // constructed and the position, so any number of threads can share one
+  // MapGen. heights are the noise of the chunk from buildHeightMaps, NULL
+  // to build it.
+  void generate(uint8 *blocks, uint8 *heightmap, uint8 *skylight, int x, int z, const float *heights = NULL) const;
+
+  // Terrain noise of the 16x16 columns of the width x depth chunks from
+  // x,z, sampled as the noise map builder of noiseutils does for each
+  // chunk. All positions are sampled in one pass, VectorNoise::POINTS at
+  // a time. Chunk x+i,z+j starts at
+  // heights+(i*depth+j)*256, indexed bX+bZ*16.
+  void buildHeightMaps(float *heights, int x, int z, int width, int depth) const;
+
+  // Chunk with the generated arrays
+  static sChunk *makeChunk(int x, int z, const uint8 *blocks, const uint8 *heightmap, const uint8 *skylight);
+
+  // Generate a new chunk without touching the map
+  sChunk *generateChunk(int x, int z) const;
+
+  // Generate the width x depth chunks from x,z with the noise of all of
+  // them built at once, appended in the order of buildHeightMaps. Gives
+  // the same chunks as generateChunk.
+  void generateChunks(std::vector<sChunk *> &chunks, int x, int z, int width, int depth) const;
+
+  // Enabled stages in order
+  const std::vector<MapGenStage *> &stages() const { return m_stages; }
 
 };
 
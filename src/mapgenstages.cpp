@@ -0,0 +1,443 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include "constants.h"
+#include "chunk.h"
+#include "mersenne.h"
+#include "mapgen.h"
+#include "mapgenstages.h"
+
+static const double PI = 3.14159265358979323846;
+
+// CounterRandom streams of the features of a chunk
+enum
+{
+  STREAM_CAVES   = 1,
+  STREAM_ORES    = 2,
+  STREAM_TREES   = 3,
+  STREAM_FLOWERS = 4,
+  // One for each tunnel of a chunk
+  STREAM_TUNNELS = 0x100
+};
+
+// Chunks on each side a cave can reach from the chunk it starts in. A
+// tunnel moves at most a block a step, the longest with its widest radius
+// stays within the reach.
+static const int CAVE_REACH          = 3;
+// Percent of the chunks starting caves, and their most tunnels
+static const unsigned CAVE_CHANCE    = 20;
+static const unsigned CAVE_TUNNELS   = 3;
+static const unsigned TUNNEL_MIN     = 16;
+static const unsigned TUNNEL_MAX     = 40;
+// Radius grows from 1 to 1+width along the tunnel and back
+static const double TUNNEL_MAX_WIDTH = 2.5;
+// Carved blocks up to this height are lava
+static const int CAVE_LAVA_LEVEL     = 10;
+
+static inline uint8 *columnAt(uint8 *blocks, int bX, int bZ)
+{
+  return blocks+(bZ*128+bX*128*16);
+}
+
+static inline const uint8 *columnAt(const uint8 *blocks, int bX, int bZ)
+{
+  return blocks+(bZ*128+bX*128*16);
+}
+
+// Highest block of a column that is not air
+static int groundAt(const uint8 *blocks, int bX, int bZ)
+{
+  const uint8 *column = columnAt(blocks, bX, bZ);
+  int y = 127;
+  while(y > 0 && column[y] == BLOCK_AIR)
+    y--;
+  return y;
+}
+
+GenArea::GenArea(int radius) : m_radius(radius), m_chunks((2*radius+1)*(2*radius+1), (const uint8 *)NULL)
+{
+}
+
+uint8 *GenArea::storage(int dx, int dz)
+{
+  if(m_storage.empty())
+    m_storage.resize(m_chunks.size()*CHUNK_BLOCKS_SIZE);
+
+  uint8 *blocks = &m_storage[index(dx, dz)*CHUNK_BLOCKS_SIZE];
+  m_chunks[index(dx, dz)] = blocks;
+  return blocks;
+}
+
+bool GenCache::get(int stage, int x, int z, uint8 *blocks)
+{
+  MutexLock lock(m_mutex);
+
+  std::map<Key, Entry>::iterator it = m_entries.find(Key(stage, std::make_pair(x, z)));
+  if(it == m_entries.end())
+    return false;
+
+  m_uses.splice(m_uses.begin(), m_uses, it->second.use);
+  memcpy(blocks, &it->second.blocks[0], CHUNK_BLOCKS_SIZE);
+  return true;
+}
+
+void GenCache::put(int stage, int x, int z, const uint8 *blocks)
+{
+  MutexLock lock(m_mutex);
+
+  Key key(stage, std::make_pair(x, z));
+  std::map<Key, Entry>::iterator it = m_entries.find(key);
+  if(it != m_entries.end())
+  {
+    // Another thread was first, the blocks are the same
+    m_uses.splice(m_uses.begin(), m_uses, it->second.use);
+    return;
+  }
+
+  if(m_entries.size() >= m_capacity && !m_uses.empty())
+  {
+    m_entries.erase(m_uses.back());
+    m_uses.pop_back();
+  }
+
+  m_uses.push_front(key);
+  Entry &entry = m_entries[key];
+  entry.blocks.assign(blocks, blocks+CHUNK_BLOCKS_SIZE);
+  entry.use = m_uses.begin();
+}
+
+bool TerrainStage::run(uint8 *blocks, int x, int z, const GenArea &area) const
+{
+  fill(blocks, NULL, NULL, x, z, NULL);
+  return true;
+}
+
+void TerrainStage::fill(uint8 *blocks, uint8 *heightmap, uint8 *skylight, int x, int z, const float *heights) const
+{
+  if(m_gen.flatland)
+  {
+    m_gen.loadFlatgrass(blocks, heightmap, skylight);
+    return;
+  }
+
+  float heightMap[16*16];
+  if(heights == NULL)
+  {
+    m_gen.buildHeightMaps(heightMap, x, z, 1, 1);
+    heights = heightMap;
+  }
+  m_gen.generateWithNoise(blocks, heightmap, skylight, heights);
+}
+
+// Carves the blocks of chunk x,z within a flattened sphere. Bedrock, water
+// and the blocks right under water stay.
+static bool carve(uint8 *blocks, int x, int z, double centerX, double centerY, double centerZ, double radius)
+{
+  double radiusY = radius*0.7;
+  int minX = std::max((int)floor(centerX-radius), x*16);
+  int maxX = std::min((int)floor(centerX+radius), x*16+15);
+  int minZ = std::max((int)floor(centerZ-radius), z*16);
+  int maxZ = std::min((int)floor(centerZ+radius), z*16+15);
+  int minY = std::max((int)floor(centerY-radiusY), 1);
+  int maxY = std::min((int)floor(centerY+radiusY), 126);
+  if(minX > maxX || minZ > maxZ || minY > maxY)
+    return false;
+
+  bool changed = false;
+  for(int bX = minX; bX <= maxX; bX++)
+  {
+    double dx = (bX+0.5-centerX)/radius;
+    for(int bZ = minZ; bZ <= maxZ; bZ++)
+    {
+      double dz     = (bZ+0.5-centerZ)/radius;
+      uint8 *column = columnAt(blocks, bX-x*16, bZ-z*16);
+      for(int bY = minY; bY <= maxY; bY++)
+      {
+        double dy = (bY+0.5-centerY)/radiusY;
+        if(dx*dx+dy*dy+dz*dz >= 1.0)
+          continue;
+
+        uint8 block = column[bY];
+        if(block == BLOCK_AIR || block == BLOCK_BEDROCK || block == BLOCK_STATIONARY_WATER ||
+           block == BLOCK_STATIONARY_LAVA || column[bY+1] == BLOCK_STATIONARY_WATER)
+          continue;
+
+        column[bY] = (bY <= CAVE_LAVA_LEVEL) ? BLOCK_STATIONARY_LAVA : BLOCK_AIR;
+        changed    = true;
+      }
+    }
+  }
+  return changed;
+}
+
+bool CarveStage::run(uint8 *blocks, int x, int z, const GenArea &area) const
+{
+  bool changed = false;
+  for(int startX = x-CAVE_REACH; startX <= x+CAVE_REACH; startX++)
+  {
+    for(int startZ = z-CAVE_REACH; startZ <= z+CAVE_REACH; startZ++)
+    {
+      CounterRandom random(m_seed, startX, startZ, STREAM_CAVES);
+      if(random.uniform(100) >= CAVE_CHANCE)
+        continue;
+
+      int tunnels = random.uniform(1, CAVE_TUNNELS+1);
+      for(int i = 0; i < tunnels; i++)
+      {
+        if(tunnel(blocks, x, z, startX, startZ, i))
+          changed = true;
+      }
+    }
+  }
+  return changed;
+}
+
+bool CarveStage::tunnel(uint8 *blocks, int x, int z, int startX, int startZ, int index) const
+{
+  // Each tunnel has its own numbers, skipping one does not move the others
+  CounterRandom random(m_seed, startX, startZ, STREAM_TUNNELS+index);
+
+  double posX   = startX*16+random.uniform()*16;
+  double posY   = 8+random.uniform()*48;
+  double posZ   = startZ*16+random.uniform()*16;
+  double yaw    = random.uniform()*2*PI;
+  double pitch  = (random.uniform()-0.5)*0.5;
+  double width  = random.uniform()*TUNNEL_MAX_WIDTH;
+  int length    = random.uniform(TUNNEL_MIN, TUNNEL_MAX+1);
+
+  // Too far to reach this chunk
+  double nearX = std::max((double)x*16, std::min(posX, (double)x*16+16));
+  double nearZ = std::max((double)z*16, std::min(posZ, (double)z*16+16));
+  double reach = length+1+width;
+  if((posX-nearX)*(posX-nearX)+(posZ-nearZ)*(posZ-nearZ) > reach*reach)
+    return false;
+
+  bool changed = false;
+  for(int step = 0; step < length; step++)
+  {
+    if(carve(blocks, x, z, posX, posY, posZ, 1+width*sin(PI*step/length)))
+      changed = true;
+
+    posX  += cos(yaw)*cos(pitch);
+    posY  += sin(pitch);
+    posZ  += sin(yaw)*cos(pitch);
+    yaw   += (random.uniform()-0.5)*0.5;
+    pitch  = pitch*0.8+(random.uniform()-0.5)*0.4;
+  }
+  return changed;
+}
+
+bool OreStage::run(uint8 *blocks, int x, int z, const GenArea &area) const
+{
+  CounterRandom random(m_seed, x, z, STREAM_ORES);
+
+  // Determine whether there should be ore and where it should be and what type
+  int oreChance = random.uniform(1, 11); // 1-10
+  int numOre    = m_density;
+  if (m_density >= 18) 
+  {
+    if (oreChance <= 2)
+      numOre = m_density;
+    else if (oreChance <= 4)
+      numOre = m_density - 4;
+    else if (oreChance <= 8)
+      numOre = m_density - 8;
+    else
+      numOre = m_density - 12;
+  } 
+
+  bool changed = false;
+  for(int i = 0; i < numOre; i++) 
+  {
+    int pos[3];
+    pos[0] = random.uniform(1, 15); // 1-14
+    pos[1] = random.uniform(1, 64); // 1-63
+    pos[2] = random.uniform(1, 15); // 1-14
+    int oreTypeRand = random.uniform(1, 21); // 1-20
+    int veinDir     = random.uniform(1, 9);  // 1-8
+
+    Block oreType;
+    if(pos[1] < 14) 
+      oreType = (oreTypeRand < 10) ? BLOCK_REDSTONE_ORE : BLOCK_DIAMOND_ORE;
+    else if (oreTypeRand <= 5 && pos[1] < 30)
+      oreType = BLOCK_GOLD_ORE;
+    else if (oreTypeRand <= 9)
+      oreType = BLOCK_IRON_ORE;
+    else
+      oreType = BLOCK_COAL_ORE;
+
+    // A 2x2x2 cube, or longer across x, z or up. Diamond and gold make
+    // smaller deposits.
+    int low[3]  = { -1, -1, -1 };
+    int high[3] = { 0, 0, 0 };
+    if(veinDir > 2)
+    {
+      int axis = (veinDir <= 4) ? 0 : ((veinDir <= 6) ? 2 : 1);
+      low[axis] = -2;
+      if(oreType != BLOCK_DIAMOND_ORE && oreType != BLOCK_GOLD_ORE)
+        high[axis] = 1;
+    }
+
+    for(int bX = std::max(pos[0]+low[0], 0); bX <= std::min(pos[0]+high[0], 15); bX++)
+    {
+      for(int bZ = std::max(pos[2]+low[2], 0); bZ <= std::min(pos[2]+high[2], 15); bZ++)
+      {
+        uint8 *column = columnAt(blocks, bX, bZ);
+        for(int bY = std::max(pos[1]+low[1], 1); bY <= pos[1]+high[1]; bY++)
+        {
+          if(column[bY] != BLOCK_STONE)
+            continue;
+          column[bY] = oreType;
+          changed    = true;
+        }
+      }
+    }
+  }
+  return changed;
+}
+
+bool SurfaceStage::run(uint8 *blocks, int x, int z, const GenArea &area) const
+{
+  bool changed = false;
+  for(int bX = 0; bX < 16; bX++)
+  {
+    for(int bZ = 0; bZ < 16; bZ++)
+    {
+      int y = groundAt(blocks, bX, bZ);
+      uint8 *column = columnAt(blocks, bX, bZ);
+      if(column[y] == BLOCK_DIRT && y >= m_seaLevel)
+      {
+        column[y] = BLOCK_GRASS;
+        changed   = true;
+      }
+    }
+  }
+  return changed;
+}
+
+// Sets a block of the chunk if it is in the chunk and holds one of the
+// blocks that may be replaced
+static bool place(uint8 *blocks, int bX, int bY, int bZ, uint8 block, uint8 over, uint8 orOver)
+{
+  if(bX < 0 || bX > 15 || bZ < 0 || bZ > 15 || bY < 1 || bY > 127)
+    return false;
+
+  uint8 &current = columnAt(blocks, bX, bZ)[bY];
+  if(current != over && current != orOver)
+    return false;
+
+  current = block;
+  return true;
+}
+
+// The parts of a tree in the chunk, bX,bZ may be outside of it. Leaves
+// only fill air and trunks only replace air and leaves, so overlapping
+// trees give the same blocks in whatever order they are planted.
+static bool plantTree(uint8 *blocks, int bX, int base, int bZ, int height)
+{
+  bool changed = false;
+  int top      = base+height-1;
+
+  for(int bY = top-2; bY <= top+1; bY++)
+  {
+    int radius = (bY < top) ? 2 : 1;
+    for(int dx = -radius; dx <= radius; dx++)
+    {
+      for(int dz = -radius; dz <= radius; dz++)
+      {
+        // Round off the corners of the wide layers
+        if(radius == 2 && abs(dx) == 2 && abs(dz) == 2)
+          continue;
+        if(place(blocks, bX+dx, bY, bZ+dz, BLOCK_LEAVES, BLOCK_AIR, BLOCK_AIR))
+          changed = true;
+      }
+    }
+  }
+
+  for(int bY = base; bY <= top; bY++)
+  {
+    if(place(blocks, bX, bY, bZ, BLOCK_LOG, BLOCK_AIR, BLOCK_LEAVES))
+      changed = true;
+  }
+  return changed;
+}
+
+bool DecorationStage::run(uint8 *blocks, int x, int z, const GenArea &area) const
+{
+  bool changed = false;
+
+  // Trees of this chunk and of the chunks next to it. Their ground is read
+  // from the blocks before any tree.
+  for(int dx = -1; dx <= 1; dx++)
+  {
+    for(int dz = -1; dz <= 1; dz++)
+    {
+      CounterRandom random(m_seed, x+dx, z+dz, STREAM_TREES);
+      const uint8 *ground = area.blocks(dx, dz);
+
+      // Half of the chunks have none, the others 1-3
+      int trees = random.uniform(2) ? (int)random.uniform(1, 4) : 0;
+      for(int i = 0; i < trees; i++)
+      {
+        int treeX  = random.uniform(16);
+        int treeZ  = random.uniform(16);
+        int height = random.uniform(4, 7);
+
+        int y = groundAt(ground, treeX, treeZ);
+        if(columnAt(ground, treeX, treeZ)[y] != BLOCK_GRASS || y+height+2 > 127)
+          continue;
+
+        if(plantTree(blocks, treeX+dx*16, y+1, treeZ+dz*16, height))
+          changed = true;
+      }
+    }
+  }
+
+  // Flowers of this chunk where no tree grew
+  CounterRandom random(m_seed, x, z, STREAM_FLOWERS);
+  int flowers = random.uniform(4);
+  for(int i = 0; i < flowers; i++)
+  {
+    int flowerX  = random.uniform(16);
+    int flowerZ  = random.uniform(16);
+    uint8 flower = random.uniform(2) ? BLOCK_RED_ROSE : BLOCK_YELLOW_FLOWER;
+
+    int y = groundAt(area.blocks(0, 0), flowerX, flowerZ);
+    if(columnAt(area.blocks(0, 0), flowerX, flowerZ)[y] != BLOCK_GRASS)
+      continue;
+
+    if(place(blocks, flowerX, y+1, flowerZ, flower, BLOCK_AIR, BLOCK_AIR))
+      changed = true;
+  }
+
+  return changed;
+}
@@ -0,0 +1,191 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MAPGENSTAGES_H
+#define _MAPGENSTAGES_H
+
+// Stages of world generation. Each stage reads the blocks a chunk has
+// after the stages before it and changes them: terrain, carve, ores,
+// surface and decorations. A stage may also read the chunks around it as
+// the previous stage left them, up to its radius. Stages are pure
+// functions of the seed, the configuration and the position, so any
+// thread can run any of them, and the outputs the next stage reads around
+// other chunks can be cached.
+//
+// Features drawing random numbers use CounterRandom keyed by the chunk the
+// feature starts in, so a feature reaching into other chunks is the same
+// whichever of them is generated.
+
+#include <list>
+#include <map>
+#include <vector>
+
+#include "tools.h"
+#include "thread.h"
+
+class MapGen;
+
+// Chunks around the one a stage runs on, as the previous stage left them
+class GenArea
+{
+public:
+  GenArea(int radius);
+
+  int radius() const { return m_radius; }
+
+  // Blocks of the chunk dx,dz away in the chunk file layout,
+  // |dx|,|dz| <= radius
+  const uint8 *blocks(int dx, int dz) const { return m_chunks[index(dx, dz)]; }
+
+  // Where the pipeline puts the blocks of the chunk dx,dz away
+  uint8 *storage(int dx, int dz);
+  // Use blocks as the chunk dx,dz away without copying them
+  void share(int dx, int dz, const uint8 *blocks) { m_chunks[index(dx, dz)] = blocks; }
+
+private:
+  int m_radius;
+  std::vector<const uint8 *> m_chunks;
+  std::vector<uint8> m_storage;
+
+  int index(int dx, int dz) const { return (dx+m_radius)*(2*m_radius+1)+dz+m_radius; }
+};
+
+class MapGenStage
+{
+public:
+  virtual ~MapGenStage() {}
+
+  // Name in logs and benchmarks
+  virtual const char *name() const = 0;
+
+  // Chunks on each side whose blocks run() reads, 0 for its own only
+  virtual int radius() const { return 0; }
+
+  // Changes the blocks of chunk x,z. area has the chunks within radius()
+  // as the previous stage left them, the center too. Returns false if
+  // nothing was changed.
+  virtual bool run(uint8 *blocks, int x, int z, const GenArea &area) const = 0;
+};
+
+// Blocks of chunks after a stage, the least recently used are dropped
+class GenCache
+{
+public:
+  GenCache(size_t capacity) : m_capacity(capacity) {}
+
+  // Copy the blocks of chunk x,z after stage to blocks if cached
+  bool get(int stage, int x, int z, uint8 *blocks);
+  void put(int stage, int x, int z, const uint8 *blocks);
+
+private:
+  typedef std::pair<int, std::pair<int, int> > Key;
+  struct Entry
+  {
+    std::vector<uint8> blocks;
+    std::list<Key>::iterator use;
+  };
+
+  size_t m_capacity;
+  std::map<Key, Entry> m_entries;
+  // Most recently used first
+  std::list<Key> m_uses;
+  Mutex m_mutex;
+};
+
+// Heights and blocks from the noise or flatland of MapGen. run() makes
+// the chunks the later stages read around the generated one, which is
+// made by fill() to seed its sky and use the noise of a batch.
+class TerrainStage : public MapGenStage
+{
+public:
+  TerrainStage(const MapGen &gen) : m_gen(gen) {}
+  const char *name() const { return "terrain"; }
+  bool run(uint8 *blocks, int x, int z, const GenArea &area) const;
+
+  // heights NULL to build the noise of this chunk, heightmap and skylight
+  // NULL to not seed them
+  void fill(uint8 *blocks, uint8 *heightmap, uint8 *skylight, int x, int z, const float *heights) const;
+
+private:
+  const MapGen &m_gen;
+};
+
+// Worm caves, started in chunks up to CAVE_REACH away
+class CarveStage : public MapGenStage
+{
+public:
+  CarveStage(int seed) : m_seed(seed) {}
+  const char *name() const { return "carve"; }
+  bool run(uint8 *blocks, int x, int z, const GenArea &area) const;
+
+private:
+  int m_seed;
+
+  bool tunnel(uint8 *blocks, int x, int z, int startX, int startZ, int index) const;
+};
+
+// Veins of coal, iron, gold, redstone and diamond in the stone
+class OreStage : public MapGenStage
+{
+public:
+  OreStage(int seed, int density) : m_seed(seed), m_density(density) {}
+  const char *name() const { return "ores"; }
+  bool run(uint8 *blocks, int x, int z, const GenArea &area) const;
+
+private:
+  int m_seed;
+  int m_density;
+};
+
+// Grass again on dirt left at the top of a column by the stages before.
+// Only caves uncover dirt, MapGen adds it with the carve stage.
+class SurfaceStage : public MapGenStage
+{
+public:
+  SurfaceStage(int seaLevel) : m_seaLevel(seaLevel) {}
+  const char *name() const { return "surface"; }
+  bool run(uint8 *blocks, int x, int z, const GenArea &area) const;
+
+private:
+  int m_seaLevel;
+};
+
+// Trees and flowers on grass. Crowns reach into the chunks next to the
+// tree, which needs the ground of those chunks.
+class DecorationStage : public MapGenStage
+{
+public:
+  DecorationStage(int seed) : m_seed(seed) {}
+  const char *name() const { return "decorations"; }
+  int radius() const { return 1; }
+  bool run(uint8 *blocks, int x, int z, const GenArea &area) const;
+
+private:
+  int m_seed;
+};
+
+#endif
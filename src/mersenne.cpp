@@ -28,6 +28,17 @@
 
 #include "mersenne.h"
 
+// Voodoo to improve distribution
+static unsigned long temper(unsigned long rnd)
+{
+  rnd ^= (rnd >> 11);
+  rnd ^= (rnd << 7) & 0x9d2c5680UL;
+  rnd ^= (rnd << 15) & 0xefc60000UL;
+  rnd ^= (rnd >> 18);
+
+  return rnd;
+}
+
 double Random::uniform()
 {
   return randgen() * (1.0 / (MAX + 1.0));
@@ -77,11 +88,39 @@ unsigned long Random::randgen()
 
   rnd = x[next++]; // Grab the next number
 
-  // Voodoo to improve distribution
-  rnd ^= (rnd >> 11);
-  rnd ^= (rnd << 7) & 0x9d2c5680UL;
-  rnd ^= (rnd << 15) & 0xefc60000UL;
-  rnd ^= (rnd >> 18);
+  return temper(rnd);
+}
 
-  return rnd;
+CounterRandom::CounterRandom(unsigned long seed, int x, int z, unsigned long stream)
+  : counter(0)
+{
+  key = mix(mix(mix(mix(seed & MAX, (unsigned long)x & MAX), (unsigned long)z & MAX), stream & MAX), 0x5bd1e995UL);
+}
+
+// One step of the pool seeding, tempered and folded
+unsigned long CounterRandom::mix(unsigned long value, unsigned long step)
+{
+  value = temper((1812433253UL * (value ^ (value >> 30)) + step) & MAX);
+  return value ^ (value >> 16);
+}
+
+unsigned long CounterRandom::get(unsigned long n) const
+{
+  n &= MAX;
+  return mix(mix(key ^ n, n), key);
+}
+
+double CounterRandom::uniform()
+{
+  return get(counter++) * (1.0 / (MAX + 1.0));
+}
+
+unsigned CounterRandom::uniform(unsigned hi)
+{
+  return static_cast<unsigned>(uniform() * hi);
+}
+
+unsigned CounterRandom::uniform(unsigned lo, unsigned hi)
+{
+  return lo + uniform(hi - lo);
 }
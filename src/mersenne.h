@@ -32,4 +32,29 @@ private:
   unsigned long randgen();
 };
 
+// Counter-based generator: the n-th number depends only on the key and n,
+// not on what was drawn before, so a chunk gets the same numbers whichever
+// thread generates it and in whatever order. Mixes with the seeding and
+// tempering steps of the twister.
+class CounterRandom {
+  static const unsigned long MAX = 0xffffffffUL;
+
+  unsigned long key;
+  unsigned long counter;
+public:
+  // Numbers for chunk x,z of a map seed, stream tells apart the users
+  // within a chunk
+  CounterRandom(unsigned long seed, int x, int z, unsigned long stream = 0);
+
+  // The n-th number of the sequence
+  unsigned long get(unsigned long n) const;
+
+  // Same as Random, drawing the next number of the sequence
+  double uniform();
+  unsigned uniform(unsigned hi);
+  unsigned uniform(unsigned lo, unsigned hi);
+private:
+  static unsigned long mix(unsigned long value, unsigned long step);
+};
+
 #endif
@@ -62,6 +62,9 @@
 #include "user.h"
 #include "chat.h"
 #include "mapgen.h"
+#include "chunkprovider.h"
+#include "journal.h"
+#include "backup.h"
 #include "config.h"
 #include "nbt.h"
 #include "packets.h"
@@ -72,22 +75,6 @@
 static bool quit = false;
 #endif
 
-int setnonblock(int fd)
-{
-  #ifdef WIN32
-  u_long iMode = 1;
-  ioctlsocket(fd, FIONBIO, &iMode);
-  #else
-  int flags;
-
-  flags  = fcntl(fd, F_GETFL);
-  flags |= O_NONBLOCK;
-  fcntl(fd, F_SETFL, flags);
-  #endif
-
-  return 1;
-}
-
 //Handle signals
 void sighandler(int sig_num)
 {
@@ -137,6 +124,13 @@ int Mineserver::Run()
   //Initialize map
   Map::get().initMap();
 
+  //Start background chunk loading and saving
+  ChunkProvider::get().init();
+
+  //Autosave interval in seconds, 0 = save only on /save and release
+  int autosaveInterval = Conf::get().iValue("map_autosave_interval");
+  uint32 lastSave      = (uint32)time(0);
+
   //Initialize packethandler
   PacketHandler::get().initPackets();
 
@@ -228,7 +222,12 @@ int Mineserver::Run()
     if(time(0)-starttime > 10)
     {
       starttime = (uint32)time(0);
-      std::cout << "Currently " << Users.size() << " users in!" << std::endl;
+      std::cout << "Currently " << Users.size() << " users in, "
+                << Map::get().maps.size() << " chunks loaded ("
+                << Map::get().residentBytes/1024 << " kB, "
+                << sChunk::sharedMemoryUsage()/1024 << " kB shared), "
+                << Map::get().warmMaps.size() << " compressed ("
+                << Map::get().warmBytes/1024 << " kB)" << std::endl;
 
       //If users, ping them
       if(Users.size() > 0)
@@ -241,26 +240,13 @@ int Mineserver::Run()
         uint8 data3[9] = {0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0e, 0x00};
         Users[0]->sendAll((uint8 *)&data3[0], 9);
       }
+    }
 
-      //Try to load port from config
-      int map_release_time = Conf::get().iValue("map_release_time");
-
-      //Release chunks not used in <map_release_time> seconds
-      std::vector<uint32> toRelease;
-      for(std::map<uint32, int>::const_iterator it = Map::get().mapLastused.begin();
-          it != Map::get().mapLastused.end();
-          ++it)
-      {
-        if(Map::get().mapLastused[it->first] <= time(0)-map_release_time)
-          toRelease.push_back(it->first);
-      }
-
-      int x_temp, z_temp;
-      for(unsigned i = 0; i < toRelease.size(); i++)
-      {
-        Map::get().idToPos(toRelease[i], &x_temp, &z_temp);
-        Map::get().releaseMap(x_temp, z_temp);
-      }
+    //Autosave modified chunks
+    if(autosaveInterval > 0 && time(0)-lastSave >= autosaveInterval)
+    {
+      lastSave = (uint32)time(0);
+      Map::get().saveWholeMap();
     }
 
     //Every second
@@ -272,16 +258,48 @@ int Mineserver::Run()
       {
         Users[i]->pushMap();
         Users[i]->popMap();
+        Users[i]->prefetchMap();
+      }
+    }
+
+    //Publish chunks loaded in the background
+    ChunkProvider::get().poll();
+
+    //Send the chunks that arrived, throttled like every other push
+    for(unsigned int i = 0; i < Users.size(); i++)
+    {
+      if(Users[i]->mapsArrived)
+      {
+        Users[i]->mapsArrived = false;
+        Users[i]->pushMap();
       }
     }
 
+    //Relight chunks changed since the last tick
+    Map::get().relightMaps();
+
+    //Release unused chunks a few at a time
+    Map::get().evictMaps();
+
+    //Report finished backups
+    Backup::get().poll();
+
+    //Write this tick's block changes to the journal
+    Journal::get().flush();
+
     //Physics simulation every 200ms
     Physics::get().update();
 
     event_base_loopexit(m_eventBase, &loopTime);
   }
 
+  Backup::get().free();
+  // Snapshots of the changed chunks go to the savers, which the provider
+  // finishes before it stops
+  Map::get().releaseAllMaps();
+  ChunkProvider::get().free();
   Map::get().freeMap();
+  Journal::get().free();
 
   #ifdef WIN32
   closesocket(m_socketlisten);
@@ -453,6 +453,47 @@ void NBT_Value::cleanup()
   m_type = TAG_END;
 }
 
+NBT_Value *NBT_Value::Clone()
+{
+  NBT_Value *copy = new NBT_Value(m_type);
+
+  switch(m_type)
+  {
+  case TAG_STRING:
+    if(m_value.stringVal != NULL)
+      copy->m_value.stringVal = new std::string(*m_value.stringVal);
+    break;
+  case TAG_BYTE_ARRAY:
+    if(m_value.byteArrayVal != NULL)
+      copy->m_value.byteArrayVal = new std::vector<uint8>(*m_value.byteArrayVal);
+    break;
+  case TAG_LIST:
+    copy->m_value.listVal.type = m_value.listVal.type;
+    if(m_value.listVal.data != NULL)
+    {
+      copy->m_value.listVal.data = new std::vector<NBT_Value*>();
+      std::vector<NBT_Value*>::iterator iter = m_value.listVal.data->begin(), end = m_value.listVal.data->end();
+      for( ; iter != end ; iter++)
+        copy->m_value.listVal.data->push_back(*iter ? (*iter)->Clone() : NULL);
+    }
+    break;
+  case TAG_COMPOUND:
+    if(m_value.compoundVal != NULL)
+    {
+      copy->m_value.compoundVal = new std::map<std::string, NBT_Value*>();
+      std::map<std::string, NBT_Value*>::iterator iter = m_value.compoundVal->begin(), end = m_value.compoundVal->end();
+      for( ; iter != end; iter++)
+        (*copy->m_value.compoundVal)[iter->first] = iter->second->Clone();
+    }
+    break;
+  default:
+    copy->m_value = m_value;
+    break;
+  }
+
+  return copy;
+}
+
 NBT_Value * NBT_Value::LoadFromFile(const std::string &filename)
 {
   FILE *fp = fopen(filename.c_str(), "rb");
@@ -473,20 +514,36 @@ NBT_Value * NBT_Value::LoadFromFile(const std::string &filename)
   gzread(nbtFile, uncompressedData, uncompressedSize);
   gzclose(nbtFile);
 
-  uint8 *ptr = uncompressedData+3; // Jump blank compound
-  int remaining = uncompressedSize;
-
-  NBT_Value *root = new NBT_Value(TAG_COMPOUND, &ptr, remaining);
+  NBT_Value *root = LoadFromMemory(uncompressedData, uncompressedSize);
 
   delete[] uncompressedData;
 
   return root;
 }
 
+NBT_Value * NBT_Value::LoadFromMemory(uint8 *buffer, uint32 len)
+{
+  if(len < 3)
+    return NULL;
+
+  uint8 *ptr = buffer+3; // Jump blank compound
+  int remaining = len;
+
+  return new NBT_Value(TAG_COMPOUND, &ptr, remaining);
+}
+
 void NBT_Value::SaveToFile(const std::string &filename)
 {
   std::vector<uint8> buffer;
-  
+  SaveToMemory(buffer);
+
+  gzFile nbtFile = gzopen(filename.c_str(), "wb");
+  gzwrite(nbtFile, &buffer[0], buffer.size());
+  gzclose(nbtFile);
+}
+
+void NBT_Value::SaveToMemory(std::vector<uint8> &buffer)
+{
   // Blank compound tag
   buffer.push_back(TAG_COMPOUND);
   buffer.push_back(0);
@@ -497,10 +554,6 @@ void NBT_Value::SaveToFile(const std::string &filename)
   buffer.push_back(0);
   buffer.push_back(0);
   buffer.push_back(0);
-
-  gzFile nbtFile = gzopen(filename.c_str(), "wb");
-  gzwrite(nbtFile, &buffer[0], buffer.size());
-  gzclose(nbtFile);
 }
 
 void NBT_Value::Write(std::vector<uint8> &buffer)
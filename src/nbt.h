@@ -92,8 +92,15 @@ public:
   eTAG_Type GetType();
   void cleanup();
 
+  // Deep copy
+  NBT_Value *Clone();
+
   static NBT_Value * LoadFromFile(const std::string &filename);
   void SaveToFile(const std::string &filename);
+
+  // Uncompressed file contents, as used inside region files
+  static NBT_Value * LoadFromMemory(uint8 *buffer, uint32 len);
+  void SaveToMemory(std::vector<uint8> &buffer);
   
   void Write(std::vector<uint8> &buffer);
 
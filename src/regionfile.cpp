@@ -0,0 +1,700 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef WIN32
+  #include <direct.h>
+#else
+  #include <sys/mman.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "tools.h"
+#include "nbt.h"
+#include "regionfile.h"
+
+namespace
+{
+
+// Accepts both zlib and gzip streams
+bool inflateData(const uint8 *in, size_t len, std::vector<uint8> &out)
+{
+  z_stream zstream;
+  memset(&zstream, 0, sizeof(zstream));
+  if(inflateInit2(&zstream, 15+32) != Z_OK)
+    return false;
+
+  out.resize(len*4 + 1024);
+  zstream.next_in  = (Bytef *)in;
+  zstream.avail_in = (uInt)len;
+
+  int state;
+  do
+  {
+    if(zstream.total_out == out.size())
+      out.resize(out.size()*2);
+
+    zstream.next_out  = &out[zstream.total_out];
+    zstream.avail_out = (uInt)(out.size() - zstream.total_out);
+    state = inflate(&zstream, Z_NO_FLUSH);
+  }
+  while(state == Z_OK);
+
+  out.resize(zstream.total_out);
+  inflateEnd(&zstream);
+
+  return state == Z_STREAM_END;
+}
+
+int chunkIndex(int x, int z)
+{
+  return (x & (RegionFile::CHUNKS-1)) + (z & (RegionFile::CHUNKS-1))*RegionFile::CHUNKS;
+}
+
+}
+
+RegionFile::RegionFile()
+  :
+#ifdef WIN32
+    m_file(INVALID_HANDLE_VALUE), m_mapping(NULL),
+#else
+    m_fd(-1),
+#endif
+    m_map(NULL), m_mapSize(0)
+{
+  memset(m_offsets, 0, sizeof(m_offsets));
+}
+
+RegionFile::~RegionFile()
+{
+  close();
+}
+
+bool RegionFile::open(const std::string &filename)
+{
+  close();
+
+#ifdef WIN32
+  m_file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                       OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(m_file == INVALID_HANDLE_VALUE)
+    return false;
+#else
+  m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+  if(m_fd == -1)
+    return false;
+#endif
+
+  MutexLock lock(m_mutex);
+
+  // New or truncated file, write empty tables
+  size_t size = fileSize();
+  if(size < HEADER_SECTORS*SECTOR_SIZE)
+  {
+    std::vector<uint8> header(HEADER_SECTORS*SECTOR_SIZE, 0);
+    if(!writeAt(&header[0], header.size(), 0))
+      return false;
+    size = header.size();
+  }
+
+  // Keep the file a whole number of sectors
+  if(size % SECTOR_SIZE)
+  {
+    std::vector<uint8> padding(SECTOR_SIZE - size % SECTOR_SIZE, 0);
+    writeAt(&padding[0], padding.size(), size);
+    size += padding.size();
+  }
+
+  uint8 header[SECTOR_SIZE];
+  if(!readAt(header, SECTOR_SIZE, 0))
+    return false;
+
+  m_usedSectors.assign(size / SECTOR_SIZE, false);
+  for(int i = 0; i < HEADER_SECTORS; i++)
+    m_usedSectors[i] = true;
+
+  for(int i = 0; i < CHUNKS*CHUNKS; i++)
+  {
+    uint32 offset = (uint32)getSint32(&header[i*4]);
+    uint32 sector = offset >> 8;
+    uint32 count  = offset & 0xff;
+
+    // Drop entries pointing outside the file
+    if(offset != 0 && (sector < HEADER_SECTORS || count == 0 ||
+                       sector + count > m_usedSectors.size()))
+    {
+      LOG("Invalid chunk offset in region file");
+      offset = 0;
+    }
+
+    m_offsets[i] = offset;
+    for(uint32 j = 0; offset != 0 && j < count; j++)
+      m_usedSectors[sector + j] = true;
+  }
+
+  remap();
+
+  return true;
+}
+
+void RegionFile::close()
+{
+  unmap();
+
+#ifdef WIN32
+  if(m_file != INVALID_HANDLE_VALUE)
+  {
+    CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+  }
+#else
+  if(m_fd != -1)
+  {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+#endif
+}
+
+bool RegionFile::hasChunk(int x, int z)
+{
+  MutexLock lock(m_mutex);
+  return m_offsets[chunkIndex(x, z)] != 0;
+}
+
+bool RegionFile::readChunk(int x, int z, std::vector<uint8> &data)
+{
+  std::vector<uint8> compressed;
+
+  {
+    MutexLock lock(m_mutex);
+
+    uint32 offset = m_offsets[chunkIndex(x, z)];
+    if(offset == 0)
+      return false;
+
+    size_t pos      = (size_t)(offset >> 8) * SECTOR_SIZE;
+    size_t capacity = (size_t)(offset & 0xff) * SECTOR_SIZE;
+
+    uint8 header[5];
+    if(m_map != NULL && pos + capacity <= m_mapSize)
+      memcpy(header, m_map + pos, 5);
+    else if(!readAt(header, 5, pos))
+      return false;
+
+    // Length includes the compression type byte
+    sint32 length = getSint32(header);
+    if(length <= 1 || (size_t)length + 4 > capacity)
+    {
+      LOG("Invalid chunk length in region file");
+      return false;
+    }
+
+    if(header[4] != COMPRESSION_GZIP && header[4] != COMPRESSION_ZLIB)
+    {
+      LOG("Unknown chunk compression in region file");
+      return false;
+    }
+
+    compressed.resize(length - 1);
+    if(m_map != NULL && pos + capacity <= m_mapSize)
+      memcpy(&compressed[0], m_map + pos + 5, compressed.size());
+    else if(!readAt(&compressed[0], compressed.size(), pos + 5))
+      return false;
+  }
+
+  // Decompress without holding the lock
+  if(!inflateData(&compressed[0], compressed.size(), data))
+  {
+    LOG("Error in decompressing chunk from region file");
+    return false;
+  }
+
+  return true;
+}
+
+bool RegionFile::writeChunk(int x, int z, const std::vector<uint8> &data)
+{
+  if(data.empty())
+    return false;
+
+  // Compress before taking the lock
+  uLongf compressedLen = compressBound(data.size());
+  std::vector<uint8> buffer(5 + compressedLen);
+  if(compress2(&buffer[5], &compressedLen, &data[0], data.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+    return false;
+
+  putSint32(&buffer[0], (sint32)(compressedLen + 1));
+  buffer[4] = COMPRESSION_ZLIB;
+
+  uint32 sectors = (uint32)((5 + compressedLen + SECTOR_SIZE - 1) / SECTOR_SIZE);
+  if(sectors > MAX_CHUNK_SECTORS)
+  {
+    LOG("Chunk too large for region file");
+    return false;
+  }
+  buffer.resize(sectors * SECTOR_SIZE, 0);
+
+  MutexLock lock(m_mutex);
+
+  // Never write over the old copy, it stays valid until the header points
+  // to the new one
+  uint32 run    = 0;
+  uint32 sector = (uint32)m_usedSectors.size();
+  for(uint32 i = HEADER_SECTORS; i < m_usedSectors.size(); i++)
+  {
+    run = m_usedSectors[i] ? 0 : run + 1;
+    if(run == sectors)
+    {
+      sector = i + 1 - sectors;
+      break;
+    }
+  }
+
+  if(sector + sectors > m_usedSectors.size())
+    m_usedSectors.resize(sector + sectors, false);
+  for(uint32 i = 0; i < sectors; i++)
+    m_usedSectors[sector + i] = true;
+
+  bool grown = (size_t)(sector + sectors) * SECTOR_SIZE > m_mapSize;
+
+  // Data on disk before the header entry that points to it
+  if(!writeAt(&buffer[0], buffer.size(), (size_t)sector * SECTOR_SIZE) || !sync())
+  {
+    LOG("Error in writing chunk to region file");
+    for(uint32 i = 0; i < sectors; i++)
+      m_usedSectors[sector + i] = false;
+    return false;
+  }
+
+  int index       = chunkIndex(x, z);
+  uint32 oldEntry = m_offsets[index];
+
+  uint8 entry[4];
+  putSint32(entry, (sint32)((sector << 8) | sectors));
+  if(!writeAt(entry, 4, index*4) || !sync())
+  {
+    LOG("Error in writing chunk offset to region file");
+    // The entry may have reached the disk, keep both runs allocated
+    return false;
+  }
+
+  m_offsets[index] = (sector << 8) | sectors;
+  for(uint32 i = 0; i < (oldEntry & 0xff); i++)
+    m_usedSectors[(oldEntry >> 8) + i] = false;
+
+  // Only informational, no need to sync
+  putSint32(entry, (sint32)time(0));
+  writeAt(entry, 4, SECTOR_SIZE + index*4);
+
+  if(grown)
+    remap();
+
+  return true;
+}
+
+bool RegionFile::readAt(uint8 *buf, size_t len, size_t offset)
+{
+#ifdef WIN32
+  OVERLAPPED overlapped;
+  memset(&overlapped, 0, sizeof(overlapped));
+  overlapped.Offset     = (DWORD)offset;
+  overlapped.OffsetHigh = (DWORD)((uint64)offset >> 32);
+
+  DWORD read = 0;
+  return ReadFile(m_file, buf, (DWORD)len, &read, &overlapped) && read == len;
+#else
+  while(len > 0)
+  {
+    ssize_t read = pread(m_fd, buf, len, offset);
+    if(read <= 0)
+      return false;
+    buf    += read;
+    len    -= read;
+    offset += read;
+  }
+  return true;
+#endif
+}
+
+bool RegionFile::writeAt(const uint8 *buf, size_t len, size_t offset)
+{
+#ifdef WIN32
+  OVERLAPPED overlapped;
+  memset(&overlapped, 0, sizeof(overlapped));
+  overlapped.Offset     = (DWORD)offset;
+  overlapped.OffsetHigh = (DWORD)((uint64)offset >> 32);
+
+  DWORD written = 0;
+  return WriteFile(m_file, buf, (DWORD)len, &written, &overlapped) && written == len;
+#else
+  while(len > 0)
+  {
+    ssize_t written = pwrite(m_fd, buf, len, offset);
+    if(written <= 0)
+      return false;
+    buf    += written;
+    len    -= written;
+    offset += written;
+  }
+  return true;
+#endif
+}
+
+bool RegionFile::sync()
+{
+#ifdef WIN32
+  return FlushFileBuffers(m_file) != 0;
+#else
+  return fsync(m_fd) == 0;
+#endif
+}
+
+size_t RegionFile::fileSize()
+{
+#ifdef WIN32
+  LARGE_INTEGER size;
+  if(!GetFileSizeEx(m_file, &size))
+    return 0;
+  return (size_t)size.QuadPart;
+#else
+  struct stat stFileInfo;
+  if(fstat(m_fd, &stFileInfo) != 0)
+    return 0;
+  return (size_t)stFileInfo.st_size;
+#endif
+}
+
+void RegionFile::remap()
+{
+  unmap();
+
+  size_t size = fileSize();
+  if(size == 0)
+    return;
+
+  // Without a mapping reads fall back to readAt
+#ifdef WIN32
+  m_mapping = CreateFileMapping(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if(m_mapping == NULL)
+    return;
+  m_map = (uint8 *)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+  void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, m_fd, 0);
+  m_map     = (map == MAP_FAILED) ? NULL : (uint8 *)map;
+#endif
+
+  if(m_map != NULL)
+    m_mapSize = size;
+}
+
+void RegionFile::unmap()
+{
+#ifdef WIN32
+  if(m_map != NULL)
+    UnmapViewOfFile(m_map);
+  if(m_mapping != NULL)
+    CloseHandle(m_mapping);
+  m_mapping = NULL;
+#else
+  if(m_map != NULL)
+    munmap(m_map, m_mapSize);
+#endif
+  m_map     = NULL;
+  m_mapSize = 0;
+}
+
+RegionStorage::RegionStorage()
+{
+}
+
+RegionStorage::~RegionStorage()
+{
+  free();
+}
+
+bool RegionStorage::init(const std::string &mapDirectory)
+{
+  m_directory = mapDirectory+"/region";
+
+  struct stat stFileInfo;
+#ifdef WIN32
+  if(stat(m_directory.c_str(), &stFileInfo) != 0 && _mkdir(m_directory.c_str()) == -1)
+#else
+  if(stat(m_directory.c_str(), &stFileInfo) != 0 && mkdir(m_directory.c_str(), 0755) == -1)
+#endif
+  {
+    LOG("Unable to create region directory");
+    return false;
+  }
+
+  // Every start, a conversion cut short by a stop or crash is finished
+  // instead of the remaining chunks being generated again
+  int converted = convertLegacy(mapDirectory);
+  if(converted)
+    std::cout << "Converted " << converted << " chunks to region files" << std::endl;
+
+  return true;
+}
+
+void RegionStorage::free()
+{
+  MutexLock lock(m_mutex);
+
+  for(std::map<std::pair<int, int>, RegionFile *>::iterator it = m_regions.begin();
+      it != m_regions.end();
+      ++it)
+  {
+    delete it->second;
+  }
+  m_regions.clear();
+}
+
+RegionFile *RegionStorage::getRegion(int x, int z, bool create)
+{
+  std::pair<int, int> pos(x >> 5, z >> 5);
+
+  MutexLock lock(m_mutex);
+
+  std::map<std::pair<int, int>, RegionFile *>::iterator it = m_regions.find(pos);
+  if(it != m_regions.end() && (it->second != NULL || !create))
+    return it->second;
+
+  std::ostringstream filename;
+  filename << m_directory << "/r." << pos.first << "." << pos.second << ".mcr";
+
+  struct stat stFileInfo;
+  if(!create && stat(filename.str().c_str(), &stFileInfo) != 0)
+  {
+    m_regions[pos] = NULL;
+    return NULL;
+  }
+
+  RegionFile *region = new RegionFile;
+  if(!region->open(filename.str()))
+  {
+    LOG("Unable to open region file");
+    delete region;
+    region = NULL;
+  }
+
+  m_regions[pos] = region;
+  return region;
+}
+
+NBT_Value *RegionStorage::loadChunk(int x, int z, bool *exists)
+{
+  RegionFile *region = getRegion(x, z, false);
+
+  *exists = (region != NULL && region->hasChunk(x, z));
+  if(!*exists)
+    return NULL;
+
+  std::vector<uint8> data;
+  if(!region->readChunk(x, z, data))
+    return NULL;
+
+  NBT_Value *root = NBT_Value::LoadFromMemory(&data[0], (uint32)data.size());
+  if(root == NULL)
+    LOG("Error in loading map (unable to parse chunk)");
+
+  return root;
+}
+
+bool RegionStorage::saveChunk(int x, int z, NBT_Value *root)
+{
+  RegionFile *region = getRegion(x, z, true);
+  if(region == NULL)
+    return false;
+
+  std::vector<uint8> data;
+  root->SaveToMemory(data);
+
+  return region->writeChunk(x, z, data);
+}
+
+bool RegionStorage::hasChunk(int x, int z)
+{
+  RegionFile *region = getRegion(x, z, false);
+  return region != NULL && region->hasChunk(x, z);
+}
+
+void RegionStorage::listChunks(std::vector<std::pair<int, int> > &chunks)
+{
+  std::vector<std::string> files;
+  listDirectory(m_directory, files);
+
+  for(unsigned int i = 0; i < files.size(); i++)
+  {
+    int regionX, regionZ;
+    char extension[4];
+    if(sscanf(files[i].c_str(), "r.%d.%d.%3s", &regionX, &regionZ, extension) != 3 ||
+       std::string(extension) != "mcr")
+    {
+      continue;
+    }
+
+    RegionFile *region = getRegion(regionX*RegionFile::CHUNKS, regionZ*RegionFile::CHUNKS, false);
+    if(region == NULL)
+      continue;
+
+    for(int x = 0; x < RegionFile::CHUNKS; x++)
+    {
+      for(int z = 0; z < RegionFile::CHUNKS; z++)
+      {
+        if(region->hasChunk(x, z))
+          chunks.push_back(std::make_pair(regionX*RegionFile::CHUNKS+x, regionZ*RegionFile::CHUNKS+z));
+      }
+    }
+  }
+}
+
+// Chunk position from c.<b36 x>.<b36 z>.dat
+static bool legacyPosition(const std::string &name, int *x, int *z)
+{
+  size_t dot = name.find('.', 2);
+  if(dot == std::string::npos || dot+5 > name.size())
+    return false;
+
+  std::string xName = name.substr(2, dot-2);
+  std::string zName = name.substr(dot+1, name.size()-dot-5);
+  if(xName.empty() || zName.empty())
+    return false;
+
+  char *end;
+  *x = (int)strtol(xName.c_str(), &end, 36);
+  if(*end != '\0')
+    return false;
+  *z = (int)strtol(zName.c_str(), &end, 36);
+  return *end == '\0';
+}
+
+int RegionStorage::convertLegacy(const std::string &mapDirectory)
+{
+  int converted = 0;
+
+  // Chunks were in <mapdir>/<b36 x&63>/<b36 z&63>/c.<b36 x>.<b36 z>.dat
+  std::vector<std::string> outer;
+  listDirectory(mapDirectory, outer);
+
+  for(unsigned int i = 0; i < outer.size(); i++)
+  {
+    if(outer[i].size() > 2)
+      continue;
+
+    std::string outdir_a = mapDirectory+"/"+outer[i];
+    std::vector<std::string> inner;
+    if(!listDirectory(outdir_a, inner))
+      continue;
+
+    bool hadChunks = false;
+
+    for(unsigned int j = 0; j < inner.size(); j++)
+    {
+      if(inner[j].size() > 2)
+        continue;
+
+      std::string outdir_b = outdir_a+"/"+inner[j];
+      std::vector<std::string> files;
+      listDirectory(outdir_b, files);
+
+      for(unsigned int k = 0; k < files.size(); k++)
+      {
+        const std::string &name = files[k];
+        if(name.size() < 6 || name.compare(0, 2, "c.") != 0 ||
+           name.compare(name.size()-4, 4, ".dat") != 0)
+        {
+          continue;
+        }
+
+        hadChunks = true;
+
+        // Saved before an interrupted conversion removed the file, the
+        // region copy may have changed since
+        std::string infile = outdir_b+"/"+name;
+        int chunkX, chunkZ;
+        if(legacyPosition(name, &chunkX, &chunkZ) && hasChunk(chunkX, chunkZ))
+        {
+          remove(infile.c_str());
+          continue;
+        }
+
+        NBT_Value *root = NBT_Value::LoadFromFile(infile);
+        if(root == NULL)
+        {
+          LOG("Unable to convert chunk file "+infile);
+          continue;
+        }
+
+        NBT_Value *level = (*root)["Level"];
+        NBT_Value *xPos  = level ? (*level)["xPos"] : NULL;
+        NBT_Value *zPos  = level ? (*level)["zPos"] : NULL;
+
+        if(xPos && zPos && saveChunk((sint32)*xPos, (sint32)*zPos, root))
+        {
+          remove(infile.c_str());
+          converted++;
+        }
+        else
+          LOG("Unable to convert chunk file "+infile);
+
+        delete root;
+      }
+
+      // Only succeeds once all chunk files are gone
+      if(hadChunks)
+      {
+#ifdef WIN32
+        _rmdir(outdir_b.c_str());
+#else
+        rmdir(outdir_b.c_str());
+#endif
+      }
+    }
+
+    if(hadChunks)
+    {
+#ifdef WIN32
+      _rmdir(outdir_a.c_str());
+#else
+      rmdir(outdir_a.c_str());
+#endif
+    }
+  }
+
+  return converted;
+}
@@ -0,0 +1,134 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _REGIONFILE_H
+#define _REGIONFILE_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include "tools.h"
+#include "thread.h"
+
+class NBT_Value;
+
+// Container for 32x32 chunks in the McRegion layout: a table of sector
+// offsets, a table of timestamps and 4KB sectors holding the length,
+// compression type and compressed data of each chunk. Reads go through a
+// read-only mapping of the file. All methods are thread safe.
+class RegionFile
+{
+public:
+  enum
+  {
+    CHUNKS            = 32,
+    SECTOR_SIZE       = 4096,
+    HEADER_SECTORS    = 2,
+    MAX_CHUNK_SECTORS = 255
+  };
+
+  enum
+  {
+    COMPRESSION_GZIP = 1,
+    COMPRESSION_ZLIB = 2
+  };
+
+  RegionFile();
+  ~RegionFile();
+
+  bool open(const std::string &filename);
+  void close();
+
+  // Chunk coordinates are local to the region, 0-31
+  bool hasChunk(int x, int z);
+
+  // Uncompressed chunk data, false if the chunk does not exist or is broken
+  bool readChunk(int x, int z, std::vector<uint8> &data);
+  // Writes to a free run and is on the disk when true is returned, the old
+  // copy stays intact until then
+  bool writeChunk(int x, int z, const std::vector<uint8> &data);
+
+private:
+#ifdef WIN32
+  HANDLE m_file;
+  HANDLE m_mapping;
+#else
+  int m_fd;
+#endif
+  uint8 *m_map;
+  size_t m_mapSize;
+
+  uint32 m_offsets[CHUNKS*CHUNKS];
+  std::vector<bool> m_usedSectors;
+  Mutex m_mutex;
+
+  bool readAt(uint8 *buf, size_t len, size_t offset);
+  bool writeAt(const uint8 *buf, size_t len, size_t offset);
+  // Flush written data to the disk
+  bool sync();
+  size_t fileSize();
+  void remap();
+  void unmap();
+
+  RegionFile(const RegionFile &);
+  RegionFile &operator=(const RegionFile &);
+};
+
+// Chunk storage in <mapdir>/region/r.<x>.<z>.mcr
+class RegionStorage
+{
+public:
+  RegionStorage();
+  ~RegionStorage();
+
+  // Creates the region directory if needed and converts any chunk files
+  // left in the old one file per chunk layout
+  bool init(const std::string &mapDirectory);
+  void free();
+
+  // Thread safe. Root of the chunk NBT, NULL if missing (exists is false)
+  // or broken.
+  NBT_Value *loadChunk(int x, int z, bool *exists);
+  bool saveChunk(int x, int z, NBT_Value *root);
+  bool hasChunk(int x, int z);
+
+  // Positions of all stored chunks
+  void listChunks(std::vector<std::pair<int, int> > &chunks);
+
+  // Move c.<x>.<z>.dat files into region files, returns converted chunks
+  int convertLegacy(const std::string &mapDirectory);
+
+private:
+  std::string m_directory;
+  // NULL entries cache region files that do not exist
+  std::map<std::pair<int, int>, RegionFile *> m_regions;
+  Mutex m_mutex;
+
+  RegionFile *getRegion(int x, int z, bool create);
+};
+
+#endif
@@ -64,7 +64,21 @@ typedef  int socklen_t;
 #include "packets.h"
 
 
-extern int setnonblock(int fd);
+int setnonblock(int fd)
+{
+  #ifdef WIN32
+  u_long iMode = 1;
+  ioctlsocket(fd, FIONBIO, &iMode);
+  #else
+  int flags;
+
+  flags  = fcntl(fd, F_GETFL);
+  flags |= O_NONBLOCK;
+  fcntl(fd, F_SETFL, flags);
+  #endif
+
+  return 1;
+}
 
 
 void client_callback(int fd,
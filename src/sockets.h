@@ -26,3 +26,4 @@
  */
 
 void accept_callback(int fd, short ev, void *arg);
+int setnonblock(int fd);
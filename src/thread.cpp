@@ -0,0 +1,348 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WIN32
+  #include <unistd.h>
+#endif
+
+#include "thread.h"
+
+#ifdef WIN32
+
+Mutex::Mutex()
+{
+  InitializeCriticalSection(&m_mutex);
+}
+
+Mutex::~Mutex()
+{
+  DeleteCriticalSection(&m_mutex);
+}
+
+void Mutex::lock()
+{
+  EnterCriticalSection(&m_mutex);
+}
+
+void Mutex::unlock()
+{
+  LeaveCriticalSection(&m_mutex);
+}
+
+Condition::Condition()
+{
+  InitializeConditionVariable(&m_cond);
+}
+
+Condition::~Condition()
+{
+}
+
+void Condition::wait(Mutex &mutex)
+{
+  SleepConditionVariableCS(&m_cond, &mutex.m_mutex, INFINITE);
+}
+
+void Condition::signal()
+{
+  WakeConditionVariable(&m_cond);
+}
+
+void Condition::broadcast()
+{
+  WakeAllConditionVariable(&m_cond);
+}
+
+namespace
+{
+
+struct ThreadStart
+{
+  Thread::ThreadFunc func;
+  void *arg;
+};
+
+DWORD WINAPI threadEntry(LPVOID param)
+{
+  ThreadStart start = *(ThreadStart *)param;
+  delete (ThreadStart *)param;
+  start.func(start.arg);
+  return 0;
+}
+
+}
+
+Thread::Thread() : m_thread(NULL), m_running(false)
+{
+}
+
+bool Thread::start(ThreadFunc func, void *arg)
+{
+  ThreadStart *start = new ThreadStart;
+  start->func = func;
+  start->arg  = arg;
+
+  m_thread = CreateThread(NULL, 0, threadEntry, start, 0, NULL);
+  if(m_thread == NULL)
+  {
+    delete start;
+    return false;
+  }
+
+  m_running = true;
+  return true;
+}
+
+void Thread::join()
+{
+  if(!m_running)
+    return;
+
+  WaitForSingleObject(m_thread, INFINITE);
+  CloseHandle(m_thread);
+  m_running = false;
+}
+
+int Thread::cpuCount()
+{
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+#else
+
+Mutex::Mutex()
+{
+  pthread_mutex_init(&m_mutex, NULL);
+}
+
+Mutex::~Mutex()
+{
+  pthread_mutex_destroy(&m_mutex);
+}
+
+void Mutex::lock()
+{
+  pthread_mutex_lock(&m_mutex);
+}
+
+void Mutex::unlock()
+{
+  pthread_mutex_unlock(&m_mutex);
+}
+
+Condition::Condition()
+{
+  pthread_cond_init(&m_cond, NULL);
+}
+
+Condition::~Condition()
+{
+  pthread_cond_destroy(&m_cond);
+}
+
+void Condition::wait(Mutex &mutex)
+{
+  pthread_cond_wait(&m_cond, &mutex.m_mutex);
+}
+
+void Condition::signal()
+{
+  pthread_cond_signal(&m_cond);
+}
+
+void Condition::broadcast()
+{
+  pthread_cond_broadcast(&m_cond);
+}
+
+namespace
+{
+
+struct ThreadStart
+{
+  Thread::ThreadFunc func;
+  void *arg;
+};
+
+void *threadEntry(void *param)
+{
+  ThreadStart start = *(ThreadStart *)param;
+  delete (ThreadStart *)param;
+  start.func(start.arg);
+  return NULL;
+}
+
+}
+
+Thread::Thread() : m_running(false)
+{
+}
+
+bool Thread::start(ThreadFunc func, void *arg)
+{
+  ThreadStart *start = new ThreadStart;
+  start->func = func;
+  start->arg  = arg;
+
+  if(pthread_create(&m_thread, NULL, threadEntry, start) != 0)
+  {
+    delete start;
+    return false;
+  }
+
+  m_running = true;
+  return true;
+}
+
+void Thread::join()
+{
+  if(!m_running)
+    return;
+
+  pthread_join(m_thread, NULL);
+  m_running = false;
+}
+
+int Thread::cpuCount()
+{
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+}
+
+#endif
+
+ThreadPool::ThreadPool() : m_running(false)
+{
+}
+
+ThreadPool::~ThreadPool()
+{
+  stop();
+}
+
+void ThreadPool::start(int threads)
+{
+  MutexLock lock(m_mutex);
+
+  m_running = true;
+  for(int i = 0; i < threads; i++)
+  {
+    Thread *thread = new Thread;
+    if(!thread->start(worker, this))
+    {
+      delete thread;
+      break;
+    }
+    m_threads.push_back(thread);
+  }
+}
+
+void ThreadPool::stop(std::vector<Job *> *unfinished)
+{
+  m_mutex.lock();
+  m_running = false;
+  m_cond.broadcast();
+  m_mutex.unlock();
+
+  for(unsigned int i = 0; i < m_threads.size(); i++)
+  {
+    m_threads[i]->join();
+    delete m_threads[i];
+  }
+  m_threads.clear();
+
+  MutexLock lock(m_mutex);
+  if(unfinished != NULL)
+  {
+    unfinished->insert(unfinished->end(), m_queue.begin(), m_queue.end());
+    unfinished->insert(unfinished->end(), m_lowQueue.begin(), m_lowQueue.end());
+  }
+  else
+  {
+    // Nobody takes them back
+    for(unsigned int i = 0; i < m_queue.size(); i++)
+      delete m_queue[i];
+    for(unsigned int i = 0; i < m_lowQueue.size(); i++)
+      delete m_lowQueue[i];
+  }
+  m_queue.clear();
+  m_lowQueue.clear();
+}
+
+void ThreadPool::push(Job *job, bool lowPriority)
+{
+  MutexLock lock(m_mutex);
+  if(lowPriority)
+    m_lowQueue.push_back(job);
+  else
+    m_queue.push_back(job);
+  m_cond.signal();
+}
+
+bool ThreadPool::promote(Job *job)
+{
+  MutexLock lock(m_mutex);
+
+  for(std::deque<Job *>::iterator it = m_lowQueue.begin(); it != m_lowQueue.end(); ++it)
+  {
+    if(*it == job)
+    {
+      m_lowQueue.erase(it);
+      m_queue.push_back(job);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ThreadPool::worker(void *arg)
+{
+  ThreadPool *pool = (ThreadPool *)arg;
+
+  for(;;)
+  {
+    pool->m_mutex.lock();
+    while(pool->m_running && pool->m_queue.empty() && pool->m_lowQueue.empty())
+      pool->m_cond.wait(pool->m_mutex);
+
+    if(!pool->m_running)
+    {
+      pool->m_mutex.unlock();
+      return;
+    }
+
+    std::deque<Job *> &queue = pool->m_queue.empty() ? pool->m_lowQueue : pool->m_queue;
+    Job *job = queue.front();
+    queue.pop_front();
+    pool->m_mutex.unlock();
+
+    job->run();
+  }
+}
@@ -0,0 +1,167 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _THREAD_H
+#define _THREAD_H
+
+#include <deque>
+#include <vector>
+
+#ifdef WIN32
+  #include <winsock2.h>
+  #include <windows.h>
+#else
+  #include <pthread.h>
+#endif
+
+class Mutex
+{
+public:
+  Mutex();
+  ~Mutex();
+  void lock();
+  void unlock();
+
+private:
+  friend class Condition;
+#ifdef WIN32
+  CRITICAL_SECTION m_mutex;
+#else
+  pthread_mutex_t m_mutex;
+#endif
+
+  Mutex(const Mutex &);
+  Mutex &operator=(const Mutex &);
+};
+
+// Locks the mutex for the lifetime of the object
+class MutexLock
+{
+public:
+  MutexLock(Mutex &mutex) : m_mutex(mutex)
+  {
+    m_mutex.lock();
+  }
+  ~MutexLock()
+  {
+    m_mutex.unlock();
+  }
+
+private:
+  Mutex &m_mutex;
+
+  MutexLock(const MutexLock &);
+  MutexLock &operator=(const MutexLock &);
+};
+
+class Condition
+{
+public:
+  Condition();
+  ~Condition();
+  // Mutex must be locked by the caller
+  void wait(Mutex &mutex);
+  void signal();
+  void broadcast();
+
+private:
+#ifdef WIN32
+  CONDITION_VARIABLE m_cond;
+#else
+  pthread_cond_t m_cond;
+#endif
+
+  Condition(const Condition &);
+  Condition &operator=(const Condition &);
+};
+
+class Thread
+{
+public:
+  typedef void (*ThreadFunc)(void *arg);
+
+  Thread();
+  bool start(ThreadFunc func, void *arg);
+  void join();
+
+  // Number of online processors, at least 1
+  static int cpuCount();
+
+private:
+#ifdef WIN32
+  HANDLE m_thread;
+#else
+  pthread_t m_thread;
+#endif
+  bool m_running;
+};
+
+// Unit of work for a ThreadPool. A job either deletes itself or hands
+// itself back to its owner at the end of run(). The pool only deletes the
+// jobs still queued when it is stopped without taking them back.
+class Job
+{
+public:
+  virtual ~Job()
+  {
+  }
+  virtual void run() = 0;
+};
+
+class ThreadPool
+{
+public:
+  ThreadPool();
+  ~ThreadPool();
+
+  void start(int threads);
+  // Waits for running jobs, queued jobs are returned to the caller or
+  // deleted if unfinished is NULL
+  void stop(std::vector<Job *> *unfinished = NULL);
+
+  // Low priority jobs only run while no normal job is queued
+  void push(Job *job, bool lowPriority = false);
+  // Move a queued low priority job to the normal queue, false if not queued
+  bool promote(Job *job);
+
+  int threadCount() const
+  {
+    return (int)m_threads.size();
+  }
+
+private:
+  std::deque<Job *> m_queue;
+  std::deque<Job *> m_lowQueue;
+  std::vector<Thread *> m_threads;
+  Mutex m_mutex;
+  Condition m_cond;
+  bool m_running;
+
+  static void worker(void *arg);
+};
+
+#endif
@@ -31,8 +31,12 @@
   #include <crtdbg.h>
   #include <conio.h>
   #include <WinSock2.h>
+  #include <windows.h>
+  #include <malloc.h>
 #else
 #include <netinet/in.h>
+#include <dirent.h>
+#include <sys/time.h>
 #endif
 
 #include <cstdlib>
@@ -162,4 +166,86 @@ std::string dtos( double n )
   std::ostringstream result;
   result << n;
   return result.str();
-}
\ No newline at end of file
+}
+void *alignedAlloc(size_t size, size_t alignment)
+{
+#ifdef WIN32
+  return _aligned_malloc(size, alignment);
+#else
+  void *ptr = NULL;
+  if(posix_memalign(&ptr, alignment, size) != 0)
+    return NULL;
+  return ptr;
+#endif
+}
+
+void alignedFree(void *ptr)
+{
+#ifdef WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+bool listDirectory(const std::string &path, std::vector<std::string> &entries)
+{
+#ifdef WIN32
+  WIN32_FIND_DATAA findData;
+  HANDLE find = FindFirstFileA((path+"\\*").c_str(), &findData);
+  if(find == INVALID_HANDLE_VALUE)
+    return false;
+
+  do
+  {
+    std::string name = findData.cFileName;
+    if(name != "." && name != "..")
+      entries.push_back(name);
+  }
+  while(FindNextFileA(find, &findData));
+
+  FindClose(find);
+#else
+  DIR *dir = opendir(path.c_str());
+  if(dir == NULL)
+    return false;
+
+  struct dirent *entry;
+  while((entry = readdir(dir)) != NULL)
+  {
+    std::string name = entry->d_name;
+    if(name != "." && name != "..")
+      entries.push_back(name);
+  }
+
+  closedir(dir);
+#endif
+
+  return true;
+}
+
+uint64 milliTime()
+{
+#ifdef WIN32
+  return (uint64)GetTickCount64();
+#else
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (uint64)now.tv_sec*1000 + now.tv_usec/1000;
+#endif
+}
+
+uint64 microTime()
+{
+#ifdef WIN32
+  LARGE_INTEGER count, frequency;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&frequency);
+  return (uint64)(count.QuadPart/frequency.QuadPart*1000000 +
+                  count.QuadPart%frequency.QuadPart*1000000/frequency.QuadPart);
+#else
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (uint64)now.tv_sec*1000000 + now.tv_usec;
+#endif
+}
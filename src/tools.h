@@ -29,6 +29,8 @@
 #define _TOOLS_H
 
 #include <stdint.h>
+#include <string>
+#include <vector>
 
 #ifdef WIN32
   #include <winsock2.h>
@@ -63,6 +65,18 @@ std::string strToLower(std::string temp);
 
 std::string dtos(double n);
 
+//Aligned memory for the chunk arrays (free with alignedFree)
+void *alignedAlloc(size_t size, size_t alignment);
+void alignedFree(void *ptr);
+
+// Names in a directory without "." and ".."
+bool listDirectory(const std::string &path, std::vector<std::string> &entries);
+
+// Milliseconds from an arbitrary point, for measuring intervals
+uint64 milliTime();
+// Microseconds from an arbitrary point, for timing short work
+uint64 microTime();
+
 inline uint64 ntohll(uint64 v)
 {
   if(htons(1) == 1) // check if already big-endian
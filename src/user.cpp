@@ -46,6 +46,7 @@
 #include "logger.h"
 #include "tools.h"
 #include "map.h"
+#include "chunkprovider.h"
 #include "user.h"
 #include "nbt.h"
 #include "chat.h"
@@ -61,6 +62,7 @@ User::User(int sock, uint32 EID)
   this->fd              = sock;
   this->UID             = EID;
   this->logged          = false;
+  this->mapsArrived     = false;
   // ENABLED FOR DEBUG
   this->admin           = true;
 
@@ -407,6 +409,17 @@ bool User::updatePos(double x, double y, double z, double stance)
     }
   }
 
+  //Remember the movement for prefetching
+  uint64 now = milliTime();
+  if(posHistory.empty() || now-posHistory.back().time >= 100)
+  {
+    posSample sample = { now, x, z };
+    posHistory.push_back(sample);
+
+    while(posHistory.size() > 2 && now-posHistory.front().time > 2000)
+      posHistory.pop_front();
+  }
+
   this->pos.x      = x;
   this->pos.y      = y;
   this->pos.z      = z;
@@ -560,33 +573,137 @@ bool User::pushMap()
 {
   //Dont send all at once
   int maxcount = 10;
+
+  // Sort by distance from center
+  vec target(static_cast<int>(pos.x / 16),
+             static_cast<int>(pos.y / 16),
+             static_cast<int>(pos.z / 16));
+  sort(mapQueue.begin(), mapQueue.end(), DistanceComparator(target));
+
   // If map in queue, push it to client
-  while(this->mapQueue.size() > 0 && maxcount > 0)
+  for(unsigned int i = 0; i < mapQueue.size(); )
   {
+    int x = mapQueue[i].x();
+    int z = mapQueue[i].z();
+
+    // Still loading in the background, skip until it arrives
+    if(ChunkProvider::get().isEnabled() && !Map::get().getMapData(x, z, false) &&
+       !Map::get().thawMap(x, z))
+    {
+      ChunkProvider::get().request(x, z, true, User::mapReady, (void *)(size_t)UID);
+      i++;
+      continue;
+    }
+
+    // The rest on the next tick
+    if(maxcount == 0)
+    {
+      mapsArrived = true;
+      break;
+    }
     maxcount--;
-    // Sort by distance from center
-    vec target(static_cast<int>(pos.x / 16),
-               static_cast<int>(pos.y / 16),
-               static_cast<int>(pos.z / 16));
-    sort(mapQueue.begin(), mapQueue.end(), DistanceComparator(target));
 
-    Map::get().sendToUser(this, mapQueue[0].x(), mapQueue[0].z());
+    Map::get().sendToUser(this, x, z);
 
     // Add this to known list
-    addKnown(mapQueue[0].x(), mapQueue[0].z());
+    addKnown(x, z);
 
     // Remove from queue
-    mapQueue.erase(mapQueue.begin());
+    mapQueue.erase(mapQueue.begin()+i);
   }
 
   return true;
 }
 
+void User::prefetchMap()
+{
+  ChunkProvider &provider = ChunkProvider::get();
+
+  if(!provider.isEnabled() || posHistory.size() < 2)
+    return;
+
+  //No moves for a while, the player stopped or stopped sending them
+  if(milliTime()-posHistory.back().time > 500)
+  {
+    posHistory.clear();
+    return;
+  }
+
+  const posSample &first = posHistory.front();
+  const posSample &last  = posHistory.back();
+  double seconds         = (last.time-first.time)/1000.0;
+
+  //Blocks per second
+  double vx = (last.x-first.x)/seconds;
+  double vz = (last.z-first.z)/seconds;
+
+  //Walking players stay well inside the view square
+  double minSpeed = provider.prefetchSpeed();
+  if(vx*vx+vz*vz < minSpeed*minSpeed)
+    return;
+
+  int ahead = provider.prefetchSeconds();
+  int predX = blockToChunk((sint32)(last.x+vx*ahead));
+  int predZ = blockToChunk((sint32)(last.z+vz*ahead));
+
+  //View square around the predicted position, minus what is queued already
+  std::vector<vec> chunks;
+  for(int mapx = predX-viewDistance; mapx <= predX+viewDistance; mapx++)
+  {
+    for(int mapz = predZ-viewDistance; mapz <= predZ+viewDistance; mapz++)
+    {
+      if(abs(mapx-curChunk.x()) > viewDistance || abs(mapz-curChunk.z()) > viewDistance)
+        chunks.push_back(vec(mapx, 0, mapz));
+    }
+  }
+
+  //Closest first, those are needed first
+  sort(chunks.begin(), chunks.end(), DistanceComparator(curChunk));
+
+  for(unsigned int i = 0; i < chunks.size(); i++)
+    provider.prefetch(chunks[i].x(), chunks[i].z());
+}
+
+void User::mapReady(int x, int z, sChunk *chunk, void *arg)
+{
+  unsigned int UID = (unsigned int)(size_t)arg;
+
+  for(unsigned int i = 0; i < Users.size(); i++)
+  {
+    if(Users[i]->UID != UID)
+      continue;
+
+    User *user = Users[i];
+
+    // Failed chunks are not retried, handle them as sent like before
+    if(chunk == NULL)
+    {
+      for(unsigned int j = 0; j < user->mapQueue.size(); j++)
+      {
+        if(user->mapQueue[j].x() == x && user->mapQueue[j].z() == z)
+        {
+          user->addKnown(x, z);
+          user->mapQueue.erase(user->mapQueue.begin()+j);
+          break;
+        }
+      }
+    }
+
+    // Sent by the main loop, a poll finishing many loads must not bypass
+    // the throttle of pushMap
+    user->mapsArrived = true;
+    break;
+  }
+}
+
 bool User::teleport(double x, double y, double z)
 {
   buffer << (sint8)PACKET_PLAYER_POSITION_AND_LOOK << x << y << (double)0.0 << z 
     << (float)0.f << (float)0.f << (sint8)0;
 
+  //A jump is not movement
+  posHistory.clear();
+
   //Also update pos for other players
   updatePos(x, y, z, 0);
   return true;
@@ -35,6 +35,8 @@
 #include "constants.h"
 #include "packets.h"
 
+struct sChunk;
+
 struct position
 {
   double x;
@@ -45,6 +47,13 @@ struct position
   float pitch;
 };
 
+struct posSample
+{
+  uint64 time;
+  double x;
+  double z;
+};
+
 struct Item
 {
   sint16 type;
@@ -91,6 +100,12 @@ public:
   std::string nick;
   position pos;
   vec curChunk;
+
+  //Queued chunks are ready to send, pushed on the next tick
+  bool mapsArrived;
+
+  //Positions of the last two seconds for movement prediction, oldest first
+  std::deque<posSample> posHistory;
   Inventory inv;
 
   int recentSpawn[10];
@@ -143,9 +158,15 @@ public:
   //Push queued map data to client
   bool pushMap();
 
+  //Chunk load finished, arg is the UID of the waiting user
+  static void mapReady(int x, int z, sChunk *chunk, void *arg);
+
   //Push remove queued map data to client
   bool popMap();
 
+  //Load chunks ahead of a fast moving player in the background
+  void prefetchMap();
+
   bool teleport(double x, double y, double z);
   bool spawnUser(int x, int y, int z);
   bool spawnOthers();
@@ -0,0 +1,534 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#ifdef WIN32
+#include <noise/vectortable.h>
+#else
+#include <libnoise/vectortable.h>
+#endif
+
+#include "logger.h"
+#include "tools.h"
+#include "vectornoise.h"
+
+// Round every product and sum on its own as libnoise does, a fused
+// multiply-add or reordering would change the terrain
+#if defined(_MSC_VER)
+  #pragma float_control(precise, on)
+  #pragma fp_contract(off)
+#elif defined(__clang__)
+  #pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+  #pragma GCC optimize("fp-contract=off")
+#endif
+
+#if defined(__AVX__)
+  #define NOISE_AVX
+  #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #define NOISE_SSE2
+  #include <emmintrin.h>
+#endif
+
+// Lanes of the vector type, POINTS is a multiple of them
+#if defined(NOISE_AVX)
+typedef __m256d dvec;
+static const int LANES = 4;
+static inline dvec vLoad(const double *p)   { return _mm256_loadu_pd(p); }
+static inline void vStore(double *p, dvec a) { _mm256_storeu_pd(p, a); }
+static inline dvec vSet(double a)           { return _mm256_set1_pd(a); }
+static inline dvec vAdd(dvec a, dvec b)       { return _mm256_add_pd(a, b); }
+static inline dvec vSub(dvec a, dvec b)       { return _mm256_sub_pd(a, b); }
+static inline dvec vMul(dvec a, dvec b)       { return _mm256_mul_pd(a, b); }
+static inline dvec vAbs(dvec a)              { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+static inline bool vBelow(dvec a, double limit)
+{
+  return _mm256_movemask_pd(_mm256_cmp_pd(a, _mm256_set1_pd(limit), _CMP_LT_OQ)) == 0xf;
+}
+// (x > 0.0 ? (int)x : (int)x - 1) as doubles
+static inline dvec vFloor(dvec a)
+{
+  dvec whole    = _mm256_cvtepi32_pd(_mm256_cvttpd_epi32(a));
+  dvec positive = _mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_GT_OQ);
+  return _mm256_sub_pd(whole, _mm256_andnot_pd(positive, _mm256_set1_pd(1.0)));
+}
+static inline dvec vGather(const double *table, const int *index)
+{
+  return _mm256_set_pd(table[index[3]], table[index[2]], table[index[1]], table[index[0]]);
+}
+#elif defined(NOISE_SSE2)
+typedef __m128d dvec;
+static const int LANES = 2;
+static inline dvec vLoad(const double *p)   { return _mm_loadu_pd(p); }
+static inline void vStore(double *p, dvec a) { _mm_storeu_pd(p, a); }
+static inline dvec vSet(double a)           { return _mm_set1_pd(a); }
+static inline dvec vAdd(dvec a, dvec b)       { return _mm_add_pd(a, b); }
+static inline dvec vSub(dvec a, dvec b)       { return _mm_sub_pd(a, b); }
+static inline dvec vMul(dvec a, dvec b)       { return _mm_mul_pd(a, b); }
+static inline dvec vAbs(dvec a)              { return _mm_andnot_pd(_mm_set1_pd(-0.0), a); }
+static inline bool vBelow(dvec a, double limit)
+{
+  return _mm_movemask_pd(_mm_cmplt_pd(a, _mm_set1_pd(limit))) == 0x3;
+}
+static inline dvec vFloor(dvec a)
+{
+  dvec whole    = _mm_cvtepi32_pd(_mm_cvttpd_epi32(a));
+  dvec positive = _mm_cmpgt_pd(a, _mm_setzero_pd());
+  return _mm_sub_pd(whole, _mm_andnot_pd(positive, _mm_set1_pd(1.0)));
+}
+static inline dvec vGather(const double *table, const int *index)
+{
+  return _mm_loadh_pd(_mm_load_sd(table+index[0]), table+index[1]);
+}
+#else
+typedef double dvec;
+static const int LANES = 1;
+static inline dvec vLoad(const double *p)   { return *p; }
+static inline void vStore(double *p, dvec a) { *p = a; }
+static inline dvec vSet(double a)           { return a; }
+static inline dvec vAdd(dvec a, dvec b)       { return a + b; }
+static inline dvec vSub(dvec a, dvec b)       { return a - b; }
+static inline dvec vMul(dvec a, dvec b)       { return a * b; }
+static inline dvec vAbs(dvec a)              { return fabs(a); }
+static inline bool vBelow(dvec a, double limit) { return a < limit; }
+static inline dvec vFloor(dvec a)            { return a > 0.0 ? (int)a : (int)a - 1; }
+static inline dvec vGather(const double *table, const int *index) { return table[*index]; }
+#endif
+
+// Multipliers of libnoise's vector index hash
+static const uint32 NOISE_X    = 1619;
+static const uint32 NOISE_Y    = 31337;
+static const uint32 NOISE_Z    = 6971;
+static const uint32 NOISE_SEED = 1013;
+
+// noise::MakeInt32Range
+static inline dvec int32Range(dvec a)
+{
+  if(vBelow(vAbs(a), 1073741824.0))
+    return a;
+
+  double values[LANES];
+  vStore(values, a);
+  for(int i = 0; i < LANES; i++)
+    values[i] = noise::MakeInt32Range(values[i]);
+  return vLoad(values);
+}
+
+// SCurve3, SCurve5 or nothing as in noise::GradientCoherentNoise3D
+static inline dvec curve(dvec a, noise::NoiseQuality quality)
+{
+  switch(quality)
+  {
+  case noise::QUALITY_FAST:
+    return a;
+  case noise::QUALITY_BEST:
+    {
+      dvec a3 = vMul(vMul(a, a), a);
+      dvec a4 = vMul(a3, a);
+      dvec a5 = vMul(a4, a);
+      return vAdd(vSub(vMul(vSet(6.0), a5), vMul(vSet(15.0), a4)), vMul(vSet(10.0), a3));
+    }
+  default:
+    return vMul(vMul(a, a), vSub(vSet(3.0), vMul(vSet(2.0), a)));
+  }
+}
+
+// noise::LinearInterp
+static inline dvec lerp(dvec n0, dvec n1, dvec a)
+{
+  return vAdd(vMul(vSub(vSet(1.0), a), n0), vMul(a, n1));
+}
+
+// noise::GradientNoise3D of the corner offset from the cube origin with
+// hash, dx..dz are the distances to the corner
+static inline dvec gradient(const double (*gradients)[256], const uint32 *hash, uint32 offset,
+                           dvec dx, dvec dy, dvec dz)
+{
+  int index[LANES];
+  for(int i = 0; i < LANES; i++)
+  {
+    index[i] = (int)(hash[i] + offset);
+    index[i] ^= index[i] >> 8;
+    index[i] &= 0xff;
+  }
+  dvec gx = vGather(gradients[0], index);
+  dvec gy = vGather(gradients[1], index);
+  dvec gz = vGather(gradients[2], index);
+  return vMul(vAdd(vAdd(vMul(gx, dx), vMul(gy, dy)), vMul(gz, dz)), vSet(2.12));
+}
+
+// noise::GradientCoherentNoise3D of LANES points
+static dvec coherentLanes(const double (*gradients)[256], dvec x, dvec y, dvec z,
+                         int seed, noise::NoiseQuality quality)
+{
+  // Corners of the unit cube around each point
+  dvec x0 = vFloor(x);
+  dvec y0 = vFloor(y);
+  dvec z0 = vFloor(z);
+
+  double cx[LANES], cy[LANES], cz[LANES];
+  vStore(cx, x0);
+  vStore(cy, y0);
+  vStore(cz, z0);
+  uint32 hash[LANES];
+  for(int i = 0; i < LANES; i++)
+    hash[i] = NOISE_X*(uint32)(int)cx[i] + NOISE_Y*(uint32)(int)cy[i] + NOISE_Z*(uint32)(int)cz[i]
+              + NOISE_SEED*(uint32)seed;
+
+  dvec dx0 = vSub(x, x0);
+  dvec dx1 = vSub(x, vAdd(x0, vSet(1.0)));
+  dvec dy0 = vSub(y, y0);
+  dvec dy1 = vSub(y, vAdd(y0, vSet(1.0)));
+  dvec dz0 = vSub(z, z0);
+  dvec dz1 = vSub(z, vAdd(z0, vSet(1.0)));
+
+  dvec xs = curve(dx0, quality);
+  dvec ys = curve(dy0, quality);
+  dvec zs = curve(dz0, quality);
+
+  dvec ix0 = lerp(gradient(gradients, hash, 0, dx0, dy0, dz0),
+                 gradient(gradients, hash, NOISE_X, dx1, dy0, dz0), xs);
+  dvec ix1 = lerp(gradient(gradients, hash, NOISE_Y, dx0, dy1, dz0),
+                 gradient(gradients, hash, NOISE_X+NOISE_Y, dx1, dy1, dz0), xs);
+  dvec iy0 = lerp(ix0, ix1, ys);
+  ix0     = lerp(gradient(gradients, hash, NOISE_Z, dx0, dy0, dz1),
+                 gradient(gradients, hash, NOISE_X+NOISE_Z, dx1, dy0, dz1), xs);
+  ix1     = lerp(gradient(gradients, hash, NOISE_Y+NOISE_Z, dx0, dy1, dz1),
+                 gradient(gradients, hash, NOISE_X+NOISE_Y+NOISE_Z, dx1, dy1, dz1), xs);
+  dvec iy1 = lerp(ix0, ix1, ys);
+
+  return lerp(iy0, iy1, zs);
+}
+
+VectorNoise::VectorNoise() : m_ready(false)
+{
+  readGradients();
+  if(check())
+    m_ready = true;
+  else
+    LOG("Vector noise does not match libnoise, using libnoise");
+}
+
+void VectorNoise::readGradients()
+{
+  // Rows of x, y, z and padding
+  for(int index = 0; index < 256; index++)
+  {
+    for(int axis = 0; axis < 3; axis++)
+      m_gradients[axis][index] = noise::g_randomVectors[index*4+axis];
+  }
+}
+
+bool VectorNoise::check() const
+{
+  uint32 random = 12345;
+  double x[POINTS], y[POINTS], z[POINTS], values[POINTS];
+
+  // Single octaves around the cube corners, at whole numbers and far out
+  for(int round = 0; round < 3000; round++)
+  {
+    double scale = (round % 3 == 0) ? 8.0 : ((round % 3 == 1) ? 4096.0 : 1.0e9);
+    for(int i = 0; i < POINTS; i++)
+    {
+      double *p[3] = { &x[i], &y[i], &z[i] };
+      for(int axis = 0; axis < 3; axis++)
+      {
+        random = random*1103515245 + 12345;
+        *p[axis] = ((double)random/4294967296.0*2.0 - 1.0)*scale;
+        if((random >> 7) % 5 == 0)
+          *p[axis] = floor(*p[axis]);
+      }
+    }
+    random = random*1103515245 + 12345;
+    int seed = (int)random;
+    noise::NoiseQuality quality = (noise::NoiseQuality)(round % 3 == 2 ? (round/3) % 3 : noise::QUALITY_STD);
+
+    coherent(x, y, z, seed, quality, values);
+    for(int i = 0; i < POINTS; i++)
+    {
+      double expected = noise::GradientCoherentNoise3D(x[i], y[i], z[i], seed, quality);
+      if(memcmp(&expected, &values[i], sizeof(double)))
+        return false;
+    }
+  }
+
+  // Whole modules, the far points leave the 32-bit range in later octaves
+  noise::module::Perlin perlin;
+  noise::module::Billow billow;
+  perlin.SetPersistence(0.15);
+  billow.SetFrequency(1.5);
+  for(int round = 0; round < 200; round++)
+  {
+    double scale = (round & 1) ? 2000.0 : 1.0e8;
+    for(int i = 0; i < POINTS; i++)
+    {
+      random = random*1103515245 + 12345;
+      x[i] = ((double)random/4294967296.0*2.0 - 1.0)*scale;
+      y[i] = i*0.25;
+      random = random*1103515245 + 12345;
+      z[i] = ((double)random/4294967296.0*2.0 - 1.0)*scale;
+    }
+    perlin.SetSeed(round*7919);
+    billow.SetSeed(-round);
+
+    octaves(Octaves(perlin, false), x, y, z, values);
+    for(int i = 0; i < POINTS; i++)
+    {
+      double expected = perlin.GetValue(x[i], y[i], z[i]);
+      if(memcmp(&expected, &values[i], sizeof(double)))
+        return false;
+    }
+
+    octaves(Octaves(billow, true), x, y, z, values);
+    for(int i = 0; i < POINTS; i++)
+    {
+      double expected = billow.GetValue(x[i], y[i], z[i]);
+      if(memcmp(&expected, &values[i], sizeof(double)))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+void VectorNoise::coherent(const double *x, const double *y, const double *z,
+                           int seed, noise::NoiseQuality quality, double *values) const
+{
+  for(int i = 0; i < POINTS; i += LANES)
+    vStore(values+i, coherentLanes(m_gradients, vLoad(x+i), vLoad(y+i), vLoad(z+i), seed, quality));
+}
+
+void VectorNoise::octaves(const Octaves &module,
+                          const double *x, const double *y, const double *z, double *values) const
+{
+  const dvec frequency   = vSet(module.frequency);
+  const dvec lacunarity  = vSet(module.lacunarity);
+  const double persistence = module.persistence;
+  const int octaveCount = module.octaveCount;
+  const int seed        = module.seed;
+  const noise::NoiseQuality quality = module.quality;
+  const bool billow     = module.billow;
+
+  for(int i = 0; i < POINTS; i += LANES)
+  {
+    dvec px = vMul(vLoad(x+i), frequency);
+    dvec py = vMul(vLoad(y+i), frequency);
+    dvec pz = vMul(vLoad(z+i), frequency);
+    dvec value = vSet(0.0);
+    double curPersistence = 1.0;
+
+    for(int octave = 0; octave < octaveCount; octave++)
+    {
+      dvec signal = coherentLanes(m_gradients, int32Range(px), int32Range(py), int32Range(pz),
+                                 (seed + octave) & 0xffffffff, quality);
+      if(billow)
+        signal = vSub(vMul(vSet(2.0), vAbs(signal)), vSet(1.0));
+      value = vAdd(value, vMul(signal, vSet(curPersistence)));
+
+      px = vMul(px, lacunarity);
+      py = vMul(py, lacunarity);
+      pz = vMul(pz, lacunarity);
+      curPersistence *= persistence;
+    }
+
+    if(billow)
+      value = vAdd(value, vSet(0.5));
+    vStore(values+i, value);
+  }
+}
+
+void VectorModule::getValues(const noise::module::Module &module,
+                             const double *x, const double *y, const double *z,
+                             double *values, int count)
+{
+  const VectorModule *vector = dynamic_cast<const VectorModule *>(&module);
+  if(vector != NULL)
+    vector->getValues(x, y, z, values, count);
+  else
+  {
+    for(int i = 0; i < count; i++)
+      values[i] = module.GetValue(x[i], y[i], z[i]);
+  }
+}
+
+// Perlin or Billow values of count points, POINTS at a time
+static void octaveValues(const noise::module::Module &module, const VectorNoise::Octaves &settings,
+                         const double *x, const double *y, const double *z,
+                         double *values, int count)
+{
+  const VectorNoise &engine = VectorNoise::get();
+  if(!engine.ready())
+  {
+    for(int i = 0; i < count; i++)
+      values[i] = module.GetValue(x[i], y[i], z[i]);
+    return;
+  }
+
+  int i = 0;
+  for(; i + VectorNoise::POINTS <= count; i += VectorNoise::POINTS)
+    engine.octaves(settings, x+i, y+i, z+i, values+i);
+
+  if(i < count)
+  {
+    // Pad the last points with copies of the last one
+    double px[VectorNoise::POINTS], py[VectorNoise::POINTS], pz[VectorNoise::POINTS];
+    double last[VectorNoise::POINTS];
+    for(int j = 0; j < VectorNoise::POINTS; j++)
+    {
+      int point = (i+j < count) ? i+j : count-1;
+      px[j] = x[point];
+      py[j] = y[point];
+      pz[j] = z[point];
+    }
+    engine.octaves(settings, px, py, pz, last);
+    memcpy(values+i, last, (count-i)*sizeof(double));
+  }
+}
+
+template <class T, bool BILLOW>
+void VectorOctaveModule<T, BILLOW>::getValues(const double *x, const double *y, const double *z,
+                                              double *values, int count) const
+{
+  octaveValues(*this, m_octaves, x, y, z, values, count);
+}
+
+template class VectorOctaveModule<noise::module::Perlin, false>;
+template class VectorOctaveModule<noise::module::Billow, true>;
+
+void VectorScaleBias::getValues(const double *x, const double *y, const double *z,
+                                double *values, int count) const
+{
+  VectorModule::getValues(GetSourceModule(0), x, y, z, values, count);
+
+  const double scale = GetScale();
+  const double bias  = GetBias();
+  for(int i = 0; i < count; i++)
+    values[i] = values[i]*scale + bias;
+}
+
+// Values of module at the given points
+static void valuesAt(const noise::module::Module &module, const std::vector<int> &points,
+                     const double *x, const double *y, const double *z, std::vector<double> &values)
+{
+  const int count = (int)points.size();
+  values.resize(count);
+  if(!count)
+    return;
+
+  std::vector<double> coords(count*3);
+  for(int i = 0; i < count; i++)
+  {
+    coords[i]         = x[points[i]];
+    coords[count+i]   = y[points[i]];
+    coords[count*2+i] = z[points[i]];
+  }
+  VectorModule::getValues(module, &coords[0], &coords[count], &coords[count*2], &values[0], count);
+}
+
+void VectorSelect::getValues(const double *x, const double *y, const double *z,
+                             double *values, int count) const
+{
+  if(count <= 0)
+    return;
+
+  std::vector<double> control(count);
+  VectorModule::getValues(GetControlModule(), x, y, z, &control[0], count);
+
+  const double lower   = GetLowerBound();
+  const double upper   = GetUpperBound();
+  const double falloff = GetEdgeFalloff();
+
+  // Sort the points by the branch Select::GetValue takes: the first
+  // source, the second, or a blend starting from either of them
+  enum { FIRST, SECOND, FROM_FIRST, FROM_SECOND };
+  std::vector<char> branch(count);
+  std::vector<double> alpha(count);
+  std::vector<int> first, second;
+  for(int i = 0; i < count; i++)
+  {
+    const double controlValue = control[i];
+    if(falloff > 0.0)
+    {
+      if(controlValue < (lower - falloff))
+        branch[i] = FIRST;
+      else if(controlValue < (lower + falloff))
+      {
+        double lowerCurve = (lower - falloff);
+        double upperCurve = (lower + falloff);
+        alpha[i]  = noise::SCurve3((controlValue - lowerCurve) / (upperCurve - lowerCurve));
+        branch[i] = FROM_FIRST;
+      }
+      else if(controlValue < (upper - falloff))
+        branch[i] = SECOND;
+      else if(controlValue < (upper + falloff))
+      {
+        double lowerCurve = (upper - falloff);
+        double upperCurve = (upper + falloff);
+        alpha[i]  = noise::SCurve3((controlValue - lowerCurve) / (upperCurve - lowerCurve));
+        branch[i] = FROM_SECOND;
+      }
+      else
+        branch[i] = FIRST;
+    }
+    else
+      branch[i] = (controlValue < lower || controlValue > upper) ? FIRST : SECOND;
+
+    if(branch[i] != SECOND)
+      first.push_back(i);
+    if(branch[i] != FIRST)
+      second.push_back(i);
+  }
+
+  std::vector<double> firstValues, secondValues;
+  valuesAt(GetSourceModule(0), first, x, y, z, firstValues);
+  valuesAt(GetSourceModule(1), second, x, y, z, secondValues);
+
+  // Both lists are in point order, walk them together
+  size_t f = 0, s = 0;
+  for(int i = 0; i < count; i++)
+  {
+    switch(branch[i])
+    {
+    case FIRST:
+      values[i] = firstValues[f++];
+      break;
+    case SECOND:
+      values[i] = secondValues[s++];
+      break;
+    case FROM_FIRST:
+      values[i] = noise::LinearInterp(firstValues[f++], secondValues[s++], alpha[i]);
+      break;
+    default:
+      values[i] = noise::LinearInterp(secondValues[s++], firstValues[f++], alpha[i]);
+      break;
+    }
+  }
+}
@@ -0,0 +1,159 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VECTORNOISE_H
+#define _VECTORNOISE_H
+
+// libnoise modules that evaluate many points per call. The gradient noise
+// runs VectorNoise::POINTS points at a time in vector registers, AVX when
+// the compiler targets it, SSE2 on every x86-64 build, scalar otherwise.
+//
+// The results are bit-exact with libnoise: the gradient table is the one
+// of libnoise's vectortable.h and the noise is checked against libnoise
+// before first use. If anything differs (another libnoise, contracted
+// multiply-adds, ...) the modules fall back to the libnoise code.
+
+#ifdef WIN32
+#include <noise/noise.h>
+#else
+#include <libnoise/noise.h>
+#endif
+
+class VectorNoise
+{
+public:
+  enum { POINTS = 4 };
+
+  // Built on the first call, make that on the main thread
+  static VectorNoise &get()
+  {
+    static VectorNoise instance;
+    return instance;
+  }
+
+  // Whether the vector noise matched libnoise
+  bool ready() const { return m_ready; }
+
+  // noise::GradientCoherentNoise3D of POINTS points
+  void coherent(const double *x, const double *y, const double *z,
+                int seed, noise::NoiseQuality quality, double *values) const;
+
+  // Settings of a Perlin or Billow module. In libnoise both derive from
+  // Module only, so they are copied out of either.
+  struct Octaves
+  {
+    double frequency;
+    double lacunarity;
+    double persistence;
+    int octaveCount;
+    int seed;
+    noise::NoiseQuality quality;
+    bool billow;
+
+    template <class T>
+    Octaves(const T &module, bool billow)
+      : frequency(module.GetFrequency()), lacunarity(module.GetLacunarity()),
+        persistence(module.GetPersistence()), octaveCount(module.GetOctaveCount()),
+        seed(module.GetSeed()), quality(module.GetNoiseQuality()), billow(billow)
+    {
+    }
+  };
+
+  // GetValue of the Perlin or Billow module with these settings at POINTS
+  // points
+  void octaves(const Octaves &module,
+               const double *x, const double *y, const double *z, double *values) const;
+
+private:
+  VectorNoise();
+
+  void readGradients();
+  bool check() const;
+
+  // Components of libnoise's gradient vectors, x, y then z
+  double m_gradients[3][256];
+  bool m_ready;
+};
+
+// Modules that can evaluate count points at once, values[i] is
+// GetValue(x[i], y[i], z[i])
+class VectorModule
+{
+public:
+  virtual ~VectorModule() {}
+  virtual void getValues(const double *x, const double *y, const double *z,
+                         double *values, int count) const = 0;
+
+  // getValues of module when it is a VectorModule, GetValue otherwise
+  static void getValues(const noise::module::Module &module,
+                        const double *x, const double *y, const double *z,
+                        double *values, int count);
+};
+
+// Perlin or Billow module with its settings kept for the vector noise.
+// The setters hide the ones of the module, set them through this class.
+template <class T, bool BILLOW>
+class VectorOctaveModule : public T, public VectorModule
+{
+public:
+  VectorOctaveModule() : m_octaves(*this, BILLOW) {}
+
+  void SetFrequency(double frequency) { T::SetFrequency(frequency); update(); }
+  void SetLacunarity(double lacunarity) { T::SetLacunarity(lacunarity); update(); }
+  void SetNoiseQuality(noise::NoiseQuality quality) { T::SetNoiseQuality(quality); update(); }
+  void SetOctaveCount(int octaveCount) { T::SetOctaveCount(octaveCount); update(); }
+  void SetPersistence(double persistence) { T::SetPersistence(persistence); update(); }
+  void SetSeed(int seed) { T::SetSeed(seed); update(); }
+
+  virtual void getValues(const double *x, const double *y, const double *z,
+                         double *values, int count) const;
+
+private:
+  VectorNoise::Octaves m_octaves;
+
+  void update() { m_octaves = VectorNoise::Octaves(*this, BILLOW); }
+};
+
+typedef VectorOctaveModule<noise::module::Perlin, false> VectorPerlin;
+typedef VectorOctaveModule<noise::module::Billow, true> VectorBillow;
+
+class VectorScaleBias : public noise::module::ScaleBias, public VectorModule
+{
+public:
+  virtual void getValues(const double *x, const double *y, const double *z,
+                         double *values, int count) const;
+};
+
+// Evaluates each source module only at the points that need it
+class VectorSelect : public noise::module::Select, public VectorModule
+{
+public:
+  virtual void getValues(const double *x, const double *y, const double *z,
+                         double *values, int count) const;
+};
+
+#endif
@@ -0,0 +1,313 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Map generation benchmark. Generates, wraps and lights a fixed grid of
+// chunks for several seeds in noise and flatland mode on one thread, with
+// all generation stages on, and reports where the time and the
+// allocations go.
+
+#include <stdlib.h>
+#include <cstdio>
+#include <new>
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include "constants.h"
+#include "logger.h"
+#include "tools.h"
+#include "map.h"
+#include "chunk.h"
+#include "mapgen.h"
+#include "config.h"
+#include "nbt.h"
+
+namespace
+{
+
+// Calls and bytes of operator new. Plain counters, main sets
+// map_light_threads to 1 so nothing allocates outside the main thread.
+size_t allocations    = 0;
+size_t allocatedBytes = 0;
+
+}
+
+// All allocations go through the first and all frees through the last
+// replacement, the others forward to them
+void *operator new(size_t size)
+{
+  allocations++;
+  allocatedBytes += size;
+
+  void *ptr = malloc(size ? size : 1);
+  if(ptr == NULL)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete[](void *ptr) throw()
+{
+  operator delete(ptr);
+}
+
+// Sized deallocation of C++14, called instead of the above there
+#if __cplusplus >= 201402L
+void operator delete(void *ptr, size_t) throw()
+{
+  operator delete(ptr);
+}
+
+void operator delete[](void *ptr, size_t) throw()
+{
+  operator delete(ptr);
+}
+#endif
+
+void operator delete(void *ptr) throw()
+{
+  free(ptr);
+}
+
+namespace
+{
+
+struct sResult
+{
+  bool flatland;
+  int seed;
+  int chunks;
+  // Microseconds of each step
+  uint64 noise;
+  uint64 fill;
+  uint64 wrap;
+  uint64 light;
+  size_t allocations;
+  size_t allocatedBytes;
+
+  uint64 total() const
+  {
+    return noise+fill+wrap+light;
+  }
+
+  double chunksPerSecond() const
+  {
+    return total() ? chunks*1000000.0/total() : 0.0;
+  }
+};
+
+double ms(uint64 micros)
+{
+  return micros/1000.0;
+}
+
+// Chunks 0,0 to grid-1,grid-1 the way the server makes them: noise of
+// all chunks at once, the blocks of each, the chunk and its NBT, and the
+// light of all chunks with the faces stitched
+sResult run(bool flatland, int seed, int grid, std::string &stages)
+{
+  Conf::get().set("map_flatland", flatland ? "true" : "false");
+  MapGen gen(seed);
+
+  stages.clear();
+  for(unsigned int i = 0; i < gen.stages().size(); i++)
+    stages += std::string(i ? " " : "")+gen.stages()[i]->name();
+
+  sResult result;
+  result.flatland = flatland;
+  result.seed     = seed;
+  result.chunks   = grid*grid;
+
+  std::vector<float> heights(grid*grid*16*16);
+  std::vector<uint8> blocks(grid*grid*CHUNK_BLOCKS_SIZE);
+  std::vector<uint8> heightmaps(grid*grid*CHUNK_HEIGHTMAP_SIZE);
+  std::vector<uint8> skylight(grid*grid*CHUNK_NIBBLES_SIZE);
+  std::vector<uint32> mapIds;
+  mapIds.reserve(grid*grid);
+
+  size_t startAllocations = allocations;
+  size_t startBytes       = allocatedBytes;
+
+  uint64 start = microTime();
+  if(!flatland)
+    gen.buildHeightMaps(&heights[0], 0, 0, grid, grid);
+  uint64 noiseEnd = microTime();
+
+  for(int i = 0; i < grid*grid; i++)
+  {
+    gen.generate(&blocks[i*CHUNK_BLOCKS_SIZE], &heightmaps[i*CHUNK_HEIGHTMAP_SIZE],
+                 &skylight[i*CHUNK_NIBBLES_SIZE], i/grid, i%grid, flatland ? NULL : &heights[i*16*16]);
+  }
+  uint64 fillEnd = microTime();
+
+  std::vector<sChunk *> chunks;
+  chunks.reserve(grid*grid);
+  for(int i = 0; i < grid*grid; i++)
+  {
+    sChunk *chunk = MapGen::makeChunk(i/grid, i%grid, &blocks[i*CHUNK_BLOCKS_SIZE],
+                                      &heightmaps[i*CHUNK_HEIGHTMAP_SIZE], &skylight[i*CHUNK_NIBBLES_SIZE]);
+    delete chunk->toNBT();
+    chunks.push_back(chunk);
+  }
+  uint64 wrapEnd = microTime();
+
+  for(unsigned int i = 0; i < chunks.size(); i++)
+  {
+    uint32 mapId;
+    Map::get().posToId(chunks[i]->x, chunks[i]->z, &mapId);
+    Map::get().addMap(chunks[i]);
+    mapIds.push_back(mapId);
+  }
+  Map::get().lightMaps(mapIds, false);
+  Map::get().lightMaps(mapIds, true);
+  uint64 lightEnd = microTime();
+
+  result.noise          = noiseEnd-start;
+  result.fill           = fillEnd-noiseEnd;
+  result.wrap           = wrapEnd-fillEnd;
+  result.light          = lightEnd-wrapEnd;
+  result.allocations    = allocations-startAllocations;
+  result.allocatedBytes = allocatedBytes-startBytes;
+
+  // Not saved when released
+  for(int i = 0; i < grid*grid; i++)
+  {
+    Map::get().mapChanged[mapIds[i]] = 0;
+    Map::get().releaseMap(i/grid, i%grid);
+  }
+
+  return result;
+}
+
+void usage()
+{
+  std::cout << "Usage: mineserver-bench [-c config] [-g grid] [-s seed]... [-o file]" << std::endl <<
+               std::endl <<
+               "Generates, wraps and lights grid x grid chunks (default 16) for each seed, in" << std::endl <<
+               "noise and flatland mode with caves, ores and decorations, on one thread." << std::endl <<
+               "-o writes the results as CSV." << std::endl;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+  std::string configFile = CONFIGFILE;
+  std::string outFile;
+  int grid               = 16;
+  std::vector<int> seeds;
+
+  for(int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+
+    if(arg == "-c" && i+1 < argc)
+      configFile = argv[++i];
+    else if(arg == "-g" && i+1 < argc)
+      grid = atoi(argv[++i]);
+    else if(arg == "-s" && i+1 < argc)
+      seeds.push_back(atoi(argv[++i]));
+    else if(arg == "-o" && i+1 < argc)
+      outFile = argv[++i];
+    else
+    {
+      usage();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if(grid <= 0)
+  {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  // Fixed seeds, comparable between runs
+  if(seeds.empty())
+  {
+    seeds.push_back(12345678);
+    seeds.push_back(1);
+    seeds.push_back(987654321);
+  }
+
+  initConstants();
+  Conf::get().load(configFile);
+
+  // Same stages whatever the config says, the fill step times all of them.
+  // Light on this thread, see the allocation counters.
+  Conf::get().set("map_caves", "true");
+  Conf::get().set("map_ores", "true");
+  Conf::get().set("map_decorations", "true");
+  Conf::get().set("map_light_threads", "1");
+
+  std::vector<sResult> results;
+  std::string stages;
+  for(int mode = 0; mode < 2; mode++)
+  {
+    for(unsigned int i = 0; i < seeds.size(); i++)
+      results.push_back(run(mode == 1, seeds[i], grid, stages));
+  }
+
+  printf("%d chunks per run, stages: %s\n\n", grid*grid, stages.c_str());
+  printf("%-8s %11s %9s %9s %9s %9s %9s %12s %9s\n", "mode", "seed", "chunks/s", "noise ms", "fill ms",
+         "nbt ms", "light ms", "allocs/chunk", "KB/chunk");
+  for(unsigned int i = 0; i < results.size(); i++)
+  {
+    const sResult &r = results[i];
+    printf("%-8s %11d %9.1f %9.1f %9.1f %9.1f %9.1f %12.1f %9.1f\n", r.flatland ? "flatland" : "noise",
+           r.seed, r.chunksPerSecond(), ms(r.noise), ms(r.fill), ms(r.wrap), ms(r.light),
+           (double)r.allocations/r.chunks, r.allocatedBytes/1024.0/r.chunks);
+  }
+
+  if(!outFile.empty())
+  {
+    FILE *out = fopen(outFile.c_str(), "w");
+    if(out == NULL)
+    {
+      LOG("Unable to write " + outFile);
+      return EXIT_FAILURE;
+    }
+
+    fprintf(out, "mode,seed,chunks,stages,chunks_per_sec,noise_ms,fill_ms,nbt_ms,light_ms,allocs_per_chunk,"
+                 "alloc_bytes_per_chunk\n");
+    for(unsigned int i = 0; i < results.size(); i++)
+    {
+      const sResult &r = results[i];
+      fprintf(out, "%s,%d,%d,%s,%.1f,%.3f,%.3f,%.3f,%.3f,%.1f,%.0f\n", r.flatland ? "flatland" : "noise", r.seed,
+              r.chunks, stages.c_str(), r.chunksPerSecond(), ms(r.noise), ms(r.fill), ms(r.wrap), ms(r.light),
+              (double)r.allocations/r.chunks, (double)r.allocatedBytes/r.chunks);
+    }
+    fclose(out);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,392 @@
+/*
+   Copyright (c) 2010, The Mineserver Project
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+ * Neither the name of the The Mineserver Project nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Offline world pre-generation. Generates, lights and writes every missing
+// chunk of an area with the same code the server uses, so players do not
+// wait for new terrain. Stop the server before running it on its map.
+
+#include <stdlib.h>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include "constants.h"
+#include "logger.h"
+#include "tools.h"
+#include "map.h"
+#include "chunk.h"
+#include "mapgen.h"
+#include "journal.h"
+#include "config.h"
+#include "nbt.h"
+#include "thread.h"
+
+namespace
+{
+
+// Finished jobs, handed back to the main thread
+struct sResults
+{
+  Mutex mutex;
+  Condition cond;
+  std::vector<sChunk *> generated;
+  int written;
+  int failed;
+
+  sResults() : written(0), failed(0)
+  {
+  }
+};
+
+// Generates a run of chunks of a row, their noise is built in one pass
+class GenerateJob : public Job
+{
+public:
+  GenerateJob(sResults *results, int x, int z, int count) : results(results), x(x), z(z), count(count)
+  {
+  }
+
+  void run()
+  {
+    // The generator is shared by all threads
+    std::vector<sChunk *> chunks;
+    Map::get().mapGen->generateChunks(chunks, x, z, 1, count);
+
+    results->mutex.lock();
+    results->generated.insert(results->generated.end(), chunks.begin(), chunks.end());
+    results->cond.signal();
+    results->mutex.unlock();
+
+    delete this;
+  }
+
+private:
+  sResults *results;
+  int x;
+  int z;
+  int count;
+};
+
+// Serializes, compresses and writes a lit chunk, takes ownership
+class WriteJob : public Job
+{
+public:
+  WriteJob(sResults *results, sChunk *chunk) : results(results), chunk(chunk)
+  {
+  }
+
+  void run()
+  {
+    NBT_Value *root = chunk->toNBT();
+    bool ok         = Map::get().storage.saveChunk(chunk->x, chunk->z, root);
+    delete root;
+    delete chunk;
+
+    results->mutex.lock();
+    if(ok)
+      results->written++;
+    else
+      results->failed++;
+    results->mutex.unlock();
+
+    delete this;
+  }
+
+private:
+  sResults *results;
+  sChunk *chunk;
+};
+
+// Chunks of one x coordinate in the area
+struct sRow
+{
+  int x;
+  int z1;
+  int z2;
+  // Queued chunks not generated yet
+  int pending;
+  std::vector<int> generated;
+};
+
+// Hand copies of the chunks of a row to the writers
+void writeRow(ThreadPool &writers, sResults *results, const sRow &row)
+{
+  for(unsigned int i = 0; i < row.generated.size(); i++)
+  {
+    uint32 mapId;
+    Map::get().posToId(row.x, row.generated[i], &mapId);
+
+    writers.push(new WriteJob(results, Map::get().maps[mapId]->clone()));
+
+    // Written already, not again when released
+    Map::get().mapChanged[mapId] = 0;
+  }
+}
+
+void releaseRow(const sRow &row)
+{
+  for(unsigned int i = 0; i < row.generated.size(); i++)
+    Map::get().releaseMap(row.x, row.generated[i]);
+}
+
+void usage()
+{
+  std::cout << "Usage: mineserver-pregen [-c config] [-t threads] <radius>" << std::endl <<
+               "       mineserver-pregen [-c config] [-t threads] <x1> <z1> <x2> <z2>" << std::endl <<
+               std::endl <<
+               "Generates all missing chunks within radius chunks of the spawn, or" << std::endl <<
+               "in the rectangle between chunks x1,z1 and x2,z2. Existing chunks are kept." << std::endl;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+  std::string configFile = CONFIGFILE;
+  int threads            = 0;
+  std::vector<int> area;
+
+  for(int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+
+    if(arg == "-c" && i+1 < argc)
+      configFile = argv[++i];
+    else if(arg == "-t" && i+1 < argc)
+      threads = atoi(argv[++i]);
+    else if(arg.size() > 1 && arg[0] == '-' && (arg[1] < '0' || arg[1] > '9'))
+    {
+      usage();
+      return EXIT_FAILURE;
+    }
+    else
+      area.push_back(atoi(arg.c_str()));
+  }
+
+  if((area.size() != 1 || area[0] < 0) && area.size() != 4)
+  {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  initConstants();
+  Conf::get().load(configFile);
+  Map::get().initMap();
+
+  if(threads <= 0)
+    threads = Thread::cpuCount();
+
+  // Area as rows of chunks
+  std::vector<sRow> rows;
+  if(area.size() == 1)
+  {
+    int radius   = area[0];
+    int center_x = blockToChunk((sint32)Map::get().spawnPos.x());
+    int center_z = blockToChunk((sint32)Map::get().spawnPos.z());
+
+    for(int dx = -radius; dx <= radius; dx++)
+    {
+      int width = (int)sqrt((double)(radius*radius-dx*dx));
+      sRow row;
+      row.x       = center_x+dx;
+      row.z1      = center_z-width;
+      row.z2      = center_z+width;
+      row.pending = 0;
+      rows.push_back(row);
+    }
+  }
+  else
+  {
+    for(int x = std::min(area[0], area[2]); x <= std::max(area[0], area[2]); x++)
+    {
+      sRow row;
+      row.x       = x;
+      row.z1      = std::min(area[1], area[3]);
+      row.z2      = std::max(area[1], area[3]);
+      row.pending = 0;
+      rows.push_back(row);
+    }
+  }
+
+  int total = 0;
+  for(unsigned int i = 0; i < rows.size(); i++)
+    total += rows[i].z2-rows[i].z1+1;
+
+  std::cout << "Generating " << total << " chunks with " << threads << " threads" << std::endl;
+
+  sResults results;
+  ThreadPool generators;
+  ThreadPool writers;
+  generators.start(threads);
+  writers.start(threads);
+
+  if(generators.threadCount() == 0 || writers.threadCount() == 0)
+  {
+    LOG("Unable to start threads");
+    return EXIT_FAILURE;
+  }
+
+  // Enough queued chunks to keep the generators busy while lighting, in
+  // runs of up to maxBatch chunks
+  const int maxBatch  = 8;
+  const int maxQueued = threads*maxBatch*2;
+
+  uint64 startTime   = milliTime();
+  uint64 reportTime  = startTime;
+  int queued         = 0;
+  int skipped        = 0;
+  int generated      = 0;
+  unsigned int queueRow = 0;
+  int queueZ            = rows.empty() ? 0 : rows[0].z1;
+  unsigned int lightRow = 0;
+
+  while(lightRow < rows.size())
+  {
+    // Queue chunks in row order, missing ones only
+    while(queued < maxQueued && queueRow < rows.size())
+    {
+      sRow &row = rows[queueRow];
+
+      if(queueZ > row.z2)
+      {
+        if(++queueRow < rows.size())
+          queueZ = rows[queueRow].z1;
+        continue;
+      }
+
+      if(Map::get().storage.hasChunk(row.x, queueZ))
+      {
+        skipped++;
+        queueZ++;
+        continue;
+      }
+
+      // Missing chunks next to each other in one job
+      int count = 1;
+      while(count < maxBatch && queueZ+count <= row.z2 && !Map::get().storage.hasChunk(row.x, queueZ+count))
+        count++;
+
+      row.pending += count;
+      queued      += count;
+      generators.push(new GenerateJob(&results, row.x, queueZ, count));
+      queueZ += count;
+    }
+
+    // Take the generated chunks
+    std::vector<sChunk *> chunks;
+    results.mutex.lock();
+    while(queued > 0 && results.generated.empty())
+      results.cond.wait(results.mutex);
+    chunks.swap(results.generated);
+    results.mutex.unlock();
+
+    for(unsigned int i = 0; i < chunks.size(); i++)
+    {
+      sRow &row = rows[chunks[i]->x-rows[0].x];
+      row.pending--;
+      row.generated.push_back(chunks[i]->z);
+      queued--;
+      generated++;
+
+      Map::get().addMap(chunks[i]);
+    }
+
+    // Light a row once it and its neighbour rows are there and stitch it
+    // to the rows lit before. The light of the row before is final then,
+    // the row before that is not needed anymore.
+    while(lightRow < rows.size())
+    {
+      bool ready = true;
+      for(unsigned int i = (lightRow > 0) ? lightRow-1 : 0; i <= lightRow+1 && i < rows.size(); i++)
+      {
+        if(i >= queueRow || rows[i].pending)
+          ready = false;
+      }
+
+      if(!ready)
+        break;
+
+      sRow &row = rows[lightRow];
+      std::vector<uint32> mapIds;
+      for(unsigned int i = 0; i < row.generated.size(); i++)
+      {
+        uint32 mapId;
+        Map::get().posToId(row.x, row.generated[i], &mapId);
+        mapIds.push_back(mapId);
+      }
+      Map::get().lightMaps(mapIds, false);
+      Map::get().lightMaps(mapIds, true);
+
+      if(lightRow > 0)
+        writeRow(writers, &results, rows[lightRow-1]);
+      if(lightRow > 1)
+        releaseRow(rows[lightRow-2]);
+
+      lightRow++;
+    }
+
+    uint64 now = milliTime();
+    if(now-reportTime >= 1000)
+    {
+      reportTime = now;
+      printf("%d/%d chunks, %d existing, %.1f chunks/s\n", generated+skipped, total, skipped,
+             generated*1000.0/(double)(now-startTime));
+      fflush(stdout);
+    }
+  }
+
+  if(!rows.empty())
+  {
+    writeRow(writers, &results, rows[rows.size()-1]);
+    if(rows.size() > 1)
+      releaseRow(rows[rows.size()-2]);
+    releaseRow(rows[rows.size()-1]);
+  }
+
+  // Write what is still queued on this thread
+  std::vector<Job *> unfinished;
+  generators.stop();
+  writers.stop(&unfinished);
+  for(unsigned int i = 0; i < unfinished.size(); i++)
+    unfinished[i]->run();
+
+  double seconds = (milliTime()-startTime)/1000.0;
+  printf("Generated %d chunks in %.1f s, %.1f chunks/s, %d existing chunks kept\n", generated, seconds,
+         (seconds > 0) ? generated/seconds : 0.0, skipped);
+
+  if(results.failed)
+    printf("Failed to write %d chunks\n", results.failed);
+
+  Map::get().freeMap();
+  Journal::get().free();
+
+  return results.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}